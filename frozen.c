@@ -0,0 +1,588 @@
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "frozen.h"
+
+#define FROZEN_MAGIC "MAPFRZ01"
+
+//How many seeds to try before giving up. We only need a new one if two
+//keys in the same bucket have the same 64 bit hash.
+#define FROZEN_TRIES 8
+
+#define KIND_VAL  0
+#define KIND_PTR  1
+#define KIND_STR  2
+#define KIND_STRV 3
+
+typedef struct {
+    char magic[8];
+    uint32_t count;
+    uint32_t nbuckets;
+    uint64_t seed;
+    uint32_t key_kind;
+    uint32_t val_kind;
+    uint32_t key_sz;
+    uint32_t val_sz;
+    uint32_t rec_sz;
+    uint32_t val_off;
+    uint64_t recs_off; //These are offsets into the blob
+    uint64_t pool_off;
+    uint64_t blob_sz;
+} frozen_hdr;
+
+//What goes at the start of a record when the keys are STR or STRV.
+//Short keys fit right in the record, so comparing them doesn't need a
+//trip out to the pool.
+#define FROZEN_SHORT_KEY 12
+typedef struct {
+    uint32_t len;
+    union {
+        char bytes[FROZEN_SHORT_KEY];
+        uint32_t off; //Into the pool, if len > FROZEN_SHORT_KEY
+    };
+} frozen_vkey;
+
+static inline size_t round_up(size_t x, size_t a) {
+    return (x + a - 1) / a * a;
+}
+
+static inline int key_inline(unsigned kind) {
+    return kind == KIND_VAL || kind == KIND_PTR;
+}
+
+static inline int val_inline(unsigned kind) {
+    return kind == KIND_VAL;
+}
+
+//Boils any kind of key down to some bytes and a length. k is whatever
+//you'd pass to map_search (so for PTR and STR keys, it's the pointer
+//itself).
+static inline void key_bytes(
+    unsigned kind, unsigned key_sz, void const *k,
+    char const **p, uint32_t *len
+) {
+    switch (kind) {
+    case KIND_VAL:
+        *p = k;
+        *len = key_sz;
+        break;
+    case KIND_PTR:
+        *p = k;
+        *len = key_sz;
+        break;
+    case KIND_STR:
+        //map_str_hash treats NULL like an empty string, so we do too
+        *p = k ? k : "";
+        *len = strlen(*p);
+        break;
+    default: {
+        map_strv const *sv = k;
+        *p = sv->ptr;
+        *len = sv->len;
+        break;
+    }
+    }
+}
+
+//Same thing, for the key stored in a map entry
+static inline void entry_key_bytes(
+    map const *md, unsigned kind, void *e,
+    char const **p, uint32_t *len
+) {
+    void *pk = e + md->key_off;
+    key_bytes(kind, md->key_sz, md->key_is_ptr ? *(void**)pk : pk, p, len);
+}
+
+static inline uint64_t fmix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+//Same idea as map_strv_hash, but we keep all 64 bits: with 32 we'd
+//start seeing keys with the same hash (which can't be told apart by
+//any pilot) at around 64k keys.
+static uint64_t key_hash(char const *p, uint32_t len, uint64_t seed) {
+    uint64_t hash = 0xA5A5A5A5 ^ seed ^ len;
+
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ull;
+        hash ^= hash >> 29;
+        p += 8;
+        len -= 8;
+    }
+
+    if (len) {
+        uint64_t word = 0;
+        memcpy(&word, p, len);
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ull;
+        hash ^= hash >> 29;
+    }
+
+    return fmix64(hash);
+}
+
+//The top half of the hash picks the bucket...
+static inline uint32_t bucket_of(uint64_t h, uint32_t nbuckets) {
+    return ((h >> 32) * nbuckets) >> 32;
+}
+
+//...and the bucket's pilot scrambles the whole thing to pick the slot
+static inline uint32_t slot_of(uint64_t h, uint32_t pilot, uint32_t n) {
+    uint32_t x = fmix64(h ^ (pilot * 0x9E3779B97F4A7C15ull));
+    return ((uint64_t)x * n) >> 32;
+}
+
+//Finds a pilot for every bucket so that all n keys land in different
+//slots. Returns 0 on success or -1 if two keys in a bucket have the
+//same hash (so the caller should try another seed).
+static int find_pilots(uint64_t const *h, uint32_t n, uint32_t nb, uint32_t *pilots) {
+    uint32_t *start = calloc(nb + 1, sizeof(uint32_t));
+    uint32_t *cursor = malloc(nb * sizeof(uint32_t));
+    uint32_t *keys = malloc((n + 1) * sizeof(uint32_t));
+    uint32_t *order = malloc(nb * sizeof(uint32_t));
+    uint64_t *taken = calloc(n / 64 + 1, sizeof(uint64_t));
+    if (!start || !cursor || !keys || !order || !taken) FAST_FAIL("out of memory");
+
+    //Counting sort the keys by bucket
+    uint32_t i, b;
+    for (i = 0; i < n; i++) start[bucket_of(h[i], nb) + 1]++;
+    uint32_t biggest = 0;
+    for (b = 0; b < nb; b++) {
+        if (start[b + 1] > biggest) biggest = start[b + 1];
+        start[b + 1] += start[b];
+    }
+    memcpy(cursor, start, nb * sizeof(uint32_t));
+    for (i = 0; i < n; i++) keys[cursor[bucket_of(h[i], nb)]++] = i;
+
+    //And then the buckets by size, biggest first
+    uint32_t *by_size = calloc(biggest + 2, sizeof(uint32_t));
+    if (!by_size) FAST_FAIL("out of memory");
+    for (b = 0; b < nb; b++) by_size[biggest - (start[b + 1] - start[b]) + 1]++;
+    for (i = 0; i <= biggest; i++) by_size[i + 1] += by_size[i];
+    for (b = 0; b < nb; b++) order[by_size[biggest - (start[b + 1] - start[b])]++] = b;
+    free(by_size);
+
+    int rc = 0;
+    uint32_t j;
+    for (j = 0; j < nb; j++) {
+        b = order[j];
+        uint32_t *bk = keys + start[b];
+        uint32_t s = start[b + 1] - start[b];
+        if (s == 0) {
+            //Everything after this is empty too
+            pilots[b] = 0;
+            continue;
+        }
+
+        //No pilot can ever split up two keys with the same hash
+        uint32_t x, y;
+        for (x = 0; x < s; x++) {
+            for (y = x + 1; y < s; y++) {
+                if (h[bk[x]] == h[bk[y]]) {
+                    rc = -1;
+                    goto done;
+                }
+            }
+        }
+
+        uint32_t p;
+        for (p = 0; ; p++) {
+            for (i = 0; i < s; i++) {
+                uint32_t slot = slot_of(h[bk[i]], p, n);
+                if (taken[slot / 64] & (1ull << (slot % 64))) break;
+                taken[slot / 64] |= 1ull << (slot % 64);
+            }
+            if (i == s) break;
+
+            //Didn't fit; give back the slots we did get
+            while (i--) {
+                uint32_t slot = slot_of(h[bk[i]], p, n);
+                taken[slot / 64] &= ~(1ull << (slot % 64));
+            }
+            if (p == UINT32_MAX) {
+                rc = -1;
+                goto done;
+            }
+        }
+        pilots[b] = p;
+    }
+
+done:
+    free(start);
+    free(cursor);
+    free(keys);
+    free(order);
+    free(taken);
+    return rc;
+}
+
+//Any alignment a value of this size could need (sizeof is always a
+//multiple of the alignment)
+static unsigned val_align(unsigned val_sz) {
+    unsigned a = val_sz & -val_sz;
+    if (a == 0) return 1;
+    return a > 16 ? 16 : a;
+}
+
+//Sets up everything in fz that only depends on the kinds and sizes
+static void layout(frozen_map *fz, size_t pool_sz) {
+    unsigned key_part = key_inline(fz->key_kind) ? fz->key_sz : sizeof(frozen_vkey);
+    unsigned val_part, align;
+    if (val_inline(fz->val_kind)) {
+        val_part = fz->val_sz;
+        align = val_align(fz->val_sz);
+    } else {
+        val_part = sizeof(void*);
+        align = sizeof(void*);
+    }
+    if (!key_inline(fz->key_kind) && align < sizeof(uint32_t)) align = sizeof(uint32_t);
+
+    fz->val_off = round_up(key_part, align);
+    fz->rec_sz = round_up(fz->val_off + val_part, align);
+
+    //Keep the records and the pool 16-aligned within the blob
+    size_t recs_off = round_up((size_t)fz->nbuckets * sizeof(uint32_t), 16);
+    size_t pool_off = round_up(recs_off + (size_t)fz->count * fz->rec_sz, 16);
+    fz->blob_sz = pool_off + pool_sz;
+}
+
+//The pilots and records get read at random, so with millions of keys
+//a lookup was missing the TLB on both of them on top of missing the 
+//cache, and that was enough to make frozen_search slower than 
+//map_search at 10M keys. Big blobs get 2MB-aligned and we ask for huge
+//pages, which gets rid of most of those misses. If zero is set, the
+//blob comes back zeroed.
+#define FROZEN_HUGE_PAGE (2u << 20)
+static void *alloc_blob(size_t sz, int zero) {
+    if (sz < FROZEN_HUGE_PAGE) return zero ? calloc(sz, 1) : malloc(sz);
+
+    size_t rounded = round_up(sz, FROZEN_HUGE_PAGE);
+    void *p;
+    if (posix_memalign(&p, FROZEN_HUGE_PAGE, rounded)) return NULL;
+#ifdef MADV_HUGEPAGE
+    //Only a hint; if THP is off we just get normal pages
+    madvise(p, rounded, MADV_HUGEPAGE);
+#endif
+    if (zero) memset(p, 0, sz);
+    return p;
+}
+
+static void carve(frozen_map *fz) {
+    size_t recs_off = round_up((size_t)fz->nbuckets * sizeof(uint32_t), 16);
+    size_t pool_off = round_up(recs_off + (size_t)fz->count * fz->rec_sz, 16);
+    fz->pilots = fz->blob;
+    fz->recs = fz->blob + recs_off;
+    fz->pool = fz->blob + pool_off;
+}
+
+int map_freeze(map const *md, frozen_map *fz) {
+    *fz = (frozen_map) {0};
+
+    if (md->key_comp == map_val_comp) fz->key_kind = KIND_VAL;
+    else if (md->key_comp == map_ptr_comp) fz->key_kind = KIND_PTR;
+    else if (md->key_comp == map_str_comp) fz->key_kind = KIND_STR;
+    else if (md->key_comp == map_strv_comp) fz->key_kind = KIND_STRV;
+    else return -1;
+
+    if (!md->val_is_ptr) fz->val_kind = KIND_VAL;
+    else if (md->val_comp == map_str_comp) fz->val_kind = KIND_STR;
+    else fz->val_kind = KIND_PTR;
+
+    fz->key_sz = md->key_sz;
+    fz->val_sz = md->val_sz;
+    fz->count = md->count;
+    fz->nbuckets = fz->count / FROZEN_LAMBDA + 1;
+
+    uint32_t n = fz->count;
+    void **ents = malloc((n + 1) * sizeof(void*));
+    uint64_t *h = malloc((n + 1) * sizeof(uint64_t));
+    if (!ents || !h) FAST_FAIL("out of memory");
+
+    //Grab the entries and work out how big the pool has to be. PTR
+    //values go first so they can be aligned, and then everything else.
+    unsigned va = val_align(fz->val_sz);
+    size_t vals_sz = 0, bytes_sz = 0;
+    uint32_t i = 0;
+    map_iter it;
+    for (it = map_begin(md); it != map_end(md); map_iter_step(it)) {
+        void *e = (void*)it - md->list_head_off;
+        ents[i++] = e;
+
+        char const *p;
+        uint32_t len;
+        entry_key_bytes(md, fz->key_kind, e, &p, &len);
+        if (!key_inline(fz->key_kind) && len > FROZEN_SHORT_KEY) bytes_sz += len;
+
+        void *pv = md->boxes ? *(void**)(e + md->val_off) : e + md->val_off;
+        char const *v = val_inline(fz->val_kind) ? NULL : *(char const **)pv;
+        if (v && fz->val_kind == KIND_PTR) vals_sz = round_up(vals_sz, va) + fz->val_sz;
+        if (v && fz->val_kind == KIND_STR) bytes_sz += strlen(v) + 1;
+    }
+    vals_sz = round_up(vals_sz, 16);
+
+    //Long keys are found by a 32 bit offset into the pool
+    if (!key_inline(fz->key_kind) && vals_sz + bytes_sz > UINT32_MAX) {
+        free(ents);
+        free(h);
+        return -1;
+    }
+
+    int tries;
+    for (tries = 0; tries < FROZEN_TRIES; tries++) {
+        fz->seed = __map_random_seed();
+        for (i = 0; i < n; i++) {
+            char const *p;
+            uint32_t len;
+            entry_key_bytes(md, fz->key_kind, ents[i], &p, &len);
+            h[i] = key_hash(p, len, fz->seed);
+        }
+
+        layout(fz, vals_sz + bytes_sz);
+        fz->blob = alloc_blob(fz->blob_sz, 1);
+        if (!fz->blob) FAST_FAIL("out of memory");
+        carve(fz);
+        if (find_pilots(h, n, fz->nbuckets, fz->pilots) == 0) break;
+        free(fz->blob);
+        fz->blob = NULL;
+    }
+    if (!fz->blob) {
+        free(ents);
+        free(h);
+        return -1;
+    }
+
+    //Now every key knows its slot, so fill in the records
+    char *vals = fz->pool, *bytes = fz->pool + vals_sz;
+    for (i = 0; i < n; i++) {
+        void *e = ents[i];
+        uint32_t slot = slot_of(h[i], fz->pilots[bucket_of(h[i], fz->nbuckets)], n);
+        void *rec = fz->recs + (size_t)slot * fz->rec_sz;
+
+        char const *p;
+        uint32_t len;
+        entry_key_bytes(md, fz->key_kind, e, &p, &len);
+        if (key_inline(fz->key_kind)) {
+            memcpy(rec, p, len);
+        } else {
+            frozen_vkey *vk = rec;
+            vk->len = len;
+            if (len <= FROZEN_SHORT_KEY) {
+                memcpy(vk->bytes, p, len);
+            } else {
+                vk->off = bytes - fz->pool;
+                memcpy(bytes, p, len);
+                bytes += len;
+            }
+        }
+
+        void *pv = md->boxes ? *(void**)(e + md->val_off) : e + md->val_off;
+        if (val_inline(fz->val_kind)) {
+            memcpy(rec + fz->val_off, pv, fz->val_sz);
+            continue;
+        }
+        char const *v = *(char const **)pv;
+        char *copy = NULL;
+        if (v && fz->val_kind == KIND_PTR) {
+            copy = fz->pool + round_up(vals - fz->pool, va);
+            memcpy(copy, v, fz->val_sz);
+            vals = copy + fz->val_sz;
+        } else if (v) {
+            size_t vlen = strlen(v) + 1;
+            copy = bytes;
+            memcpy(copy, v, vlen);
+            bytes += vlen;
+        }
+        memcpy(rec + fz->val_off, &copy, sizeof(void*));
+    }
+
+    free(ents);
+    free(h);
+    return 0;
+}
+
+void *frozen_search(frozen_map const *fz, void const *k) {
+    if (!fz->count) return NULL;
+
+    char const *p;
+    uint32_t len;
+    key_bytes(fz->key_kind, fz->key_sz, k, &p, &len);
+    uint64_t h = key_hash(p, len, fz->seed);
+    uint32_t pilot = fz->pilots[bucket_of(h, fz->nbuckets)];
+    void *rec = fz->recs + (size_t)slot_of(h, pilot, fz->count) * fz->rec_sz;
+
+    if (key_inline(fz->key_kind)) {
+        if (memcmp(rec, p, len)) return NULL;
+    } else {
+        frozen_vkey const *vk = rec;
+        if (vk->len != len) return NULL;
+        char const *stored = len <= FROZEN_SHORT_KEY ? vk->bytes : fz->pool + vk->off;
+        if (memcmp(stored, p, len)) return NULL;
+    }
+    return rec + fz->val_off;
+}
+
+void frozen_free(frozen_map *fz) {
+    free(fz->blob);
+    *fz = (frozen_map) {0};
+}
+
+int frozen_save(frozen_map const *fz, char const *path) {
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, PATH_MAX, "%s.tmp", path) >= PATH_MAX) return -1;
+
+    FILE *f = fopen(tmp, "w");
+    if (!f) return -1;
+    setvbuf(f, NULL, _IOFBF, 1 << 20);
+
+    frozen_hdr hdr = {
+        .count = fz->count,
+        .nbuckets = fz->nbuckets,
+        .seed = fz->seed,
+        .key_kind = fz->key_kind,
+        .val_kind = fz->val_kind,
+        .key_sz = fz->key_sz,
+        .val_sz = fz->val_sz,
+        .rec_sz = fz->rec_sz,
+        .val_off = fz->val_off,
+        .recs_off = fz->recs - fz->blob,
+        .pool_off = (void*)fz->pool - fz->blob,
+        .blob_sz = fz->blob_sz
+    };
+    memcpy(hdr.magic, FROZEN_MAGIC, 8);
+    fwrite(&hdr, sizeof(hdr), 1, f);
+
+    if (val_inline(fz->val_kind)) {
+        fwrite(fz->blob, fz->blob_sz, 1, f);
+    } else {
+        //Pointers into the pool get saved as offsets plus one (so that
+        //0 can still be NULL)
+        fwrite(fz->blob, hdr.recs_off, 1, f);
+        char *rec = malloc(fz->rec_sz);
+        if (!rec) FAST_FAIL("out of memory");
+        uint32_t i;
+        for (i = 0; i < fz->count; i++) {
+            memcpy(rec, fz->recs + (size_t)i * fz->rec_sz, fz->rec_sz);
+            char *v;
+            memcpy(&v, rec + fz->val_off, sizeof(void*));
+            uintptr_t off = v ? (uintptr_t)(v - fz->pool) + 1 : 0;
+            memcpy(rec + fz->val_off, &off, sizeof(void*));
+            fwrite(rec, fz->rec_sz, 1, f);
+        }
+        free(rec);
+        size_t recs_end = hdr.recs_off + (size_t)fz->count * fz->rec_sz;
+        fwrite(fz->blob + recs_end, fz->blob_sz - recs_end, 1, f);
+    }
+
+    int rc = (fflush(f) == 0 && !ferror(f) && fsync(fileno(f)) == 0) ? 0 : -1;
+    if (fclose(f) != 0) rc = -1;
+    if (rc == 0) rc = rename(tmp, path);
+    if (rc < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *dst, size_t n) {
+    while (n) {
+        ssize_t rc = read(fd, dst, n);
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (rc == 0) return -1;
+        dst += rc;
+        n -= rc;
+    }
+    return 0;
+}
+
+//Checks that everything in the records points somewhere inside the
+//pool, and turns saved value offsets back into pointers
+static int fix_records(frozen_map *fz, size_t pool_sz) {
+    if (key_inline(fz->key_kind) && val_inline(fz->val_kind)) return 0;
+
+    uint32_t i;
+    for (i = 0; i < fz->count; i++) {
+        void *rec = fz->recs + (size_t)i * fz->rec_sz;
+        if (!key_inline(fz->key_kind)) {
+            frozen_vkey const *vk = rec;
+            if (vk->len > FROZEN_SHORT_KEY && (uint64_t)vk->off + vk->len > pool_sz) return -1;
+        }
+        if (val_inline(fz->val_kind)) continue;
+
+        uintptr_t off;
+        memcpy(&off, rec + fz->val_off, sizeof(void*));
+        char *v = NULL;
+        if (off) {
+            off--;
+            if (fz->val_kind == KIND_PTR && (off > pool_sz || pool_sz - off < fz->val_sz)) return -1;
+            if (fz->val_kind == KIND_STR && (off >= pool_sz || !memchr(fz->pool + off, 0, pool_sz - off))) return -1;
+            v = fz->pool + off;
+        }
+        memcpy(rec + fz->val_off, &v, sizeof(void*));
+    }
+    return 0;
+}
+
+int frozen_load(frozen_map *fz, char const *path) {
+    *fz = (frozen_map) {0};
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    frozen_hdr hdr;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || read_all(fd, &hdr, sizeof(hdr)) < 0) goto fail;
+    if (memcmp(hdr.magic, FROZEN_MAGIC, 8)) goto fail;
+    if (hdr.key_kind > KIND_STRV || hdr.val_kind > KIND_STR) goto fail;
+    if ((uint64_t)st.st_size != sizeof(hdr) + hdr.blob_sz) goto fail;
+    if (hdr.nbuckets != hdr.count / FROZEN_LAMBDA + 1) goto fail;
+    if (key_inline(hdr.key_kind) && hdr.key_sz > hdr.rec_sz) goto fail;
+
+    fz->count = hdr.count;
+    fz->nbuckets = hdr.nbuckets;
+    fz->seed = hdr.seed;
+    fz->key_kind = hdr.key_kind;
+    fz->val_kind = hdr.val_kind;
+    fz->key_sz = hdr.key_sz;
+    fz->val_sz = hdr.val_sz;
+
+    //Rather than trusting the offsets in the file, work them out again
+    //and make sure they agree
+    if (hdr.blob_sz < hdr.pool_off) goto fail;
+    size_t pool_sz = hdr.blob_sz - hdr.pool_off;
+    layout(fz, pool_sz);
+    if (fz->rec_sz != hdr.rec_sz || fz->val_off != hdr.val_off || fz->blob_sz != hdr.blob_sz) goto fail;
+
+    fz->blob = alloc_blob(fz->blob_sz, 0);
+    if (!fz->blob) FAST_FAIL("out of memory");
+    carve(fz);
+    if ((uint64_t)((void*)fz->recs - fz->blob) != hdr.recs_off) goto fail;
+    if ((uint64_t)((void*)fz->pool - fz->blob) != hdr.pool_off) goto fail;
+    if (read_all(fd, fz->blob, fz->blob_sz) < 0) goto fail;
+    close(fd);
+    fd = -1;
+
+    if (fix_records(fz, pool_sz) < 0) goto fail;
+    return 0;
+
+fail:
+    if (fd >= 0) close(fd);
+    frozen_free(fz);
+    return -1;
+}
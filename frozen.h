@@ -0,0 +1,83 @@
+#ifndef FROZEN_H
+#define FROZEN_H 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include "map.h"
+
+//A read-only copy of a map, for maps that get built once and then only
+//searched. map_freeze builds a minimal perfect hash over the keys, so
+//every key gets its own slot in a dense array of n records and a
+//lookup is always: hash the key, read one pilot, read one record,
+//compare one key. There are no chains, no empty slots and no
+//list_heads; the only overhead is 4 bytes of pilot per FROZEN_LAMBDA
+//keys (plus alignment padding in the records).
+//
+//The hash is CHD-style: keys are split into buckets by hash, and each
+//bucket gets a pilot (found by trial and error when freezing) that
+//moves all of its keys to free slots at once. Biggest buckets go
+//first, while there's still lots of room.
+//
+//The frozen copy owns everything it points to, so the map can be freed
+//(or keep changing) afterwards. Keys have to use the built-in compare
+//functions, since the frozen copy compares bytes. PTR keys and values
+//get copied (key_sz/val_sz bytes of whatever they point at), and STR
+//ones get copied up to their NUL.
+
+//Average number of keys per bucket. Bigger buckets mean less memory
+//for pilots, but they take longer to place.
+#define FROZEN_LAMBDA 3
+
+typedef struct {
+    uint32_t count;
+    uint32_t nbuckets;
+    uint64_t seed;
+
+    //What the keys and values were in the original map
+    unsigned key_kind;
+    unsigned val_kind;
+    unsigned key_sz; //Bytes of key in each record, if they're inline
+    unsigned val_sz; //Bytes of value (or what a PTR value points to)
+
+    //Each record is the key (inline, or an offset and length into the
+    //pool) followed by the value (inline, or a pointer into the pool)
+    unsigned rec_sz;
+    unsigned val_off;
+
+    //pilots, recs and pool are all carved out of one allocation, which
+    //is also exactly what gets saved (with pool pointers turned into
+    //offsets)
+    uint32_t *pilots;
+    void *recs;
+    char *pool;
+    void *blob;
+    size_t blob_sz;
+} frozen_map;
+
+//Builds a frozen copy of md. Returns 0 on success, or negative if md's
+//keys use a custom compare function, if the keys are STR or STRV and 
+//the pool would pass 4GB (long keys are stored as a 32 bit offset into
+//it), or if we somehow couldn't find a perfect hash. md isn't changed.
+int map_freeze(map const *md, frozen_map *fz);
+
+//Same arguments and return value as map_search (so for STR values you
+//get back a char const**). The returned pointer is good until
+//frozen_free.
+void *frozen_search(frozen_map const *fz, void const *key);
+
+#define frozen_count(fz) ((fz)->count)
+
+//Writes fz to path, which is replaced atomically. Returns 0 on success
+//or negative on error.
+int frozen_save(frozen_map const *fz, char const *path);
+
+//Reads back something frozen_save wrote. This is one read into one
+//allocation, plus a pass to fix up pointers if the values are PTR or
+//STR, so it's a lot faster than rebuilding. Returns 0 on success or
+//negative if the file is missing or doesn't look right. The file has
+//to come from a machine with the same endianness and pointer size.
+int frozen_load(frozen_map *fz, char const *path);
+
+void frozen_free(frozen_map *fz);
+
+#endif
@@ -0,0 +1,189 @@
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "map.h"
+#include "kv.h"
+#include "fast_fail.h"
+
+void kv_init(kv *db) {
+    map_init(&db->m, char const*, uint32_t, STR2VAL);
+    db->log = NULL;
+}
+
+void kv_free(kv *db) {
+    map_free(&db->m);
+}
+
+//Just the map half of a set. Returns 1 if key was new.
+static int put(kv *db, char const *key, uint32_t val) {
+    char *copied = strdup(key);
+    if (!copied) FAST_FAIL("out of memory");
+    int inserted;
+    uint32_t *slot = map_emplace(&db->m, copied, 1, &inserted);
+    *slot = val;
+    //If the key was already there, the map kept its own copy
+    if (!inserted) free(copied);
+    return inserted;
+}
+
+int kv_set(kv *db, char const *key, uint32_t val) {
+    if (db->log && wal_log_set(db->log, key, val) < 0) return -1;
+    int inserted = put(db, key, val);
+    if (db->log) wal_maybe_compact(db->log, &db->m);
+    return inserted;
+}
+
+int kv_mset(kv *db, char const *const *keys, uint32_t const *vals, unsigned n) {
+    if (db->log && wal_log_sets(db->log, keys, vals, n) < 0) return -1;
+    unsigned i;
+    int inserted = 0;
+    for (i = 0; i < n; i++) inserted += put(db, keys[i], vals[i]);
+    if (db->log) wal_maybe_compact(db->log, &db->m);
+    return inserted;
+}
+
+int kv_del(kv *db, char const *key) {
+    //Don't bother logging deletes that wouldn't do anything
+    if (!map_search(&db->m, key)) return 1;
+    if (db->log && wal_log_del(db->log, key) < 0) return -1;
+    int rc = map_search_delete(&db->m, key, NULL);
+    if (db->log) wal_maybe_compact(db->log, &db->m);
+    return rc;
+}
+
+void kv_out_append(kv_out *out, char const *p, size_t n) {
+    if (out->len + n > out->cap) {
+        size_t cap = out->cap ? out->cap : 4096;
+        while (cap < out->len + n) cap *= 2;
+        out->buf = realloc(out->buf, cap);
+        if (!out->buf) FAST_FAIL("out of memory");
+        out->cap = cap;
+    }
+    memcpy(out->buf + out->len, p, n);
+    out->len += n;
+}
+
+#define out_str(out, s) kv_out_append((out), (s), strlen(s))
+
+static void out_val(kv_out *out, uint32_t const *val) {
+    if (val) {
+        char num[16];
+        kv_out_append(out, num, sprintf(num, "%d", (int) *val));
+    } else {
+        out_str(out, "(null)");
+    }
+}
+
+//Splits line on spaces in place. Returns the number of words found, 
+//or -1 if there were more than max.
+static int split(char *line, char **words, int max) {
+    int n = 0;
+    char *p = line;
+    for (;;) {
+        while (*p == ' ' || *p == '\t' || *p == '\r') *p++ = '\0';
+        if (!*p) return n;
+        if (n == max) return -1;
+        words[n++] = p;
+        while (*p && *p != ' ' && *p != '\t' && *p != '\r') p++;
+    }
+}
+
+//Longest key the log can hold
+#define KEY_MAX 255
+
+static int parse_val(char const *s, uint32_t *val) {
+    char *end;
+    long v = strtol(s, &end, 10);
+    if (end == s || *end) return -1;
+    *val = v;
+    return 0;
+}
+
+#define MAX_WORDS 1024
+
+void kv_exec(kv *db, char *line, kv_out *out) {
+    char *w[MAX_WORDS];
+    int n = split(line, w, MAX_WORDS);
+    int i;
+
+    if (n < 0) {
+        out_str(out, "Error too many arguments\n");
+        return;
+    } else if (n == 0) {
+        out_str(out, "Error empty command\n");
+        return;
+    }
+    for (i = 1; i < n; i++) {
+        if (strlen(w[i]) > KEY_MAX) {
+            out_str(out, "Error key too long\n");
+            return;
+        }
+    }
+
+    if (!strcmp(w[0], "set")) {
+        uint32_t val;
+        if (n != 3 || parse_val(w[2], &val) < 0) {
+            out_str(out, "Error usage: set key value\n");
+            return;
+        }
+        int rc = kv_set(db, w[1], val);
+        out_str(out, rc > 0 ? "Written\n" : rc == 0 ? "Overwritten\n" : "Error log failed\n");
+    } else if (!strcmp(w[0], "get")) {
+        if (n != 2) {
+            out_str(out, "Error usage: get key\n");
+            return;
+        }
+        out_val(out, kv_get(db, w[1]));
+        out_str(out, "\n");
+    } else if (!strcmp(w[0], "delk")) {
+        if (n != 2) {
+            out_str(out, "Error usage: delk key\n");
+            return;
+        }
+        int rc = kv_del(db, w[1]);
+        out_str(out, rc == 0 ? "Deleted\n" : rc > 0 ? "Not found\n" : "Error log failed\n");
+    } else if (!strcmp(w[0], "mget")) {
+        if (n < 2) {
+            out_str(out, "Error usage: mget key...\n");
+            return;
+        }
+        for (i = 1; i < n; i++) {
+            if (i > 1) out_str(out, " ");
+            out_val(out, kv_get(db, w[i]));
+        }
+        out_str(out, "\n");
+    } else if (!strcmp(w[0], "mset")) {
+        char const *keys[MAX_WORDS/2];
+        uint32_t vals[MAX_WORDS/2];
+        //Check everything first so a bad pair doesn't leave half of 
+        //the command applied
+        if (n < 3 || n % 2 == 0) {
+            out_str(out, "Error usage: mset key value...\n");
+            return;
+        }
+        for (i = 1; i < n; i += 2) {
+            keys[i/2] = w[i];
+            if (parse_val(w[i+1], &vals[i/2]) < 0) {
+                out_str(out, "Error usage: mset key value...\n");
+                return;
+            }
+        }
+        if (kv_mset(db, keys, vals, n/2) < 0) {
+            out_str(out, "Error log failed\n");
+            return;
+        }
+        char msg[32];
+        kv_out_append(out, msg, sprintf(msg, "Stored %d\n", n / 2));
+    } else if (n == 1) {
+        if (strlen(w[0]) > KEY_MAX) {
+            out_str(out, "Error key too long\n");
+            return;
+        }
+        out_val(out, kv_get(db, w[0]));
+        out_str(out, "\n");
+    } else {
+        out_str(out, "Error unknown command\n");
+    }
+}
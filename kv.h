@@ -0,0 +1,56 @@
+#ifndef KV_H
+#define KV_H 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include "map.h"
+#include "wal.h"
+
+//The key-value store behind main.c: a STR2VAL map from strings to 
+//uint32_t, plus an optional write-ahead log. Both the stdin REPL and 
+//the socket server go through these so that every mutation ends up 
+//in the log.
+typedef struct {
+    map m;
+    wal *log; //NULL when not logging
+} kv;
+
+void kv_init(kv *db);
+void kv_free(kv *db);
+
+//Returns 1 if key was new, 0 if it was overwritten, or negative if the
+//log is broken (in which case the map is left alone). The store makes 
+//its own copy of key.
+int kv_set(kv *db, char const *key, uint32_t val);
+//Sets n keys as one batch: the whole batch is logged before any of it
+//goes into the map, so if the log fails, nothing changes. Returns how
+//many keys were new, or negative if the log is broken.
+int kv_mset(kv *db, char const *const *keys, uint32_t const *vals, unsigned n);
+//Returns 0 if key was deleted, 1 if it wasn't there, or negative if 
+//the log is broken
+int kv_del(kv *db, char const *key);
+#define kv_get(db, key) ((uint32_t*) map_search(&(db)->m, (key)))
+
+//A growable byte buffer for responses
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+} kv_out;
+
+void kv_out_append(kv_out *out, char const *p, size_t n);
+
+//Runs one command (line must not include the newline, and gets
+//chopped up in place). Every command produces exactly one line of 
+//response in out, which is what lets clients pipeline: they can send
+//a pile of commands and just count newlines coming back. Commands:
+//  set k v             -> Written | Overwritten
+//  get k               -> v | (null)
+//  delk k              -> Deleted | Not found
+//  mget k1 k2 ...      -> v1 v2 ... (with (null) for missing keys)
+//  mset k1 v1 k2 v2 .. -> Stored n
+//  k                   -> same as get k
+//Anything malformed gets "Error <reason>".
+void kv_exec(kv *db, char *line, kv_out *out);
+
+#endif
@@ -1,13 +1,18 @@
+#include "util.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <time.h>
+#include <unistd.h>
 #include "map.h"
 #include "list.h"
 #include "vector.h"
-
-//I was getting tired of seeing that annoying warning
-char *strdup(char const *);
+#include "wal.h"
+#include "tier.h"
+#include "kv.h"
+#include "server.h"
+#include "map_perf.h"
 
 void print_map(map const *md) {
     map_assert_type(md, char const*, uint32_t, STR2VAL);
@@ -37,11 +42,234 @@ typedef struct {
     uint32_t hash;
 } map_op;
 
-int main(void) {
-    map m;
-    map_init(&m, char const*, uint32_t, STR2VAL);
+//Hammers the log with n sets on random keys and reports how fast it 
+//went. The clock keeps running through wal_close, so the last batch's
+//fsync is counted too.
+static void bench(kv *db, wal_opts const *opts, unsigned n) {
+    wal w;
+    double start = now_sec();
+    if (wal_open(&w, opts, &db->m) < 0) {
+        fprintf(stderr, "Could not open log in %s\n", opts->dir);
+        return;
+    }
+    double opened = now_sec();
+    printf("Replayed %u keys in %.3f s\n", db->m.count, opened - start);
+
+    db->log = &w;
+    unsigned i;
+    for (i = 0; i < n; i++) {
+        char key[32];
+        sprintf(key, "k%u", (unsigned) rand() % (n ? n : 1));
+        if (kv_set(db, key, i) < 0) {
+            fprintf(stderr, "Log write failed after %u sets\n", i);
+            break;
+        }
+    }
+    wal_close(&w);
+    db->log = NULL;
+
+    double secs = now_sec() - opened;
+    printf(
+        "commit_us=%u: %u sets in %.3f s = %.0f ops/s, "
+        "%llu fsyncs (%.1f records per fsync)\n",
+        opts->commit_us, i, secs, i / secs,
+        (unsigned long long) w.commits,
+        w.commits ? (double) w.records / w.commits : 0.0
+    );
+}
+
+//Loads nkeys keys into a tiered store, then does nops random gets and
+//sets (get_pct% gets) spread evenly over all of them. The interesting
+//number is how nkeys compares to what fits in the hot table.
+static void tier_bench(tier_opts const *opts, unsigned nkeys, unsigned nops, unsigned get_pct) {
+    tier t;
+    if (tier_open(&t, opts) < 0) {
+        fprintf(stderr, "Could not open tiered store in %s\n", opts->dir);
+        return;
+    }
+    printf(
+        "%u keys, room for %u in memory (%.1fx)\n",
+        nkeys, t.hot.max_count, (double) nkeys / t.hot.max_count
+    );
+
+    double start = now_sec();
+    unsigned i;
+    for (i = 0; i < nkeys; i++) {
+        char key[32];
+        sprintf(key, "k%u", i);
+        if (tier_set(&t, key, i) < 0) {
+            fprintf(stderr, "Write failed after %u sets\n", i);
+            tier_close(&t);
+            return;
+        }
+    }
+    tier_flush(&t);
+    double secs = now_sec() - start;
+    printf(
+        "load: %u sets in %.3f s = %.0f ops/s, %.1f MB written\n",
+        nkeys, secs, nkeys / secs, t.bytes_written / 1e6
+    );
+
+    uint64_t gets0 = t.gets, hot0 = t.hot_hits, preads0 = t.preads;
+    unsigned seed = 1, found = 0, gets = 0;
+    start = now_sec();
+    for (i = 0; i < nops; i++) {
+        char key[32];
+        unsigned k = rand_r(&seed) % (nkeys ? nkeys : 1);
+        sprintf(key, "k%u", k);
+        if ((unsigned) rand_r(&seed) % 100 < get_pct) {
+            uint32_t val;
+            found += (tier_get(&t, key, &val) == 1);
+            gets++;
+        } else {
+            tier_set(&t, key, i);
+        }
+    }
+    secs = now_sec() - start;
+    uint64_t g = t.gets - gets0;
+    printf(
+        "mixed: %u ops (%u%% gets) in %.3f s = %.0f ops/s, "
+        "%.1f%% of gets hot, %.2f preads per get, %u/%u found\n",
+        nops, get_pct, secs, nops / secs,
+        g ? 100.0 * (t.hot_hits - hot0) / g : 0.0,
+        g ? (double) (t.preads - preads0) / g : 0.0,
+        found, gets
+    );
+
+    start = now_sec();
+    tier_close(&t);
+    printf(
+        "close: %.3f s (%llu flushes, %llu compactions)\n",
+        now_sec() - start, (unsigned long long) t.flushes,
+        (unsigned long long) t.compactions
+    );
+}
+
+static int perf_on;
+
+//Prints where the map's time went (if -p was given)
+static void perf_report(void) {
+    if (!perf_on) return;
+    map_perf_report r;
+    map_perf_stop(&r);
+    map_perf_print(&r, stderr);
+}
+
+static void usage(char const *prog) {
+    fprintf(stderr,
+        "Usage: %s [-w dir] [-i commit_us] [-B commit_bytes] [-C compact_bytes] [-b nsets]\n"
+        "       %s [-w dir ...] -s socket\n"
+        "       %s -c socket [-t conns] [-d depth] [-n ops] [-k keys] [-g get_pct]\n"
+        "       %s -T dir [-M mem_bytes] -b nkeys [-n ops] [-g get_pct]\n"
+        "  -w  Log every set/delk to dir and replay it on startup\n"
+        "  -i  Longest a mutation waits before being fsynced (0 = every time)\n"
+        "  -B  Commit early once this many bytes are waiting\n"
+        "  -C  Snapshot and start a new log once it gets this big (0 = never)\n"
+        "  -b  Instead of reading commands, time nsets random sets (needs -w)\n"
+        "  -p  Print hardware counters for each kind of map operation at exit\n"
+        "      (needs a build with -DMAP_PERF)\n"
+        "  -s  Serve the map on a Unix socket instead of reading stdin\n"
+        "  -c  Run a load generator against a server on socket: conns\n"
+        "      connections each send ops commands in pipelined batches of\n"
+        "      depth, on keys k0 to k<keys-1>, get_pct%% of them gets\n"
+        "  -T  Benchmark the out-of-core store in dir: load nkeys keys, then\n"
+        "      run ops random gets/sets over them\n"
+        "  -M  Memory budget for -T\n",
+        prog, prog, prog, prog
+    );
+}
+
+int main(int argc, char **argv) {
+    wal_opts opts = WAL_DEFAULT_OPTS(NULL);
+    tier_opts topts = TIER_DEFAULT_OPTS(NULL);
+    long nbench = -1;
+    char const *serve_path = NULL;
+    kv_load_opts load = {
+        .conns = 4,
+        .depth = 32,
+        .nops = 1000000,
+        .keyspace = 100000,
+        .get_pct = 90
+    };
+    int opt;
+    while ((opt = getopt(argc, argv, "w:i:B:C:b:ps:c:t:d:n:k:g:T:M:h")) != -1) {
+        switch (opt) {
+        case 'w': opts.dir = optarg; break;
+        case 'i': opts.commit_us = strtoul(optarg, NULL, 0); break;
+        case 'B': opts.commit_bytes = strtoul(optarg, NULL, 0); break;
+        case 'C': opts.compact_bytes = strtoul(optarg, NULL, 0); break;
+        case 'b': nbench = strtol(optarg, NULL, 0); break;
+        case 'p': perf_on = 1; break;
+        case 's': serve_path = optarg; break;
+        case 'c': load.path = optarg; break;
+        case 't': load.conns = strtoul(optarg, NULL, 0); break;
+        case 'd': load.depth = strtoul(optarg, NULL, 0); break;
+        case 'n': load.nops = strtoul(optarg, NULL, 0); break;
+        case 'k': load.keyspace = strtoul(optarg, NULL, 0); break;
+        case 'g': load.get_pct = strtoul(optarg, NULL, 0); break;
+        case 'T': topts.dir = optarg; break;
+        case 'M': topts.mem_bytes = strtoull(optarg, NULL, 0); break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    //The client doesn't need a map at all
+    if (load.path) return kv_load(&load) < 0;
+
+    if (topts.dir) {
+        if (nbench < 0) {
+            usage(argv[0]);
+            return 1;
+        }
+        tier_bench(&topts, nbench, load.nops, load.get_pct);
+        return 0;
+    }
+
+    kv db;
+    kv_init(&db);
+
+    if (perf_on) {
+        int n = map_perf_start();
+        if (n < 0) {
+            fprintf(stderr, "Rebuild with -DMAP_PERF to use -p\n");
+            perf_on = 0;
+        } else if (n < MAP_PERF_NCOUNTERS - 1) {
+            fprintf(stderr, "Only %d of %d hardware counters are available\n", n, MAP_PERF_NCOUNTERS - 1);
+        }
+    }
+
+    if (nbench >= 0) {
+        if (!opts.dir) {
+            usage(argv[0]);
+            return 1;
+        }
+        bench(&db, &opts, nbench);
+        perf_report();
+        kv_free(&db);
+        return 0;
+    }
+
+    wal w;
+    if (opts.dir) {
+        if (wal_open(&w, &opts, &db.m) < 0) {
+            fprintf(stderr, "Could not open log in %s\n", opts.dir);
+            return 1;
+        }
+        db.log = &w;
+    }
+
+    if (serve_path) {
+        int rc = kv_serve(&db, serve_path);
+        if (rc < 0) fprintf(stderr, "Could not listen on %s\n", serve_path);
+        if (db.log) wal_close(db.log);
+        perf_report();
+        kv_free(&db);
+        return rc < 0;
+    }
 
-    print_map(&m);
+    print_map(&db.m);
 
     char cmd[32];
 
@@ -50,21 +278,18 @@ int main(void) {
             char word[32];
             int val;
             scanf("%31s%d", word, &val);
-            char *copied = strdup(word);
-            int rc = map_insert(&m, copied, 1, &val, 0);
-            if (rc < 0) {
-                puts("Full");
-                free(copied);
-            } else if (rc == 1) {
+            int rc = kv_set(&db, word, val);
+            if (rc > 0) {
+                puts("Written");
+            } else if (rc == 0) {
                 puts("Overwritten");
-                free(copied);
             } else {
-                puts("Written");
+                puts("Log error");
             }
         } else if (!strcmp(cmd, "get")) {
             char word[32];
             scanf("%31s", word);
-            int *val = map_search(&m, word);
+            int *val = map_search(&db.m, word);
             if (val) {
                 printf("%d\n", *val);
             } else {
@@ -73,16 +298,18 @@ int main(void) {
         } else if (!strcmp(cmd, "delk")) {
             char word[32];
             scanf("%31s", word);
-            int rc = map_search_delete(&m, word, NULL);
+            int rc = kv_del(&db, word);
             if (rc == 0) {
                 puts("Deleted");
-            } else {
+            } else if (rc > 0) {
                 puts("Not found");
+            } else {
+                puts("Log error");
             }
         } else if (!strcmp(cmd, "print")) {
-            print_map(&m);
+            print_map(&db.m);
         } else {
-            int *val = map_search(&m, cmd);
+            int *val = map_search(&db.m, cmd);
             if (val) {
                 printf("%d\n", *val);
             } else {
@@ -91,9 +318,12 @@ int main(void) {
         }
     }
 
-    print_map(&m);
+    if (db.log) wal_close(db.log);
+
+    print_map(&db.m);
+    perf_report();
     
-    map_free(&m);
+    kv_free(&db);
 
     /*
     VECTOR_DECL(map_op, inputs);
@@ -1,40 +1,237 @@
+#include "util.h"
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/random.h>
 
 #include "map.h"
+#include "map_perf.h"
 #include "list.h"
 
-uint32_t map_val_hash(void const *a, unsigned sz) {
+#ifdef MAP_PERF
+int const __map_perf_hooks = 1;
+#else
+int const __map_perf_hooks = 0;
+#endif
+
+//Murmur3's finalizer. The multiply-and-add loops below leave the high
+//bits poorly mixed (and short keys barely touch them at all), so we
+//run everything through this at the end.
+static inline uint32_t fmix32(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85EBCA6B;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35;
+    h ^= h >> 16;
+    return h;
+}
+
+uint32_t map_val_hash(void const *a, unsigned sz, uint64_t seed) {
     //Is this too slow? There are so many ideas for optimization:
     // - Working on 4 bytes at a time 
     // - Sparsely sampling the value (if it's really big)
     // - A different hash function entirely
     // - (Or just use a library fn from someone else)
 
-    uint32_t hash = 0xA5A5A5A5;
+    uint32_t hash = 0xA5A5A5A5 ^ (uint32_t)seed ^ (uint32_t)(seed >> 32);
 
     char const *bytes = (char const *) a;
 
-    int i;
+    unsigned i;
     for (i = 0; i < sz; i++) {
-        hash = hash*147 + bytes[i];
+        //FNV-1a step. The old hash*147 + byte had way too many exact
+        //collisions on multi-byte keys (small differences in adjacent 
+        //bytes could cancel out), and the xor makes that go away.
+        hash = (hash ^ (unsigned char) bytes[i]) * 0x01000193;
     }
 
-    return hash;
+    return fmix32(hash);
 }
-uint32_t map_ptr_hash(void const *a, unsigned sz) {
-    return map_val_hash(*(void const**)a, sz);
+uint32_t map_ptr_hash(void const *a, unsigned sz, uint64_t seed) {
+    return map_val_hash(*(void const**)a, sz, seed);
 }
-uint32_t map_str_hash(void const *a, unsigned sz) {
-    uint32_t hash = 0xA5A5A5A5;
+uint32_t map_str_hash(void const *a, unsigned sz, uint64_t seed) {
+    (void) sz;
+    uint32_t hash = 0xA5A5A5A5 ^ (uint32_t)seed ^ (uint32_t)(seed >> 32);
 
     char const *str = *(char const **) a;
 
     while (str && *str) {
-        hash = hash*147 + *str++;
+        hash = (hash ^ (unsigned char) *str++) * 0x01000193;
+    }
+
+    return fmix32(hash);
+}
+uint32_t map_strv_hash(void const *a, unsigned sz, uint64_t seed) {
+    (void) sz;
+    //Since we know the length up front, we can chew through the 
+    //string 8 bytes at a time instead of one char at a time. The 
+    //memcpy is just the portable way of doing an unaligned load;
+    //the compiler turns it into a single mov.
+    map_strv const *sv = a;
+    char const *p = sv->ptr;
+    uint32_t len = sv->len;
+
+    uint64_t hash = 0xA5A5A5A5 ^ seed ^ len;
+
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ull;
+        hash ^= hash >> 29;
+        p += 8;
+        len -= 8;
+    }
+
+    if (len) {
+        uint64_t word = 0;
+        memcpy(&word, p, len);
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ull;
+        hash ^= hash >> 29;
+    }
+
+    return (uint32_t) (hash ^ (hash >> 32));
+}
+
+//SipHash-1-3 (one compression round, three finalization rounds). This
+//is what a lot of language runtimes use for exactly this problem: 
+//it's keyed, so without the seed you can't predict collisions, and it's
+//still fast enough for short keys.
+#define ROTL(x,b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND                                         \
+    do {                                                 \
+        v0 += v1; v1 = ROTL(v1,13); v1 ^= v0; v0 = ROTL(v0,32); \
+        v2 += v3; v3 = ROTL(v3,16); v3 ^= v2;            \
+        v0 += v3; v3 = ROTL(v3,21); v3 ^= v0;            \
+        v2 += v1; v1 = ROTL(v1,17); v1 ^= v2; v2 = ROTL(v2,32); \
+    } while (0)
+
+static uint32_t siphash13(void const *data, size_t len, uint64_t seed) {
+    //We only have 64 bits of seed, so derive the second half of the 
+    //key from the first
+    uint64_t k0 = seed;
+    uint64_t k1 = seed*0x9E3779B97F4A7C15ull ^ 0xD6E8FEB86659FD93ull;
+
+    uint64_t v0 = k0 ^ 0x736f6d6570736575ull;
+    uint64_t v1 = k1 ^ 0x646f72616e646f6dull;
+    uint64_t v2 = k0 ^ 0x6c7967656e657261ull;
+    uint64_t v3 = k1 ^ 0x7465646279746573ull;
+
+    char const *p = data;
+    size_t left = len;
+    while (left >= 8) {
+        uint64_t m;
+        memcpy(&m, p, 8);
+        v3 ^= m;
+        SIPROUND;
+        v0 ^= m;
+        p += 8;
+        left -= 8;
+    }
+
+    uint64_t b = ((uint64_t)len) << 56;
+    uint64_t tail = 0;
+    memcpy(&tail, p, left);
+    b |= tail;
+
+    v3 ^= b;
+    SIPROUND;
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+
+    uint64_t h = v0 ^ v1 ^ v2 ^ v3;
+    return (uint32_t) (h ^ (h >> 32));
+}
+
+#undef SIPROUND
+#undef ROTL
+
+uint32_t map_val_shash(void const *a, unsigned sz, uint64_t seed) {
+    return siphash13(a, sz, seed);
+}
+uint32_t map_ptr_shash(void const *a, unsigned sz, uint64_t seed) {
+    return siphash13(*(void const**)a, sz, seed);
+}
+uint32_t map_str_shash(void const *a, unsigned sz, uint64_t seed) {
+    (void) sz;
+    char const *str = *(char const **) a;
+    return siphash13(str, str ? strlen(str) : 0, seed);
+}
+uint32_t map_strv_shash(void const *a, unsigned sz, uint64_t seed) {
+    (void) sz;
+    map_strv const *sv = a;
+    return siphash13(sv->ptr, sv->len, seed);
+}
+
+map_hash_fn *__map_stronger_hash(map_hash_fn *fn) {
+    if (fn == map_val_hash || fn == map_val_shash) return map_val_shash;
+    if (fn == map_ptr_hash || fn == map_ptr_shash) return map_ptr_shash;
+    if (fn == map_str_hash || fn == map_str_shash) return map_str_shash;
+    if (fn == map_strv_hash || fn == map_strv_shash) return map_strv_shash;
+    return NULL;
+}
+
+//Where the kernel's randomness comes in. Asking it for every map made
+//map_init cost a syscall, which was most of the price of a map that 
+//only lives for one request.
+static uint64_t seed_secret(void) {
+    uint64_t seed;
+    if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) == sizeof(seed)) {
+        return seed;
+    }
+
+    //No entropy available (very early boot, or some weird sandbox). 
+    //Scramble together whatever we can get our hands on. This isn't 
+    //secret, but at least it's different every run.
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    seed = ((uint64_t)ts.tv_sec << 32) ^ ts.tv_nsec ^ (uintptr_t)&seed;
+    return seed;
+}
+
+//Every map still gets its own seed: we ask the kernel once, and then 
+//run a counter through splitmix64 keyed with that. Nobody outside ever
+//sees a seed, so this is as hard to guess as the secret.
+static uint64_t seed_key = 0;
+static uint64_t seed_counter = 0;
+static pthread_once_t seed_once = PTHREAD_ONCE_INIT;
+
+//A forked child would otherwise hand out the exact same seeds as its
+//parent (and its siblings), which is the whole setup for pre-fork 
+//servers. Forgetting the secret makes the child's first map go back 
+//to the kernel for a fresh one.
+static void seed_forget(void) {
+    seed_key = 0;
+    seed_counter = 0;
+}
+
+static void seed_register(void) {
+    pthread_atfork(NULL, NULL, seed_forget);
+}
+
+uint64_t __map_random_seed(void) {
+    pthread_once(&seed_once, seed_register);
+
+    uint64_t key = __atomic_load_n(&seed_key, __ATOMIC_RELAXED);
+    if (!key) {
+        uint64_t fresh = seed_secret() | 1;
+        //If another thread got there first, use theirs
+        if (!__atomic_compare_exchange_n(&seed_key, &key, fresh, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            fresh = key;
+        }
+        key = fresh;
     }
 
-    return hash;
+    uint64_t seed = key + __atomic_add_fetch(&seed_counter, 1, __ATOMIC_RELAXED) * 0x9E3779B97F4A7C15ull;
+    seed = (seed ^ (seed >> 30)) * 0xBF58476D1CE4E5B9ull;
+    seed = (seed ^ (seed >> 27)) * 0x94D049BB133111EBull;
+    return seed ^ (seed >> 31);
 }
 
 int map_val_comp(void const *a, void const *b, unsigned sz) {
@@ -48,17 +245,31 @@ int map_ptr_comp(void const *a, void const *b, unsigned sz) {
     return map_val_comp(*(void const**) a, *(void const**) b, sz);
 }
 int map_str_comp(void const *a, void const *b, unsigned sz) {
+    (void) sz;
     //Again: this wrapper should be able to go away
     return strcmp(*(char const**)a, *(char const**)b);
 }
+int map_strv_comp(void const *a, void const *b, unsigned sz) {
+    (void) sz;
+    map_strv const *x = a;
+    map_strv const *y = b;
+    //Different lengths can never match, and this check is a lot 
+    //cheaper than looking at the characters
+    if (x->len != y->len) return 1;
+    return memcmp(x->ptr, y->ptr, x->len);
+}
 
 void map_val_free(void *a) {
+    (void) a;
     fprintf(stderr, "Warning: trying to free a value");
 }
 void map_ptr_free(void *a) {
     //I hope the C compiler makes the wrapper go away!
     free(*(void **)a);
 }
+void map_strv_free(void *a) {
+    free((void*) ((map_strv *)a)->ptr);
+}
 
 //Internal function that sets up the free list of entries. A 
 //little more streamlined to manually manage prev and next.
@@ -71,7 +282,7 @@ void __map_init_entries(map *md) {
     list_head *prev = head;
 
     //Do the first slots-1 entries
-    int i;
+    uint32_t i;
     for (i = 0; i < md->slots - 1; i++) {
         list_head *next = (void*)cur + md->entry_sz;
         cur->prev = prev;
@@ -84,16 +295,197 @@ void __map_init_entries(map *md) {
     cur->prev = prev;
     cur->next = head;
     head->prev = cur;
+
+    //Small maps always take the first free entry, so they don't need
+    //the bitmap
+    if (md->small) return;
+
+    //Same thing for the free bitmap: every slot but the sentinel (and
+    //the padding past the last slot) starts out free
+    size_t words = md->slots/64 + 1;
+    md->free_bits = realloc(md->free_bits, words*sizeof(uint64_t));
+    if (!md->free_bits) FAST_FAIL("out of memory");
+    memset(md->free_bits, 0xff, words*sizeof(uint64_t));
+    md->free_bits[0] &= ~1ull;
+    unsigned tail = (md->slots + 1) % 64;
+    if (tail) md->free_bits[words-1] &= (1ull << tail) - 1;
 }
 
-//Returns NULL if not found, or pointer to value if found
-void *map_search(map const* md, void const* k) {
+static inline void mark_free(map *md, uint32_t idx) {
+    md->free_bits[idx >> 6] |= 1ull << (idx & 63);
+}
+
+static inline void mark_used(map *md, uint32_t idx) {
+    md->free_bits[idx >> 6] &= ~(1ull << (idx & 63));
+}
+
+static inline uint32_t slot_of(map const *md, void const *entry) {
+    return (entry - md->entries) / md->entry_sz;
+}
+
+//Where a hash lands in [0, 2^32) before being scaled down to a slot.
+//Our own hash functions already end in fmix32, but a custom one 
+//might not (the identity function on integer keys is the classic), 
+//and scaling only looks at the high bits. Mixing again costs a few 
+//multiplies and leaves well-mixed hashes just as well-mixed. fmix32 
+//is a bijection, so nothing that didn't collide before collides now.
+//slot_key is 0 unless harden gave the map one.
+static inline uint32_t slot_pos(map const *md, uint32_t hash) {
+    return fmix32(hash ^ md->slot_key);
+}
+
+//Which slot a position belongs in. Remember that slot 0 is the 
+//sentinel. This scales the position down to [0, slots) instead of
+//taking it mod slots, so the home slot only ever goes up as the 
+//position goes up. map_scan depends on that: a range of positions 
+//always lands in a range of slots, no matter how big the array is. 
+//(It's also a multiply instead of a divide.)
+static inline uint32_t pos_idx(map const *md, uint32_t pos) {
+    return (uint32_t)(((uint64_t)pos * md->slots) >> 32) + 1;
+}
+
+static inline uint32_t home_idx(map const *md, uint32_t hash) {
+    return pos_idx(md, slot_pos(md, hash));
+}
+
+//The smallest position whose home slot is idx (or 2^32 for the slot 
+//after the last one)
+static inline uint64_t first_pos(map const *md, uint32_t idx) {
+    return (((uint64_t)(idx - 1) << 32) + md->slots - 1) / md->slots;
+}
+
+//Every entry remembers the full hash of its key, so we never need to 
+//call md->hash on a key that's already in the map
+static inline uint32_t entry_hash(map const *md, void const *entry) {
+    return *(uint32_t const*)(entry + md->hash_off);
+}
+
+//Where an entry's value actually lives (see map_box_values)
+static inline void *entry_val(map const *md, void *entry) {
+    if (md->boxes) return *(void**)(entry + md->val_off);
+    return entry + md->val_off;
+}
+
+//How many bytes of value are stored in the entry itself
+static inline unsigned stored_val_sz(map const *md) {
+    if (md->boxes || md->val_is_ptr) return sizeof(void*);
+    return md->val_sz;
+}
+
+//Boxed values are carved out of big chunks that never move, which is
+//what keeps their addresses stable. Freed boxes go on a free list 
+//(threaded through the boxes themselves) and get reused first.
+struct map_slab {
+    unsigned box_sz;
+    unsigned per_chunk;
+    unsigned used; //How many boxes of the newest chunk are handed out
+    void *free_list;
+    void **chunks;
+    unsigned nchunks;
+    unsigned chunks_cap;
+};
+
+//Aim for chunks of about this many bytes (but at least 16 boxes)
+#define SLAB_CHUNK_BYTES (64 << 10)
+
+static map_slab *slab_new(unsigned val_sz) {
+    map_slab *sl = calloc(1, sizeof(*sl));
+    if (!sl) FAST_FAIL("out of memory");
+    //Round up so every box is as aligned as malloc would make it
+    sl->box_sz = (val_sz + 15) & ~15u;
+    sl->per_chunk = SLAB_CHUNK_BYTES / sl->box_sz;
+    if (sl->per_chunk < 16) sl->per_chunk = 16;
+    sl->used = sl->per_chunk; //Forces a chunk on the first alloc
+    return sl;
+}
+
+static void *slab_alloc(map_slab *sl) {
+    if (sl->free_list) {
+        void *box = sl->free_list;
+        sl->free_list = *(void**)box;
+        return box;
+    }
+
+    if (sl->used == sl->per_chunk) {
+        if (sl->nchunks == sl->chunks_cap) {
+            sl->chunks_cap = sl->chunks_cap ? 2*sl->chunks_cap : 8;
+            sl->chunks = realloc(sl->chunks, sl->chunks_cap * sizeof(void*));
+            if (!sl->chunks) FAST_FAIL("out of memory");
+        }
+        sl->chunks[sl->nchunks] = malloc((size_t)sl->per_chunk * sl->box_sz);
+        if (!sl->chunks[sl->nchunks]) FAST_FAIL("out of memory");
+        sl->nchunks++;
+        sl->used = 0;
+    }
+
+    return sl->chunks[sl->nchunks - 1] + (size_t)(sl->used++) * sl->box_sz;
+}
+
+static void slab_free(map_slab *sl, void *box) {
+    *(void**)box = sl->free_list;
+    sl->free_list = box;
+}
+
+static void slab_destroy(map_slab *sl) {
+    if (!sl) return;
+    unsigned i;
+    for (i = 0; i < sl->nchunks; i++) free(sl->chunks[i]);
+    free(sl->chunks);
+    free(sl);
+}
+
+uint32_t map_hash_key(map const *md, void const *k) {
     //See the big comment in the __map_metadata struct. This 
     //is the trick that lets us avoid dealing with pointers-
     //to-pointers.
     void const *pk = md->key_is_ptr ? &k : k;
+    return md->hash(pk, md->key_sz, md->seed);
+}
+
+//find_entry for small maps: just try every entry. The common key kinds
+//get their compare inlined, since calling through key_comp would cost
+//more than the compare itself.
+static void *small_find(map const *md, void const *pk) {
+    void *e = md->entries + md->entry_sz + md->key_off;
+    void *end = e + (size_t)md->count*md->entry_sz;
+
+    if (md->key_comp == map_val_comp && md->key_sz == sizeof(uint64_t)) {
+        uint64_t k;
+        memcpy(&k, pk, sizeof(k));
+        for (; e < end; e += md->entry_sz) {
+            uint64_t cur;
+            memcpy(&cur, e, sizeof(cur));
+            if (cur == k) return e - md->key_off;
+        }
+    } else if (md->key_comp == map_val_comp && md->key_sz == sizeof(uint32_t)) {
+        uint32_t k;
+        memcpy(&k, pk, sizeof(k));
+        for (; e < end; e += md->entry_sz) {
+            uint32_t cur;
+            memcpy(&cur, e, sizeof(cur));
+            if (cur == k) return e - md->key_off;
+        }
+    } else if (md->key_comp == map_str_comp) {
+        char const *k = *(char const **)pk;
+        for (; e < end; e += md->entry_sz) {
+            char const *cur = *(char const **)e;
+            if (cur[0] == k[0] && !strcmp(cur, k)) return e - md->key_off;
+        }
+    } else {
+        for (; e < end; e += md->entry_sz) {
+            if (!md->key_comp(e, pk, md->key_sz)) return e - md->key_off;
+        }
+    }
+
+    return NULL;
+}
+
+//Returns the entry holding the key (pk is already "undone" by the 
+//key_is_ptr trick), or NULL if it isn't in the map
+static void *find_entry(map const *md, void const *pk, uint32_t hash) {
+    if (md->small) return small_find(md, pk);
 
-    uint32_t idx = (md->hash(pk, md->key_sz) % md->slots) + 1;
+    uint32_t idx = home_idx(md, hash);
     
     void *cur_entry = md->entries + md->entry_sz*idx;
 
@@ -110,22 +502,297 @@ void *map_search(map const* md, void const* k) {
     while(1) {
         void const *key_from_entry = cur_entry + md->key_off;
 
-        //If this matches the key, we're done
-        if (md->key_comp(key_from_entry, pk, md->key_sz) == 0) {
-            return cur_entry + md->val_off;
+        //If this matches the key, we're done. Checking the stored 
+        //hash first means we almost never call key_comp on the wrong
+        //key (which really matters for strings).
+        if (
+            entry_hash(md, cur_entry) == hash && 
+            md->key_comp(key_from_entry, pk, md->key_sz) == 0
+        ) {
+            return cur_entry;
         }
 
         if (flags->is_last) break;
 
         //Otherwise, step all our variables to the next entry
         list_head_from_entry = list_head_from_entry->next;
-        cur_entry = list_head_from_entry - md->list_head_off;
+        cur_entry = ((void*)list_head_from_entry) - md->list_head_off;
         flags = cur_entry + md->flag_off;
     }
 
     return NULL;
 }
 
+//The cache is 2-way: the two slots for a hash sit side by side, with
+//the most recently used one first. Plain direct mapping did noticeably
+//worse on skewed traffic, since every miss in the long tail would 
+//knock out whatever hot key happened to share its slot.
+static inline map_front_slot *front_set(map const *md, uint32_t hash) {
+    return &md->front->slots[(hash & md->front->mask) & ~1u];
+}
+
+//Called when the entry holding a key with this hash moves or goes away
+static inline void front_forget(map const *md, uint32_t hash) {
+    if (!md->front) return;
+    map_front_slot *set = front_set(md, hash);
+    if (set[0].hash == hash) set[0].idx = 0;
+    if (set[1].hash == hash) set[1].idx = 0;
+}
+
+//Bumps one of the front cache or filter counters. map_search can run
+//on several threads at once, so these can't be plain ++. A real 
+//atomic add would have every searching thread fighting over the cache
+//line, though, so this is a relaxed load and store: as cheap as ++, 
+//no data race, and the worst that can happen is losing a few counts.
+static inline void stat_inc(uint64_t *n) {
+    __atomic_store_n(n, __atomic_load_n(n, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
+
+//Only reads the cache; map_search_touch is what fills it
+static void *front_lookup(map const *md, void const *pk, uint32_t hash) {
+    map_front *f = md->front;
+    map_front_slot const *set = front_set(md, hash);
+
+    //A slot can only point at an entry with its hash (everything that 
+    //moves entries calls front_forget), but two keys can share a hash,
+    //so we still have to check the key
+    int way;
+    for (way = 0; way < 2; way++) {
+        if (!set[way].idx || set[way].hash != hash) continue;
+        void *entry = md->entries + (size_t)set[way].idx*md->entry_sz;
+        if (md->key_comp(entry + md->key_off, pk, md->key_sz) == 0) {
+            stat_inc(&f->hits);
+            return entry;
+        }
+    }
+
+    stat_inc(&f->misses);
+    return find_entry(md, pk, hash);
+}
+
+//Moves entry to the front of its set, putting it in the cache if it 
+//isn't there yet (which pushes out the other way)
+static void front_touch(map *md, void *entry, uint32_t hash) {
+    map_front_slot *set = front_set(md, hash);
+    uint32_t idx = (entry - md->entries) / md->entry_sz;
+    if (set[0].idx == idx && set[0].hash == hash) return;
+    if (set[1].idx != idx || set[1].hash != hash) {
+        set[1].hash = hash;
+        set[1].idx = idx;
+    }
+    map_front_slot tmp = set[0];
+    set[0] = set[1];
+    set[1] = tmp;
+}
+
+static void leave_small(map *md);
+
+void map_front_enable(map *md, unsigned nslots) {
+    unsigned n = 2;
+    while (n < nslots) n *= 2;
+
+    map_front_disable(md);
+    leave_small(md);
+    md->front = calloc(1, sizeof(map_front) + n*sizeof(map_front_slot));
+    if (!md->front) FAST_FAIL("out of memory");
+    md->front->mask = n - 1;
+}
+
+void map_front_disable(map *md) {
+    free(md->front);
+    md->front = NULL;
+}
+
+//Same salts as Parquet's split block Bloom filter. Each one picks the
+//bit to set in one word of the block from a different mix of the hash.
+static uint32_t const filter_salt[8] = {
+    0x47b6137bu, 0x44974d91u, 0x8824ad5bu, 0xa2b7289du,
+    0x705495c7u, 0x2df1424bu, 0x9efc4947u, 0x5c6bfb31u
+};
+
+static inline uint64_t *filter_block(map_filter const *f, uint32_t hash) {
+    //The bits come from the low end of hash*salt, so pick the block 
+    //with the high end of a different product
+    uint32_t x = ((uint64_t)hash * 0x9E3779B97F4A7C15ull) >> 32;
+    return f->blocks + 8*(((uint64_t)x * f->nblocks) >> 32);
+}
+
+static inline void filter_add(map_filter *f, uint32_t hash) {
+    uint64_t *b = filter_block(f, hash);
+    int i;
+    for (i = 0; i < 8; i++) b[i] |= 1ull << ((hash * filter_salt[i]) >> 26);
+}
+
+//Returns 0 if the key is definitely not in the map
+static inline int filter_test(map_filter const *f, uint32_t hash) {
+    uint64_t const *b = filter_block(f, hash);
+    uint64_t missing = 0;
+    int i;
+    //No early exit, so the compiler can do all 8 words at once
+    for (i = 0; i < 8; i++) missing |= ~b[i] & (1ull << ((hash * filter_salt[i]) >> 26));
+    return !missing;
+}
+
+//Sizes the filter for the current number of slots and refills it from
+//the hashes stored in the entries
+static void filter_rebuild(map *md) {
+    map_filter *f = md->filter;
+    uint64_t bits = (uint64_t)md->slots * f->bits_per_key;
+    uint32_t nblocks = (bits + 511) / 512;
+    if (nblocks != f->nblocks) {
+        free(f->blocks);
+        f->blocks = aligned_alloc(64, (size_t)nblocks*64);
+        if (!f->blocks) FAST_FAIL("out of memory");
+        f->nblocks = nblocks;
+    }
+    memset(f->blocks, 0, (size_t)nblocks*64);
+    f->stale = 0;
+
+    list_head *head = md->entries + md->list_head_off;
+    list_head *cur;
+    for (cur = head->next; cur != head; cur = cur->next) {
+        filter_add(f, entry_hash(md, ((void*)cur) - md->list_head_off));
+    }
+}
+
+void map_filter_enable(map *md, unsigned bits_per_key) {
+    map_filter_disable(md);
+    leave_small(md);
+    md->filter = calloc(1, sizeof(map_filter));
+    if (!md->filter) FAST_FAIL("out of memory");
+    md->filter->bits_per_key = bits_per_key ? bits_per_key : MAP_FILTER_BITS;
+    filter_rebuild(md);
+}
+
+void map_filter_disable(map *md) {
+    if (!md->filter) return;
+    free(md->filter->blocks);
+    free(md->filter);
+    md->filter = NULL;
+}
+
+int map_box_values(map *md) {
+    if (md->boxes) return 0;
+    //Pointer values are already out of line, and sets have no values
+    if (md->val_is_ptr || md->val_sz == 0) return -1;
+    leave_small(md);
+
+    //The value is the last thing in the entry, so the entry shrinks 
+    //down to a pointer where the value used to be (moved up a little 
+    //if the value wasn't pointer-aligned). Keep whatever alignment 
+    //the old entry size had.
+    unsigned old_sz = md->entry_sz;
+    unsigned old_val_off = md->val_off;
+    unsigned align = old_sz & -old_sz;
+    if (align > 16) align = 16; //That's just a coincidence of the size
+    unsigned new_val_off = (old_val_off + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    unsigned new_sz = (new_val_off + sizeof(void*) + align - 1) & ~(align - 1);
+
+    uint32_t n = md->slots + 1; //Remember the sentinel
+    void *old_entries = md->entries;
+    void *new_entries = calloc(n, new_sz);
+    if (!new_entries) FAST_FAIL("out of memory");
+    md->boxes = slab_new(md->val_sz);
+
+    //Every entry stays in the same slot, so list pointers into the old
+    //array just need to be moved to the same slot in the new one
+    #define RELOC(p) (((p) == &md->empties) ? (p) : \
+        (list_head*)(new_entries + ((void*)(p) - old_entries) / old_sz * new_sz + md->list_head_off))
+
+    uint32_t i;
+    for (i = 0; i < n; i++) {
+        void *src = old_entries + (size_t)i*old_sz;
+        void *dst = new_entries + (size_t)i*new_sz;
+        memcpy(dst, src, old_val_off);
+
+        list_head *node = dst + md->list_head_off;
+        node->next = RELOC(node->next);
+        node->prev = RELOC(node->prev);
+
+        __entry_flags *flags = src + md->flag_off;
+        if (i && flags->is_filled) {
+            void *box = slab_alloc(md->boxes);
+            memcpy(box, src + old_val_off, md->val_sz);
+            *(void**)(dst + new_val_off) = box;
+        }
+    }
+
+    md->empties.next = RELOC(md->empties.next);
+    md->empties.prev = RELOC(md->empties.prev);
+    if (md->clock_hand) md->clock_hand = RELOC(md->clock_hand);
+
+    #undef RELOC
+
+    md->entries = new_entries;
+    md->entry_sz = new_sz;
+    md->val_off = new_val_off;
+    free(old_entries);
+    return 0;
+}
+
+//The guts of map_search_hashed, without the perf hooks (so that other
+//operations can search without it counting as a separate search). 
+//Gives back the entry rather than the value.
+static void *search_hashed(map const *md, void const *k, uint32_t hash) {
+    void const *pk = md->key_is_ptr ? &k : k;
+    map_filter *f = md->filter;
+    if (f && !filter_test(f, hash)) {
+        stat_inc(&f->rejected);
+        return NULL;
+    }
+
+    void *entry = md->front ? front_lookup(md, pk, hash) : find_entry(md, pk, hash);
+    if (f) {
+        stat_inc(&f->passed);
+        if (!entry) stat_inc(&f->false_pos);
+    }
+    return entry;
+}
+
+//search_hashed for when we don't have the hash yet. Small maps don't
+//need one.
+static void *search_key(map const *md, void const *k) {
+    if (md->small) return small_find(md, md->key_is_ptr ? &k : k);
+    return search_hashed(md, k, map_hash_key(md, k));
+}
+
+void *__map_search_entry(map const *md, void const *k) {
+    return search_key(md, k);
+}
+
+void *map_search_hashed(map const *md, void const *k, uint32_t hash) {
+    MAP_PERF_BEGIN(MAP_PERF_SEARCH);
+    void *entry = search_hashed(md, k, hash);
+    MAP_PERF_END();
+    return entry ? entry_val(md, entry) : NULL;
+}
+
+//Returns NULL if not found, or pointer to value if found
+void *map_search(map const* md, void const* k) {
+    MAP_PERF_BEGIN(MAP_PERF_SEARCH);
+    void *entry = search_key(md, k);
+    MAP_PERF_END();
+    return entry ? entry_val(md, entry) : NULL;
+}
+
+//The part of a lookup that writes to the map, which map_search can't
+//do since several threads might be searching at once
+static void touch_entry(map *md, void *entry) {
+    if (md->front) front_touch(md, entry, entry_hash(md, entry));
+    if (md->max_count) {
+        __entry_flags *flags = entry + md->flag_off;
+        flags->referenced = 1;
+    }
+}
+
+void *map_search_touch(map *md, void const *k) {
+    MAP_PERF_BEGIN(MAP_PERF_SEARCH);
+    void *entry = search_key(md, k);
+    if (entry) touch_entry(md, entry);
+    MAP_PERF_END();
+    return entry ? entry_val(md, entry) : NULL;
+}
+
 //Traverses entire list and checks if any of the keys/values should
 //be freed. TODO? Have a fast version that assumes no nodes need to 
 //be freed?
@@ -146,11 +813,17 @@ void map_free(map *md) {
             md->key_free(cur_entry + md->key_off);
         }
         if (flags->free_val) {
-            md->val_free(cur_entry + md->val_off);
+            md->val_free(entry_val(md, cur_entry));
         }
     }
 
     free(md->entries);
+    free(md->free_bits);
+    map_index_disable(md);
+    map_front_disable(md);
+    map_filter_disable(md);
+    slab_destroy(md->boxes);
+    md->boxes = NULL;
 }
 
 static void fill_entry(
@@ -171,11 +844,34 @@ static void fill_entry(
     unsigned key_sz = (md->key_is_ptr) ? sizeof(void*) : md->key_sz;
     unsigned val_sz = (md->val_is_ptr) ? sizeof(void*) : md->val_sz;
     memcpy(e + md->key_off, k, key_sz);
-    memcpy(e + md->val_off, v, val_sz);
+    //Sets don't have values (and pass in NULL for v)
+    if (val_sz) memcpy(entry_val(md, e), v, val_sz);
 }
 
-static void map_expand(map *md) {
-    void *new_entries = calloc((md->slots+1)*2, md->entry_sz);
+static void *claim_entry(map *md, uint32_t hash);
+
+//claim_entry for small maps. The first free entry is always slot 
+//count+1 (the empties list stays in slot order), and it goes on the 
+//end of the list of filled entries so that list stays in slot order too.
+static void *small_claim(map *md, uint32_t hash) {
+    list_head *node = md->empties.next;
+    void *entry = ((void*)node) - md->list_head_off;
+
+    list_del(node);
+    list_add_before((list_head*)(md->entries + md->list_head_off), node);
+    *(__entry_flags*)(entry + md->flag_off) = (__entry_flags) {.is_filled = 1, .is_last = 1};
+    *(uint32_t*)(entry + md->hash_off) = hash;
+    md->count++;
+    return entry;
+}
+
+//Moves everything into a fresh entries array with new_slots slots.
+//If the hash function or seed changed, pass recompute = 1; otherwise
+//we just reuse the hashes stored in the entries.
+static void rehash(map *md, uint32_t new_slots, int recompute) {
+    MAP_PERF_BEGIN(MAP_PERF_EXPAND);
+
+    void *new_entries = calloc(new_slots+1, md->entry_sz);
     if (!new_entries) {
         FAST_FAIL("out of memory");
     }
@@ -191,54 +887,222 @@ static void map_expand(map *md) {
     list_head *head = md->entries + md->list_head_off;
 
     void *old_entries = md->entries; //Need to keep this so we can free later
-    //These need to be set so that __map_insert will work
+    //These need to be set so that claim_entry will work
     md->entries = new_entries;
-    md->slots = 2*(md->slots+1) - 1; //Another advantage of sentinel: 2n+1 is coprime with n
+    md->slots = new_slots;
 
     //Build the initial linked list of free nodes (note: this had to be 
     //done after setting the new entries in md)
     __map_init_entries(md);
 
+    //Everything is about to get reinserted
+    md->count = 0;
+    md->clock_hand = NULL;
+    if (md->front) {
+        memset(md->front->slots, 0, (md->front->mask + 1)*sizeof(map_front_slot));
+    }
+    //Resized and emptied here, then claim_entry puts everything back
+    if (md->filter) filter_rebuild(md);
+
+    //We know all the keys are different, so there's no need to search
+    //the buckets; just claim an entry for each one and copy it over
+    //Boxed values stay where they are; only the pointers move
+    unsigned key_sz = (md->key_is_ptr) ? sizeof(void*) : md->key_sz;
+    unsigned val_sz = stored_val_sz(md);
     list_head *cur;
     for (cur = head->next; cur != head; cur = cur->next) {
-        //Annoying: because of my trick involving pointers that 
-        //simplifies the API, I have to "undo" already having a 
-        //pointer-to-pointer
-        void *entry = cur - md->list_head_off;
+        void *entry = ((void*)cur) - md->list_head_off;
         __entry_flags *flags = entry + md->flag_off;
-        void *k = entry + md->key_off;
-        if (md->key_is_ptr) k = *(void**)k;
-        void *v = entry + md->val_off;
-        if (md->val_is_ptr) v = *(void**)v;
-        map_insert(md, k, flags->free_key, v, flags->free_val);
+        uint32_t hash = recompute 
+            ? md->hash(entry + md->key_off, md->key_sz, md->seed)
+            : entry_hash(md, entry);
+
+        void *dst = md->small ? small_claim(md, hash) : claim_entry(md, hash);
+        __entry_flags *dst_flags = dst + md->flag_off;
+        dst_flags->free_key = flags->free_key;
+        dst_flags->free_val = flags->free_val;
+        memcpy(dst + md->key_off, entry + md->key_off, key_sz);
+        if (val_sz) memcpy(dst + md->val_off, entry + md->val_off, val_sz);
     }
 
     //Notice we don't call the specific freeing functions on the 
     //keys and values; we just free the old memory. 
     free(old_entries);
+
+    MAP_PERF_END();
 }
 
-//Returns 0 on success, 1 if previous value overwritten,
-//or negative on error
-int map_insert(
-    map *md, 
-    void const *k, int free_key,
-    void const *v, int free_val
-) {
-    //See the big comment in the __map_metadata struct. This 
-    //is the trick that lets us avoid dealing with pointers-
-    //to-pointers.
-    void const *pk = md->key_is_ptr ? &k : k;
-    void const *pv = md->val_is_ptr ? &v : v;
+//Picks the layout for a map that's about to have this many slots
+static uint32_t pick_layout(map *md, uint32_t slots) {
+    if (md->small && slots > MAP_SMALL_MAX) {
+        //Use up the whole small layout before leaving it
+        if (md->slots < MAP_SMALL_MAX) return MAP_SMALL_MAX;
+        md->small = 0;
+    }
+    return slots;
+}
+
+static void map_expand(map *md) {
+    uint32_t slots = 2*(md->slots+1) - 1; //Another advantage of sentinel: 2n+1 is coprime with n
+    rehash(md, pick_layout(md, slots), 0);
+}
+
+//For the things that only work with the hashed layout
+static void leave_small(map *md) {
+    if (!md->small) return;
+    md->small = 0;
+    rehash(md, md->slots, 0);
+}
+
+//Called when an insert walked a suspiciously long chain. Switches to 
+//the keyed version of the hash function with a brand new seed and 
+//rehashes in place. We only do this once per map: if the chains are 
+//still long with a keyed hash, it's not because of the keys, and 
+//doing it again would just let an attacker make us rehash over and 
+//over. Returns 1 if we rehashed.
+//
+//pk is the key being inserted, and same is how many entries in its 
+//chain have the exact same hash. Those only matter for custom hash 
+//functions (see MAP_CHAIN_LIMIT).
+static int harden(map *md, void const *pk, uint32_t hash, uint32_t same) {
+    if (md->stats.rehashes) return 0;
+
+    uint64_t seed = __map_random_seed();
+    map_hash_fn *stronger = __map_stronger_hash(md->hash);
+    if (stronger) {
+        md->hash = stronger;
+        md->stats.harden_kind = MAP_HARDEN_KEYED_HASH;
+    } else {
+        //Most of the chain being one hash that the seed doesn't touch
+        //means rehashing would get us the same chain back. Save the 
+        //one try for something we can fix.
+        if (same > MAP_CHAIN_LIMIT/2 && md->hash(pk, md->key_sz, seed) == hash) {
+            md->stats.hopeless++;
+            return 0;
+        }
+        md->slot_key = (uint32_t) (__map_random_seed() >> 32) | 1;
+        md->stats.harden_kind = MAP_HARDEN_KEYED_SLOTS;
+    }
+    md->seed = seed;
+
+    md->stats.rehashes++;
+    md->stats.rehash_count = md->count;
+    rehash(md, md->slots, 1);
+
+    return 1;
+}
+
+void map_set_seed(map *md, uint64_t seed) {
+    md->seed = seed;
+    if (md->count) rehash(md, md->slots, 1);
+}
+
+static int delete_entry(map *md, void *entry);
+
+static inline int cache_is_full(map const *md) {
+    return md->max_count && md->count >= md->max_count;
+}
+
+//Runs the CLOCK hand until it finds an entry that hasn't been 
+//referenced since the last time the hand went by, then deletes it.
+//Each pass clears the bits it skips, so this always finishes within
+//two trips around the list.
+static void evict_one(map *md) {
+    list_head *sentinel = md->entries + md->list_head_off;
+    list_head *hand = md->clock_hand ? md->clock_hand : sentinel->next;
+
+    while (1) {
+        if (hand == sentinel) {
+            hand = hand->next;
+            continue;
+        }
+
+        __entry_flags *flags = ((void*)hand) - md->list_head_off + md->flag_off;
+        if (!flags->referenced) break;
+
+        flags->referenced = 0;
+        hand = hand->next;
+    }
+
+    void *victim = ((void*)hand) - md->list_head_off;
+    md->clock_hand = hand->next; //delete_entry fixes this if it has to
+
+    if (md->on_evict) {
+        md->on_evict(victim + md->key_off, entry_val(md, victim), md->evict_ctx);
+    }
+
+    delete_entry(md, victim);
+}
+
+void map_set_capacity(map *md, uint32_t max_count, map_evict_fn *on_evict, void *ctx) {
+    if (max_count) leave_small(md);
+    md->max_count = max_count;
+    md->on_evict = on_evict;
+    md->evict_ctx = ctx;
+    md->clock_hand = NULL;
+
+    while (max_count && md->count > max_count) {
+        evict_one(md);
+    }
+}
+
+//Picks the free entry that the occupant of slot idx gets moved to 
+//when there's a collision. That entry becomes the next hop in the 
+//bucket, so if we just took whatever was at the front of the free 
+//list (which could be anywhere in the array), almost every hop would
+//be a cache miss and a TLB miss. Instead we look for the closest free
+//slot among the 64 slots sharing idx's word of the free bitmap, then
+//in the words on either side, and only fall back to the free list if 
+//those are all taken.
+static void *near_free_entry(map *md, uint32_t idx) {
+    uint32_t w = idx >> 6;
+    uint64_t bits = md->free_bits[w];
+    uint32_t slot;
+
+    if (bits) {
+        //Closest set bit on either side of idx (idx itself is taken)
+        unsigned b = idx & 63;
+        uint64_t above = bits >> b;
+        uint64_t below = bits & ((1ull << b) - 1);
+        unsigned up = above ? __builtin_ctzll(above) : 64;
+        unsigned down = below ? b - (63 - __builtin_clzll(below)) : 64;
+        slot = (up <= down) ? idx + up : idx - down;
+    } else if (w < md->slots/64 && md->free_bits[w+1]) {
+        //Next best is the start of the next word...
+        slot = 64*(w+1) + __builtin_ctzll(md->free_bits[w+1]);
+    } else if (w > 0 && md->free_bits[w-1]) {
+        //...or the end of the previous one
+        slot = 64*(w-1) + 63 - __builtin_clzll(md->free_bits[w-1]);
+    } else {
+        md->stats.far_claims++;
+        void *entry = ((void*)__map_first_free_entry(md)) - md->list_head_off;
+        mark_used(md, slot_of(md, entry));
+        return entry;
+    }
+
+    md->stats.near_claims++;
+    mark_used(md, slot);
+    return md->entries + md->entry_sz*slot;
+}
 
-    uint32_t idx = (md->hash(pk, md->key_sz) % md->slots) + 1;
+//Grabs an entry for a key with this hash and links it into the bucket.
+//The caller has to know that the key isn't in the map already, that 
+//there's at least one free entry, and that we're allowed to grow (i.e.
+//cache mode won't mind). The entry comes back marked as filled, with 
+//is_last set correctly and the hash stored, but the caller still has 
+//to write the key and value into it.
+static void *claim_entry(map *md, uint32_t hash) {
+    uint32_t idx = home_idx(md, hash);
 
     void *hit_by_hash = md->entries + md->entry_sz*idx;
     __entry_flags *hbh_flags = hit_by_hash + md->flag_off;
     list_head *hbh_node = hit_by_hash + md->list_head_off;
 
-    //If the current entry is free, we can write in the 
-    //new value and terminate early 
+    md->count++;
+    if (md->filter) filter_add(md->filter, hash);
+
+    //If the current entry is free, we can claim it and 
+    //terminate early 
     if (!hbh_flags->is_filled) {
         //Move this node into the the linked list of 
         //filled nodes
@@ -246,55 +1110,14 @@ int map_insert(
         //Remember: sentinel (first entry in array) is head of list 
         //of filled nodes
         list_add((list_head*)(md->entries+md->list_head_off), hbh_node);
-        fill_entry(hit_by_hash, md, pk, free_key, pv, free_val, 1);
-        return 0;
-    }
-
-    //Search the bucket to see if this element already
-    //exists
-    void *cur = hit_by_hash; //Notice that we save the entry hit by the hash
-    list_head *cur_node = hbh_node;
-    __entry_flags *cur_flags = hbh_flags;
-    while(1) {
-        void *key = cur + md->key_off;
-        if (!md->key_comp(key, pk, md->key_sz)) {
-            //Overwrite entry and return 1
-            if (cur_flags->free_key) {
-                md->key_free(key);
-            }
-            if (cur_flags->free_val) {
-                md->val_free(cur + md->val_off);
-            }
-
-            //Notice we don't modify the is_last flag
-            fill_entry(cur, md, pk, free_key, pv, free_val, cur_flags->is_last);
-
-            return 1;
-        }
-
-        if (cur_flags->is_last) break;
-        cur_node = cur_node->next;
-        cur = cur_node - md->list_head_off;
-        cur_flags = cur + md->flag_off;
-    } 
-
-    //Item not found. 
-
-    //The only way to insert is to use a free element
-    if(map_full(md)) {
-        map_expand(md);
-        //So all of the work we just did has essentially gone to 
-        //waste because all the memory and indices have been moved 
-        //around. The simplest thing to do is to just recurse; the 
-        //small amount of time we would save with a more clever
-        //implementation is pretty small compared to the time we're 
-        //forced to spend to rehash everything into the new table
-
-        return map_insert(md, k, free_key, v, free_val);
+        *hbh_flags = (__entry_flags) {.is_filled = 1, .is_last = 1};
+        *(uint32_t*)(hit_by_hash + md->hash_off) = hash;
+        mark_used(md, idx);
+        return hit_by_hash;
     }
 
-    list_head *free_entry_node = __map_first_free_entry(md);
-    void *free_entry = free_entry_node - md->list_head_off;
+    void *free_entry = near_free_entry(md, idx);
+    list_head *free_entry_node = free_entry + md->list_head_off;
 
     //Remove the free entry from the linked list of free nodes
     list_del(free_entry_node);
@@ -309,8 +1132,10 @@ int map_insert(
     //list pointers; we're going to overwrite them in a second
     //when we insert the free entry after the hit-by-hash 
     //element. 
+    front_forget(md, entry_hash(md, hit_by_hash));
     memcpy(free_entry, hit_by_hash, md->entry_sz);
-    fill_entry(hit_by_hash, md, pk, free_key, pv, free_val, 0);
+    *hbh_flags = (__entry_flags) {.is_filled = 1, .is_last = 0};
+    *(uint32_t*)(hit_by_hash + md->hash_off) = hash;
 
 
     //The situation now looks like this:
@@ -332,13 +1157,177 @@ int map_insert(
 
     //All done!
 
-    return 0;
+    return hit_by_hash;
+}
+
+//Finds the entry for pk, or if there isn't one, grabs an entry for it 
+//(see claim_entry). This is the only place where new keys get added 
+//to the map, so both map_insert and map_emplace go through here.
+static void *find_or_claim(map *md, void const *pk, uint32_t hash, int *inserted) {
+    if (md->small) {
+        void *entry = small_find(md, pk);
+        *inserted = !entry;
+        if (entry) return entry;
+
+        //Small maps are never in cache mode or boxed, so all there is
+        //to worry about is running out of room
+        if (map_full(md)) {
+            map_expand(md);
+            if (!md->small) return find_or_claim(md, pk, hash, inserted);
+        }
+        return small_claim(md, hash);
+    }
+
+    uint32_t idx = home_idx(md, hash);
+
+    void *cur = md->entries + md->entry_sz*idx;
+    __entry_flags *cur_flags = cur + md->flag_off;
+    list_head *cur_node = cur + md->list_head_off;
+    uint32_t chain_len = 0, same = 0;
+
+    //Search the bucket to see if this element already
+    //exists
+    if (cur_flags->is_filled) while(1) {
+        chain_len++;
+
+        void *key = cur + md->key_off;
+        if (entry_hash(md, cur) == hash) {
+            if (!md->key_comp(key, pk, md->key_sz)) {
+                if (md->max_count) cur_flags->referenced = 1;
+                *inserted = 0;
+                return cur;
+            }
+            same++;
+        }
+
+        if (cur_flags->is_last) break;
+        cur_node = cur_node->next;
+        cur = ((void*)cur_node) - md->list_head_off;
+        cur_flags = cur + md->flag_off;
+    } 
+
+    //Item not found. 
+    *inserted = 1;
+
+    if (chain_len > md->stats.longest_chain) {
+        md->stats.longest_chain = chain_len;
+    }
+    if (chain_len > MAP_CHAIN_LIMIT && harden(md, pk, hash, same)) {
+        //The hash function changed, so the hash we were given is no 
+        //good anymore
+        return find_or_claim(md, pk, md->hash(pk, md->key_sz, md->seed), inserted);
+    }
+
+    if (cache_is_full(md)) {
+        //Evicting might shuffle entries around, so start over
+        evict_one(md);
+        return find_or_claim(md, pk, hash, inserted);
+    }
+
+    //The only way to insert is to use a free element
+    if(map_full(md)) {
+        //All the memory and indices are about to get moved around, but 
+        //at least we know the key isn't in there, so we can skip 
+        //straight to claiming an entry in the new table
+        map_expand(md);
+    }
+
+    void *entry = claim_entry(md, hash);
+    if (md->boxes) *(void**)(entry + md->val_off) = slab_alloc(md->boxes);
+    return entry;
+}
+
+static int insert_hashed(
+    map *md, 
+    void const *k, int free_key,
+    void const *v, int free_val,
+    uint32_t hash
+) {
+    //See the big comment in the __map_metadata struct. This 
+    //is the trick that lets us avoid dealing with pointers-
+    //to-pointers.
+    void const *pk = md->key_is_ptr ? &k : k;
+    void const *pv = md->val_is_ptr ? &v : v;
+
+    int inserted;
+    void *entry = find_or_claim(md, pk, hash, &inserted);
+    __entry_flags *flags = entry + md->flag_off;
+
+    if (!inserted) {
+        //Overwrite entry and return 1. The index has to switch over to
+        //the new key before the old one gets freed.
+        if (md->index) __map_index_insert(md, pk);
+        if (flags->free_key) {
+            md->key_free(entry + md->key_off);
+        }
+        if (flags->free_val) {
+            md->val_free(entry_val(md, entry));
+        }
+    }
+
+    //Notice we don't modify the is_last flag
+    fill_entry(entry, md, pk, free_key, pv, free_val, flags->is_last);
+    if (inserted && md->index) __map_index_insert(md, pk);
+
+    return inserted ? 0 : 1;
+}
+
+int map_insert_hashed(
+    map *md, 
+    void const *k, int free_key,
+    void const *v, int free_val,
+    uint32_t hash
+) {
+    MAP_PERF_BEGIN(MAP_PERF_INSERT);
+    int ret = insert_hashed(md, k, free_key, v, free_val, hash);
+    MAP_PERF_END();
+    return ret;
+}
+
+//Returns 0 on success, 1 if previous value overwritten,
+//or negative on error
+int map_insert(
+    map *md, 
+    void const *k, int free_key,
+    void const *v, int free_val
+) {
+    MAP_PERF_BEGIN(MAP_PERF_INSERT);
+    int ret = insert_hashed(md, k, free_key, v, free_val, map_hash_key(md, k));
+    MAP_PERF_END();
+    return ret;
+}
+
+void *map_emplace(map *md, void const *k, int free_key, int *inserted) {
+    MAP_PERF_BEGIN(MAP_PERF_INSERT);
+    void const *pk = md->key_is_ptr ? &k : k;
+
+    void *entry = find_or_claim(md, pk, map_hash_key(md, k), inserted);
+
+    if (*inserted) {
+        __entry_flags *flags = entry + md->flag_off;
+        flags->free_key = free_key ? 1 : 0;
+        
+        unsigned key_sz = (md->key_is_ptr) ? sizeof(void*) : md->key_sz;
+        unsigned val_sz = (md->val_is_ptr) ? sizeof(void*) : md->val_sz;
+        memcpy(entry + md->key_off, pk, key_sz);
+        memset(entry_val(md, entry), 0, val_sz);
+        if (md->index) __map_index_insert(md, pk);
+    }
+
+    MAP_PERF_END();
+    return entry_val(md, entry);
+}
+
+int set_insert(set *s, void const *k, int free_key) {
+    int inserted;
+    map_emplace(s, k, free_key, &inserted);
+    return inserted ? 0 : 1;
 }
 
 //If someone wants to search by value, there is no other alternative 
 //than to look through everything in the map. Returns the pointer to 
-//the value in the entry if found, or NULL if not found.
-static list_head *find_by_value(map *md, void const *v) {
+//entry if found, or NULL if not found.
+static void *find_by_value(map *md, void const *v) {
     //See the big comment in the __map_metadata struct. This 
     //is the trick that lets us avoid dealing with pointers-
     //to-pointers.
@@ -350,59 +1339,38 @@ static list_head *find_by_value(map *md, void const *v) {
 
     list_head *cur;
     for (cur = head->next; cur != head; cur = cur->next) {
-        void *val = ((void*)cur) - md->list_head_off + md->val_off;
-        if (md->val_comp(val, pv, md->val_sz)) {
-            return val;
+        void *entry = ((void*)cur) - md->list_head_off;
+        if (md->val_comp(entry_val(md, entry), pv, md->val_sz) == 0) {
+            return entry;
         }
     }
 
     return NULL;
 }
 
-//Searches for either pk_needle or pv_needle depending on which one 
-//is not NULL. If both are given, will search using key but will also 
-//make sure value matches. Returns 0 if entry was deleted, 1 if it 
-//wasn't found, or negative on error
-int map_search_delete(map *md, void const *k_needle, void const *v_needle) {
-    void *found_val;
-
-    if (k_needle) {
-        found_val = map_search(md, k_needle);
-        if (!found_val) return 1; //Not found
-
-        //If the user also gave a value, make sure that the value 
-        //found in this entry matches it:
-        if (v_needle) {
-            //See the big comment in the __map_metadata struct. This 
-            //is the trick that lets us avoid dealing with pointers-
-            //to-pointers.
-            void const *pv = md->val_is_ptr ? &v_needle : v_needle;
-            if (md->val_comp(found_val, pv, md->val_sz) != 0) {
-                return 1; // Not found 
-            }
-        }
-    } else {
-        found_val = find_by_value(md, v_needle);
-        if (!found_val) return 1; //Not found
-    }
-
-    //If we made it here, it's because we need to get deletin'
-    void *entry = found_val - md->val_off;
+//Removes a filled entry from the map, freeing its key and value if the
+//map owns them. Since there are no tombstones, this might move some 
+//other entry (from later in the same bucket) into this entry's slot,
+//in which case we return 1 (otherwise 0).
+static int delete_entry(map *md, void *entry) {
     list_head *node = entry + md->list_head_off;
     __entry_flags *flags = entry + md->flag_off;
 
-    //Compute the hash of this value before we free the key.
-    //The reason we do this will become clear later.
-    uint32_t hash = md->hash(entry+md->key_off, md->key_sz);
-    uint32_t idx = (hash % md->slots) + 1;
+    //The reason we need this will become clear later.
+    uint32_t idx = home_idx(md, entry_hash(md, entry));
+    int moved = 0;
+
+    if (md->index) __map_index_remove(md, entry + md->key_off);
+    front_forget(md, entry_hash(md, entry));
 
     //Free key and value, if necessary
     if (flags->free_key) {
         md->key_free(entry + md->key_off);
     }
     if (flags->free_val) {
-        md->val_free(found_val);
+        md->val_free(entry_val(md, entry));
     }
+    if (md->boxes) slab_free(md->boxes, entry_val(md, entry));
 
     //Here's where things get a little insane. If this entry is 
     //already in the correct position to be hit by the hash, we 
@@ -417,7 +1385,22 @@ int map_search_delete(map *md, void const *k_needle, void const *v_needle) {
     //     things maangeable for the API. I'm half done this
     //     same implementation in C++ and I don't feel that it's
     //     as hacky.
-    if (entry == md->entries + md->entry_sz*idx && !flags->is_last) {
+    if (md->small) {
+        //Small maps stay packed: the last entry moves into the hole 
+        //(keeping this entry's place in the list, which also keeps the 
+        //list in slot order)
+        void *last = md->entries + md->entry_sz*md->count;
+        if (entry != last) {
+            list_head saved = *node;
+            memcpy(entry, last, md->entry_sz);
+            *node = saved;
+            moved = 1;
+
+            entry = last;
+            node = last + md->list_head_off;
+            flags = last + md->flag_off;
+        }
+    } else if (entry == md->entries + md->entry_sz*idx && !flags->is_last) {
         //Follow this bucket until we find the next element with 
         //the same index after hashing
         list_head *cur_node = node->next;
@@ -426,25 +1409,20 @@ int map_search_delete(map *md, void const *k_needle, void const *v_needle) {
             void *cur_entry = ((void*)cur_node) - md->list_head_off;
             __entry_flags *cur_flags = cur_entry + md->flag_off;
 
-            void *pk = cur_entry + md->key_off;
-            uint32_t cur_hash = md->hash(pk,md->entry_sz);
-            uint32_t cur_idx = (cur_hash % md->slots) + 1;
+            uint32_t cur_idx = home_idx(md, entry_hash(md, cur_entry));
             
             if(cur_idx == idx) {
-                //Overwrite the found entry with this one
-                fill_entry(
-                    entry, 
-                    md, 
-                    pk, 
-                    cur_flags->free_key, 
-                    cur_entry + md->val_off,
-                    cur_flags->free_val,
-                    cur_flags->is_last
-                );
+                //Overwrite the found entry with this one (everything 
+                //but the list pointers)
+                list_head saved = *node;
+                front_forget(md, entry_hash(md, cur_entry));
+                memcpy(entry, cur_entry, md->entry_sz);
+                *node = saved;
+                moved = 1;
 
                 //Now set these variables from the outer scope
                 //to point to the entry whose values were copied
-                //in the previous call to fill_entry. This is 
+                //in the memcpy above. This is 
                 //because the code after this loop unconditionally
                 //deletes the entry indicated by entry, node, and flags.
                 entry = cur_entry;
@@ -497,14 +1475,529 @@ int map_search_delete(map *md, void const *k_needle, void const *v_needle) {
         prev_flags->is_last = 1;
     }
 
+    //If the clock hand is sitting on the node we're about to take out,
+    //bump it along so it doesn't end up in the empties list
+    if (md->clock_hand == node) {
+        md->clock_hand = node->next;
+    }
+
     //Remove from list of filled nodes
     flags->is_filled = 0; 
     list_del(node);
+    md->count--;
 
-    //Add back into list of empty nodes
+    //Add back into list of empty nodes (for small maps, this is the 
+    //lowest free slot, so the empties stay in slot order)
     list_add(&md->empties, node);
+    if (!md->small) mark_free(md, slot_of(md, entry));
+
+    //The filter can't forget this key, so it'll let lookups for it 
+    //through until the next rebuild
+    if (md->filter && ++md->filter->stale > (md->slots + 1)/2) {
+        filter_rebuild(md);
+    }
 
     //Phew, done!
+    return moved;
+}
+
+//Searches for either pk_needle or pv_needle depending on which one 
+//is not NULL. If both are given, will search using key but will also 
+//make sure value matches. Returns 0 if entry was deleted, 1 if it 
+//wasn't found, or negative on error
+static int search_delete(map *md, void const *k_needle, void const *v_needle) {
+    void *found;
+
+    if (k_needle) {
+        found = search_key(md, k_needle);
+        if (!found) return 1; //Not found
+
+        //If the user also gave a value, make sure that the value 
+        //found in this entry matches it:
+        if (v_needle) {
+            //See the big comment in the __map_metadata struct. This 
+            //is the trick that lets us avoid dealing with pointers-
+            //to-pointers.
+            void const *pv = md->val_is_ptr ? &v_needle : v_needle;
+            if (md->val_comp(entry_val(md, found), pv, md->val_sz) != 0) {
+                return 1; // Not found 
+            }
+        }
+    } else {
+        found = find_by_value(md, v_needle);
+        if (!found) return 1; //Not found
+    }
+
+    //If we made it here, it's because we need to get deletin'
+    delete_entry(md, found);
+
+    return 0;
+}
+
+int map_search_delete(map *md, void const *k_needle, void const *v_needle) {
+    MAP_PERF_BEGIN(MAP_PERF_DELETE);
+    int ret = search_delete(md, k_needle, v_needle);
+    MAP_PERF_END();
+    return ret;
+}
+void map_part_init(map const *md, map_part_iter *it, unsigned part, unsigned nparts) {
+    //Slot 0 is the sentinel, so the real slots are 1..slots. Doing 
+    //the multiply in 64 bits keeps this from overflowing on big maps
+    it->md = md;
+    it->cur = 1 + (uint32_t)(((uint64_t)md->slots * part) / nparts);
+    it->end = 1 + (uint32_t)(((uint64_t)md->slots * (part+1)) / nparts);
+}
+
+map_iter map_part_next(map_part_iter *it) {
+    map const *md = it->md;
     
+    while (it->cur < it->end) {
+        void *entry = md->entries + md->entry_sz*(it->cur++);
+        __entry_flags *flags = entry + md->flag_off;
+        if (flags->is_filled) {
+            return entry + md->list_head_off;
+        }
+    }
+
+    return NULL;
+}
+
+uint64_t map_scan(map const *md, uint64_t cursor, map_scan_fn *fn, void *ctx, unsigned max_items) {
+    //The cursor is a position (see slot_pos): everything with a smaller
+    //position has already been visited. We visit whole home slots at a 
+    //time (skipping positions below the cursor, which an earlier call 
+    //took care of) and hand back the first position of the slot we 
+    //stopped at. Since that's independent of the array size, it 
+    //doesn't matter if the map grew or shrank in between calls.
+    if (cursor > UINT32_MAX) return 0;
+    if (max_items == 0) max_items = 1;
+
+    //Small maps get done in one go. A map never goes back to being 
+    //small, so there's no way for an earlier call to have stopped 
+    //partway through this one.
+    if (md->small) {
+        void *entry = md->entries + md->entry_sz;
+        uint32_t i;
+        for (i = 0; i < md->count; i++, entry += md->entry_sz) {
+            if (slot_pos(md, entry_hash(md, entry)) >= cursor) {
+                fn(entry + md->key_off, entry_val(md, entry), ctx);
+            }
+        }
+        return 0;
+    }
+
+    uint32_t idx = pos_idx(md, (uint32_t)cursor);
+    //Don't spend forever skipping empty slots in a sparse map
+    uint64_t budget = (uint64_t)max_items * 10;
+    unsigned visited = 0;
+
+    while (idx <= md->slots && visited < max_items && budget--) {
+        void *entry = md->entries + md->entry_sz*idx;
+        __entry_flags *flags = entry + md->flag_off;
+        idx++;
+
+        //If the entry sitting in this slot doesn't belong here, no 
+        //other entry does either (claim_entry would have kicked it out)
+        if (!flags->is_filled || home_idx(md, entry_hash(md, entry)) != idx - 1) {
+            continue;
+        }
+
+        //The bucket can have entries from other home slots mixed in,
+        //but those get visited when we get to their own slot
+        while (1) {
+            uint32_t hash = entry_hash(md, entry);
+            if (home_idx(md, hash) == idx - 1 && slot_pos(md, hash) >= cursor) {
+                fn(entry + md->key_off, entry_val(md, entry), ctx);
+                visited++;
+            }
+            if (flags->is_last) break;
+            entry = ((list_head*)(entry + md->list_head_off))->next;
+            entry -= md->list_head_off;
+            flags = entry + md->flag_off;
+        }
+    }
+
+    if (idx > md->slots) return 0;
+    return first_pos(md, idx);
+}
+
+typedef struct {
+    map const *md;
+    map_visit_fn *fn;
+    void *ctx;
+    unsigned part;
+    unsigned nparts;
+} for_each_job;
+
+static void *for_each_worker(void *arg) {
+    for_each_job *job = arg;
+    map const *md = job->md;
+
+    map_part_iter it;
+    map_part_init(md, &it, job->part, job->nparts);
+
+    map_iter cur;
+    while ((cur = map_part_next(&it)) != NULL) {
+        void *entry = ((void*)cur) - md->list_head_off;
+        job->fn(entry + md->key_off, entry_val(md, entry), job->ctx, job->part);
+    }
+
+    return NULL;
+}
+
+void map_for_each_parallel(map const *md, map_visit_fn *fn, void *ctx, unsigned nthreads) {
+    if (nthreads == 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = (ncpu > 0) ? ncpu : 1;
+    }
+    //No sense in having threads with empty ranges
+    if (nthreads > md->slots) nthreads = md->slots;
+
+    for_each_job *jobs = malloc(nthreads * sizeof(for_each_job));
+    pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+    int *started = calloc(nthreads, sizeof(int));
+    if (!jobs || !threads || !started) FAST_FAIL("out of memory");
+
+    unsigned i;
+    for (i = 0; i < nthreads; i++) {
+        jobs[i] = (for_each_job) {
+            .md = md,
+            .fn = fn,
+            .ctx = ctx,
+            .part = i,
+            .nparts = nthreads
+        };
+    }
+
+    //Range 0 is done on this thread, so start at 1
+    for (i = 1; i < nthreads; i++) {
+        started[i] = !pthread_create(threads + i, NULL, for_each_worker, jobs + i);
+    }
+
+    for_each_worker(jobs);
+
+    //If we couldn't get a thread for some range, just do it here. It's 
+    //slower but the caller still gets every entry.
+    for (i = 1; i < nthreads; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        } else {
+            for_each_worker(jobs + i);
+        }
+    }
+
+    free(started);
+    free(threads);
+    free(jobs);
+}
+
+//Duplicates an owned key or value in place (i.e. overwrites the thing 
+//in the entry with a pointer to a fresh copy). comp tells us what 
+//kind of thing it is, and sz is the size it was declared with. Plain 
+//values are left alone.
+static void dup_owned(void *slot, map_comp_fn *comp, unsigned sz) {
+    if (comp == map_str_comp) {
+        char const *str = *(char const **)slot;
+        size_t len = strlen(str) + 1;
+        char *copied = malloc(len);
+        if (!copied) FAST_FAIL("out of memory");
+        memcpy(copied, str, len);
+        *(char **)slot = copied;
+    } else if (comp == map_ptr_comp) {
+        void *copied = malloc(sz);
+        if (!copied) FAST_FAIL("out of memory");
+        memcpy(copied, *(void **)slot, sz);
+        *(void **)slot = copied;
+    } else if (comp == map_strv_comp) {
+        map_strv *sv = slot;
+        char *copied = malloc(sv->len ? sv->len : 1);
+        if (!copied) FAST_FAIL("out of memory");
+        memcpy(copied, sv->ptr, sv->len);
+        sv->ptr = copied;
+    }
+}
+
+//Plain values live in the entry, so memcpy'ing the entry already 
+//duplicated them
+static int can_dup(map_comp_fn *comp) {
+    return comp == map_val_comp || comp == map_str_comp 
+        || comp == map_ptr_comp || comp == map_strv_comp;
+}
+
+//How many entries we copy before going back to fix their pointers. 
+//The idea is to fix them up while they're still in cache.
+#define CLONE_CHUNK 64
+
+int map_clone(map const *md, map *copy, int flags) {
+    if ((flags & MAP_CLONE_DEEP_KEYS) && !can_dup(md->key_comp)) return -1;
+    if ((flags & MAP_CLONE_DEEP_VALS) && !can_dup(md->val_comp)) return -1;
+
+    uint32_t n = md->slots + 1; //Remember the sentinel
+    void *new_entries = malloc((size_t)n * md->entry_sz);
+    if (!new_entries) FAST_FAIL("out of memory");
+
+    *copy = *md;
+    copy->entries = new_entries;
+    copy->index = NULL; //Rebuilt at the end, since the keys might move
+    copy->front = NULL;
+    copy->filter = NULL; //Also rebuilt at the end
+    if (md->front) map_front_enable(copy, md->front->mask + 1);
+
+    if (md->free_bits) {
+        size_t words = md->slots/64 + 1;
+        copy->free_bits = malloc(words*sizeof(uint64_t));
+        if (!copy->free_bits) FAST_FAIL("out of memory");
+        memcpy(copy->free_bits, md->free_bits, words*sizeof(uint64_t));
+    }
+    //The copy needs boxes of its own (filled in below)
+    if (md->boxes) copy->boxes = slab_new(md->val_sz);
+
+    //Every list pointer either points somewhere in the old array (and 
+    //just needs to be shifted over) or at the empties head, which 
+    //lives in the map struct
+    ptrdiff_t delta = new_entries - md->entries;
+    list_head const *old_empties = &md->empties;
+    #define RELOC(p) (((p) == old_empties) ? &copy->empties : (list_head*)(((void*)(p)) + delta))
+
+    copy->empties.next = RELOC(md->empties.next);
+    copy->empties.prev = RELOC(md->empties.prev);
+    if (md->clock_hand) copy->clock_hand = RELOC(md->clock_hand);
+
+    uint32_t i;
+    for (i = 0; i < n; i += CLONE_CHUNK) {
+        uint32_t chunk = (n - i < CLONE_CHUNK) ? n - i : CLONE_CHUNK;
+        void *dst = new_entries + (size_t)i*md->entry_sz;
+        memcpy(dst, md->entries + (size_t)i*md->entry_sz, (size_t)chunk*md->entry_sz);
+
+        uint32_t j;
+        for (j = 0; j < chunk; j++) {
+            list_head *node = dst + (size_t)j*md->entry_sz + md->list_head_off;
+            node->next = RELOC(node->next);
+            node->prev = RELOC(node->prev);
+        }
+    }
+
+    #undef RELOC
+
+    //Now sort out who owns what
+    list_head *head = copy->entries + copy->list_head_off;
+    list_head *cur;
+    for (cur = head->next; cur != head; cur = cur->next) {
+        void *entry = ((void*)cur) - copy->list_head_off;
+        __entry_flags *eflags = entry + copy->flag_off;
+
+        if (copy->boxes) {
+            void *box = slab_alloc(copy->boxes);
+            memcpy(box, entry_val(md, entry), md->val_sz);
+            *(void**)(entry + copy->val_off) = box;
+        }
+
+        if (eflags->free_key && (flags & MAP_CLONE_DEEP_KEYS)) {
+            dup_owned(entry + copy->key_off, copy->key_comp, copy->key_sz);
+        } else {
+            eflags->free_key = 0;
+        }
+
+        if (eflags->free_val && (flags & MAP_CLONE_DEEP_VALS)) {
+            dup_owned(entry_val(copy, entry), copy->val_comp, copy->val_sz);
+        } else {
+            eflags->free_val = 0;
+        }
+    }
+
+    if (md->index) map_index_enable(copy);
+    if (md->filter) map_filter_enable(copy, md->filter->bits_per_key);
+
     return 0;
-}
\ No newline at end of file
+}
+
+void map_reserve(map *md, uint32_t n) {
+    //Keep the same sizes map_expand would have picked
+    uint32_t slots = md->slots;
+    while (slots < n) slots = 2*(slots+1) - 1;
+    if (md->small && slots > MAP_SMALL_MAX) md->small = 0;
+    if (slots != md->slots) rehash(md, slots, 0);
+}
+
+static int same_keys(map const *a, map const *b) {
+    return a->key_comp == b->key_comp && a->key_sz == b->key_sz;
+}
+
+//The hash that src's entry would have in dst
+static inline uint32_t hash_for(map const *dst, map const *src, void const *src_entry) {
+    if (dst->hash == src->hash && dst->seed == src->seed) {
+        return entry_hash(src, src_entry);
+    }
+    return dst->hash(src_entry + src->key_off, src->key_sz, dst->seed);
+}
+
+int map_merge(map *dst, map *src, int policy) {
+    if (!same_keys(dst, src)) return -1;
+    if (dst->val_comp != src->val_comp || dst->val_sz != src->val_sz) return -1;
+    if (dst == src) return 0;
+
+    map_reserve(dst, dst->count + src->count);
+
+    unsigned key_sz = (src->key_is_ptr) ? sizeof(void*) : src->key_sz;
+    unsigned val_sz = (src->val_is_ptr) ? sizeof(void*) : src->val_sz;
+
+    list_head *head = src->entries + src->list_head_off;
+    list_head *cur;
+    for (cur = head->next; cur != head; cur = cur->next) {
+        void *entry = ((void*)cur) - src->list_head_off;
+        __entry_flags *flags = entry + src->flag_off;
+
+        //Keys in the entry are already "undone" by the key_is_ptr 
+        //trick, so this can go straight to find_or_claim
+        int inserted;
+        void *dst_entry = find_or_claim(
+            dst, entry + src->key_off, hash_for(dst, src, entry), &inserted
+        );
+        __entry_flags *dst_flags = dst_entry + dst->flag_off;
+
+        if (!inserted) {
+            if (policy == MAP_MERGE_KEEP_DST) continue;
+
+            if (dst->index) __map_index_insert(dst, entry + src->key_off);
+            if (dst_flags->free_key) {
+                dst->key_free(dst_entry + dst->key_off);
+            }
+            if (dst_flags->free_val) {
+                dst->val_free(entry_val(dst, dst_entry));
+            }
+        }
+
+        memcpy(dst_entry + dst->key_off, entry + src->key_off, key_sz);
+        if (val_sz) memcpy(entry_val(dst, dst_entry), entry_val(src, entry), val_sz);
+        if (inserted && dst->index) __map_index_insert(dst, dst_entry + dst->key_off);
+
+        //Hand ownership over to dst
+        dst_flags->free_key = flags->free_key;
+        dst_flags->free_val = flags->free_val;
+        flags->free_key = 0;
+        flags->free_val = 0;
+    }
+
+    return 0;
+}
+
+//Below this many entries, it isn't worth starting threads
+#define MAP_PARALLEL_MIN (1 << 16)
+
+typedef struct {
+    map const *dst;
+    map const *src;
+    int doom_if_found;
+} doom_job;
+
+//Marks a dst entry as doomed based on whether its key is in src. This
+//runs on several threads at once, so it only reads src (find_entry 
+//doesn't touch anything) and only writes the flags of its own entry.
+static void mark_doomed(void *key, void *val, void *ctx, unsigned part) {
+    (void) val;
+    (void) part;
+    doom_job *job = ctx;
+    void *entry = key - job->dst->key_off;
+
+    int found = find_entry(job->src, key, hash_for(job->src, job->dst, entry)) != NULL;
+
+    __entry_flags *flags = entry + job->dst->flag_off;
+    flags->doomed = (found == job->doom_if_found);
+}
+
+uint32_t map_remove_if(map *md, map_pred_fn *pred, void *ctx) {
+    list_head *head = md->entries + md->list_head_off;
+    list_head *cur = head->next;
+    uint32_t removed = 0;
+
+    //When delete_entry pulls a later entry into the slot we're looking
+    //at, we stay put and look at the slot again (the entry that got 
+    //moved hasn't been checked yet); otherwise we move on
+    while (cur != head) {
+        void *entry = ((void*)cur) - md->list_head_off;
+        void *val = md->val_sz ? entry_val(md, entry) : NULL;
+
+        if (!pred(entry + md->key_off, val, ctx)) {
+            cur = cur->next;
+            continue;
+        }
+
+        list_head *next = cur->next;
+        if (!delete_entry(md, entry)) cur = next;
+        removed++;
+    }
+
+    return removed;
+}
+
+void map_clear(map *md) {
+    //Same as map_free, except we keep the array
+    list_head *head = md->entries + md->list_head_off;
+    list_head *cur;
+    for (cur = head->next; cur != head; cur = cur->next) {
+        void *entry = ((void*)cur) - md->list_head_off;
+        __entry_flags *flags = entry + md->flag_off;
+
+        if (flags->free_key) md->key_free(entry + md->key_off);
+        if (flags->free_val) md->val_free(entry_val(md, entry));
+    }
+    if (md->boxes) {
+        unsigned val_sz = md->val_sz;
+        slab_destroy(md->boxes);
+        md->boxes = slab_new(val_sz);
+    }
+
+    memset(md->entries, 0, (size_t)(md->slots + 1)*md->entry_sz);
+    head->next = head;
+    head->prev = head;
+    __map_init_entries(md);
+
+    md->count = 0;
+    md->clock_hand = NULL;
+    if (md->front) {
+        memset(md->front->slots, 0, (md->front->mask + 1)*sizeof(map_front_slot));
+    }
+    if (md->filter) filter_rebuild(md);
+    if (md->index) __map_index_clear(md);
+}
+
+static int is_doomed(void *key, void *val, void *ctx) {
+    (void) val;
+    map const *md = ctx;
+    __entry_flags const *flags = key - md->key_off + md->flag_off;
+    return flags->doomed;
+}
+
+//Deletes every doomed entry in a single pass over the list of filled 
+//entries
+static void sweep_doomed(map *md) {
+    map_remove_if(md, is_doomed, md);
+}
+
+static int remove_by_membership(map *dst, map const *src, int doom_if_found) {
+    if (!same_keys(dst, src)) return -1;
+
+    doom_job job = {
+        .dst = dst,
+        .src = src,
+        .doom_if_found = doom_if_found
+    };
+    map_for_each_parallel(dst, mark_doomed, &job, dst->count >= MAP_PARALLEL_MIN ? 0 : 1);
+    sweep_doomed(dst);
+
+    return 0;
+}
+
+int map_intersect(map *dst, map const *src) {
+    if (dst == src) return 0;
+    return remove_by_membership(dst, src, 0);
+}
+
+int map_subtract(map *dst, map const *src) {
+    //Everything goes
+    if (dst == src) {
+        map_clear(dst);
+        return 0;
+    }
+    return remove_by_membership(dst, src, 1);
+}
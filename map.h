@@ -8,35 +8,153 @@
 #include "list.h"
 #include "fast_fail.h"
 
-typedef uint32_t map_hash_fn(void const *, unsigned);
-uint32_t map_val_hash(void const *a, unsigned sz);
-uint32_t map_ptr_hash(void const *a, unsigned sz);
-uint32_t map_str_hash(void const *a, unsigned sz);
+//A string that carries its own length. It doesn't need to be NUL-
+//terminated and can have zeros in it, so you can point it straight 
+//into the middle of some bigger buffer. Maps with STRV keys store 
+//this struct in the entry (so the key is a value, not a pointer).
+typedef struct {
+    char const *ptr;
+    uint32_t len;
+} map_strv;
+
+//Every map gets its own random seed, which is passed to the hash 
+//function along with the key and its size. A custom hash doesn't need
+//to mix its bits well (the map scrambles every hash again before 
+//picking a slot, so even the identity function on integer keys is 
+//fine), but different keys should get different hashes as often as 
+//possible: keys with equal hashes always end up in the same chain.
+typedef uint32_t map_hash_fn(void const *, unsigned, uint64_t);
+uint32_t map_val_hash(void const *a, unsigned sz, uint64_t seed);
+uint32_t map_ptr_hash(void const *a, unsigned sz, uint64_t seed);
+uint32_t map_str_hash(void const *a, unsigned sz, uint64_t seed);
+uint32_t map_strv_hash(void const *a, unsigned sz, uint64_t seed);
+
+//Slower keyed (SipHash-1-3) versions of the above. The fast ones are 
+//easy to attack: someone who controls the keys can make them all land
+//in one giant chain no matter what the seed is. When a map notices 
+//that happening, it switches over to these (see MAP_CHAIN_LIMIT).
+uint32_t map_val_shash(void const *a, unsigned sz, uint64_t seed);
+uint32_t map_ptr_shash(void const *a, unsigned sz, uint64_t seed);
+uint32_t map_str_shash(void const *a, unsigned sz, uint64_t seed);
+uint32_t map_strv_shash(void const *a, unsigned sz, uint64_t seed);
+
+//Returns the keyed version of one of the built-in hash functions (or 
+//the function itself if it's already keyed), or NULL for custom ones
+map_hash_fn *__map_stronger_hash(map_hash_fn *fn);
+uint64_t __map_random_seed(void);
 
 typedef int map_comp_fn(void const *, void const *, unsigned);
 int map_val_comp(void const *a, void const *b, unsigned sz);
 int map_ptr_comp(void const *a, void const *b, unsigned sz);
 int map_str_comp(void const *a, void const *b, unsigned sz);
+int map_strv_comp(void const *a, void const *b, unsigned sz);
 
 typedef void map_free_fn(void *);
 void map_val_free(void *a); //This is technically not needed
 void map_ptr_free(void *a);
 #define map_str_free map_ptr_free
+void map_strv_free(void *a); //Frees the characters, not the map_strv
 
 typedef struct {
     unsigned    is_filled   :1;
     unsigned    is_last     :1;
     unsigned    free_key    :1;
     unsigned    free_val    :1;
+    unsigned    referenced  :1; //CLOCK bit, only used in cache mode
+    unsigned    doomed      :1; //Marked for removal by a bulk operation
 } __entry_flags;
 
+//Called on an entry that's about to be evicted from a map in cache 
+//mode. key and val point into the entry (same as map_search). This
+//runs before the map frees the key/value (if it owns them), so only
+//release things the map doesn't own.
+typedef void map_evict_fn(void *key, void *val, void *ctx);
+
+//If an insert has to walk a chain longer than this, we assume someone
+//is feeding us keys that were picked to collide, so we switch to a 
+//keyed hash with a fresh seed and rehash everything. Normal chains 
+//(even at 100% load) stay well under this.
+//
+//We can't swap out a custom hash function, so for those we pick a new
+//seed and also start picking slots with a secret key mixed into the 
+//hash. That spreads out keys that only collided on their slot, even 
+//if the hash ignores the seed. Keys with the exact same hash are 
+//another story: if the seed doesn't change their hash, nothing we do
+//will separate them, so we leave the map alone and count it in 
+//stats.hopeless instead.
+#define MAP_CHAIN_LIMIT 64
+
+//What the rehash in map_stats did
+enum {
+    MAP_HARDEN_NONE,
+    MAP_HARDEN_KEYED_HASH,  //Switched to a keyed built-in hash
+    MAP_HARDEN_KEYED_SLOTS, //Custom hash: new seed and keyed slots
+};
+
+typedef struct {
+    uint32_t longest_chain; //Longest chain walked by an insert
+    uint32_t rehashes;      //How many times a long chain made us rehash
+    uint32_t rehash_count;  //Number of entries when that last happened
+    uint32_t harden_kind;   //MAP_HARDEN_*
+    uint32_t hopeless;      //Long chains of equal hashes we couldn't fix
+    uint64_t near_claims;   //Collisions that found a free slot nearby
+    uint64_t far_claims;    //Collisions that had to go anywhere
+} map_stats;
+
+//B+tree over the keys, for maps that want ordered scans. Lives in 
+//map_index.c.
+typedef struct map_index map_index;
+
+//Storage for out-of-line values (see map_box_values)
+typedef struct map_slab map_slab;
+
+//Front cache (see map_front_enable). Each slot remembers which entry 
+//the last lookup of some hash landed on. idx 0 means empty, since 
+//that's the sentinel.
+typedef struct {
+    uint32_t hash;
+    uint32_t idx;
+} map_front_slot;
+
+typedef struct {
+    uint32_t mask; //Number of slots minus one
+    uint64_t hits;
+    uint64_t misses;
+    map_front_slot slots[];
+} map_front;
+
+//Maps start out small. Until they need room for more than this many 
+//entries, the filled entries are packed into slots 1..count (in the 
+//same order as the list of filled entries), and looking a key up just
+//compares it against each of them: no hashing, no chains. There's no
+//free bitmap either. Once a map outgrows this it switches over to the 
+//hashed layout for good. Turning on cache mode, the front cache or 
+//boxed values also switches it over.
+#define MAP_SMALL_MAX 8
+
+//Blocked Bloom filter in front of lookups (see map_filter_enable)
+typedef struct {
+    uint32_t nblocks;
+    unsigned bits_per_key;
+    uint32_t stale;     //Deleted keys whose bits are still set
+    uint64_t rejected;  //Lookups the filter turned away
+    uint64_t passed;    //Lookups it let through to the table...
+    uint64_t false_pos; //...that then didn't find anything
+    uint64_t *blocks;   //8 words (one cache line) per block
+} map_filter;
+
 typedef struct {
     uint32_t slots; //Does not include sentinel
+    int small;      //See MAP_SMALL_MAX
 
     //Could have kept head of list of full nodes here,
     //but the sentinel already has space for it (and 
     //we get a benefit when it comes to managing flags).
     list_head empties; //Linked list of empty nodes
+    //Also one bit per slot (set if it's free), so that collisions can
+    //look for a free slot close to home. Slot 0 is never free. NULL 
+    //while the map is small.
+    uint64_t *free_bits;
     //OTOH, I didn't want to put both lists into the
     //sentinel because I don't want the size of the 
     //sentinel to be bigger than the size of a record
@@ -45,6 +163,8 @@ typedef struct {
     //It is possible for the user to define custom 
     //functions.
     map_hash_fn *hash;
+    uint64_t seed;
+    uint32_t slot_key; //Mixed in before picking a slot (see harden)
     map_comp_fn *key_comp;
     map_comp_fn *val_comp;
     void (*key_free)(void *);
@@ -130,16 +250,48 @@ typedef struct {
     //lose some optimizations
     unsigned list_head_off;
     unsigned flag_off;
+    unsigned hash_off;
     unsigned key_off;
     unsigned key_sz;
     unsigned val_off;
     unsigned val_sz;
+
+    uint32_t count; //Number of filled entries
+
+    map_stats stats;
+
+    //Cache mode (see map_set_capacity). When max_count is 0, the map
+    //just grows like normal. Otherwise, once we have max_count entries,
+    //inserting a new key evicts an old one instead of growing. We use 
+    //the CLOCK algorithm: map_search_touch sets the referenced bit on 
+    //hits, and the hand sweeps along the list of filled entries 
+    //clearing referenced bits until it finds an entry without one.
+    uint32_t max_count;
+    list_head *clock_hand; //NULL means "start at the front"
+    map_evict_fn *on_evict;
+    void *evict_ctx;
+
+    //Optional ordered index over the keys (see map_index_enable)
+    map_index *index;
+
+    //Optional front cache for lookups (see map_front_enable)
+    map_front *front;
+
+    //Optional filter for lookups that miss (see map_filter_enable)
+    map_filter *filter;
+
+    //Where the values live if they're stored out of line (see 
+    //map_box_values), or NULL if they're in the entries
+    map_slab *boxes;
 } map;
 
+//The hash of the key gets stored in each entry. It fits in what would 
+//otherwise be padding after the flags for most key types.
 #define MAP_STRUCT(ktype, vtype) \
 struct {                         \
     list_head entry_list;        \
     __entry_flags flags;         \
+    uint32_t hash;               \
     ktype key;                   \
     vtype val;                   \
 }
@@ -157,6 +309,9 @@ void __map_init_entries(map *md);
 #define STR2VAL map_str_hash,map_str_comp,map_val_comp,map_str_free,map_val_free,0,sizeof(entries->val)
 #define STR2PTR map_str_hash,map_str_comp,map_ptr_comp,map_str_free,map_ptr_free,0,sizeof(*entries->val)
 #define STR2STR map_str_hash,map_str_comp,map_str_comp,map_str_free,map_str_free,0,0
+#define STRV2VAL map_strv_hash,map_strv_comp,map_val_comp,map_strv_free,map_val_free,sizeof(entries->key),sizeof(entries->val)
+#define STRV2PTR map_strv_hash,map_strv_comp,map_ptr_comp,map_strv_free,map_ptr_free,sizeof(entries->key),sizeof(*entries->val)
+#define STRV2STR map_strv_hash,map_strv_comp,map_str_comp,map_strv_free,map_str_free,sizeof(entries->key),0
 
 //https://stackoverflow.com/questions/29962560/understanding-defer-and-obstruct-macros/30009264
 #define EMPTY()
@@ -177,20 +332,32 @@ void __map_init_entries(map *md);
 //Would have been nicer as a callable function to avoid this 
 //inlining penalty, so maybe I'll change that later on. The 
 //downside is that all those sizeofs and offsets need to be 
-//passed into the function, which means a lot of parameters
+//passed into the function, which means a lot of parameters.
+//See map_hash_fn for what a custom hsh has to do.
 #define map_custom_init(m,ktype,vtype,hsh,kcmp,vcmp,kfree,vfree,ksz,vsz) \
 do {                                                                     \
     MAP_STRUCT(ktype,vtype) *entries =                                   \
         calloc(MAP_INIT_SZ,sizeof(*entries));                            \
     if (!entries) FAST_FAIL("out of memory");                            \
-    list_head *fulls = &entries->entry_list;                             \
+    __map_setup(m,entries,hsh,kcmp,vcmp,kfree,vfree,ksz,vsz,             \
+                anon_offsetof(entries,val));                             \
+} while(0)
+
+//The part of init that doesn't care what the entries look like. This 
+//is shared with set_init, which has no val member to take the offset 
+//of (so the caller figures out voff).
+#define __map_setup(m,entries,hsh,kcmp,vcmp,kfree,vfree,ksz,vsz,voff)    \
+do {                                                                     \
+    list_head *fulls = &(entries)->entry_list;                           \
     fulls->next = fulls;                                                 \
     fulls->prev = fulls;                                                 \
                                                                          \
     *(m) = (map) {                                                       \
         .slots = MAP_INIT_SZ - 1,                                        \
+        .small = 1,                                                      \
                                                                          \
         .hash = hsh,                                                     \
+        .seed = __map_random_seed(),                                     \
         .key_comp = kcmp,                                                \
         .val_comp = vcmp,                                                \
         .key_free = kfree,                                               \
@@ -199,14 +366,15 @@ do {                                                                     \
         .key_is_ptr = (kcmp==map_ptr_comp||kcmp==map_str_comp),          \
         .val_is_ptr = (vcmp==map_ptr_comp||vcmp==map_str_comp),          \
                                                                          \
-        .entries = entries,                                              \
-        .entry_sz = sizeof(*entries),                                    \
+        .entries = (entries),                                            \
+        .entry_sz = sizeof(*(entries)),                                  \
                                                                          \
         .list_head_off = anon_offsetof(entries,entry_list),              \
         .flag_off = anon_offsetof(entries,flags),                        \
+        .hash_off = anon_offsetof(entries,hash),                         \
         .key_off = anon_offsetof(entries,key),                           \
         .key_sz = ksz,                                                   \
-        .val_off = anon_offsetof(entries,val),                           \
+        .val_off = voff,                                                 \
         .val_sz = vsz,                                                   \
     };                                                                   \
                                                                          \
@@ -218,9 +386,17 @@ do {                                                                     \
 //be freed?
 void map_free(map *md);
 
-//Returns NULL if not found, or pointer to value if found
+//Returns NULL if not found, or pointer to value if found. This only 
+//reads md, so any number of threads can search the same map at once
+//as long as nothing is changing it.
 void *map_search(map const *md, void const *key);
 
+//Same as map_search, but the lookup also counts as a use of the key:
+//in cache mode it keeps the entry from being the next one evicted, 
+//and with the front cache on it moves the key into the front cache.
+//Since that writes to md, it's a mutation like map_insert is.
+void *map_search_touch(map *md, void const *key);
+
 //Returns 0 on success, 1 if previous value overwritten,
 //or negative on error
 int map_insert(
@@ -235,6 +411,109 @@ int map_insert(
 //wasn't found, or negative on error
 int map_search_delete(map *md, void const *k_needle, void const *v_needle);
 
+//Finds the entry for k, or makes a new one if it isn't there, and 
+//returns a pointer to its value (same as what map_search gives you) 
+//so you can read-modify-write it after a single probe. *inserted is 
+//set to 1 if a new entry was made, in which case the value is zeroed 
+//and the map takes k (and frees it later if free_key is set). If the 
+//entry already existed, the stored key is left alone and you still 
+//own k. The map never frees values written through this pointer.
+void *map_emplace(map *md, void const *k, int free_key, int *inserted);
+
+//These let you hash a key once and reuse the hash. The hash is just 
+//whatever the map's hash function gives for the key with the map's 
+//seed, so it's valid for any map with the same hash function and seed
+//(see map_set_seed). It stops being valid if the map switches to a 
+//keyed hash (stats.rehashes goes up). Passing a hash that doesn't 
+//belong to the key will give you wrong answers, not a crash.
+uint32_t map_hash_key(map const *md, void const *k);
+void *map_search_hashed(map const *md, void const *k, uint32_t hash);
+int map_insert_hashed(
+    map *md, 
+    void const *k, int free_key,
+    void const *v, int free_val,
+    uint32_t hash
+);
+
+//Makes sure the map has room for at least n entries, so that inserting
+//that many won't have to call map_expand along the way
+void map_reserve(map *md, uint32_t n);
+
+//Return nonzero to remove the entry. key and val point into the entry
+//(same as what map_search gives you).
+typedef int map_pred_fn(void *key, void *val, void *ctx);
+
+//Removes every entry that pred says to, in one pass over the list of 
+//filled entries, and returns how many went. Nothing gets rehashed or
+//looked up again, which makes this a lot cheaper than collecting keys
+//and calling map_search_delete on each one. pred is called exactly 
+//once per entry, and must not modify the map.
+uint32_t map_remove_if(map *md, map_pred_fn *pred, void *ctx);
+
+//Removes everything (freeing the keys/values the map owns) but keeps
+//the entries array, so the map stays at its current size. Costs one 
+//pass over the entries plus one memset.
+void map_clear(map *md);
+
+//What map_merge does when a key is in both maps
+#define MAP_MERGE_KEEP_DST 0 //Leave the entry in dst alone
+#define MAP_MERGE_TAKE_SRC 1 //Overwrite it with the one from src
+
+//Bulk operations between two maps with the same kind of keys. These 
+//are a lot faster than doing the same thing one map_insert or 
+//map_search_delete at a time: dst gets presized once, and if both maps
+//have the same hash function and seed (see map_set_seed), the hashes 
+//stored in src's entries get reused instead of rehashing every key. 
+//All of them return 0 on success, or negative if the maps don't have 
+//the same key (and for merge, value) types.
+//
+//map_merge copies every entry in src into dst. Any key or value that 
+//ends up in dst and was owned by src becomes owned by dst instead, so
+//src still has the entries but won't free them. Make sure to free src
+//before dst. (Entries that stay behind because of MAP_MERGE_KEEP_DST
+//are still owned by src.)
+int map_merge(map *dst, map *src, int policy);
+
+//These remove entries from dst whose keys are (for subtract) or aren't
+//(for intersect) in src. src isn't changed at all. On big maps, the 
+//lookups into src are spread across one thread per CPU, and then the 
+//entries get removed in one pass.
+int map_intersect(map *dst, map const *src);
+int map_subtract(map *dst, map const *src);
+
+//Changes the map's seed (rehashing if there's anything in it). Mostly
+//useful for giving two maps the same seed so they can share hashes.
+void map_set_seed(map *md, uint64_t seed);
+
+//Puts the map into cache mode: it will never hold more than max_count
+//entries. When it's full, inserting a new key evicts an entry that 
+//hasn't been used recently (on_evict, if given, gets called on it 
+//first). Using a key means finding it with map_search_touch or 
+//inserting it again; plain map_search doesn't count, since it isn't
+//allowed to write to the map. If the map is already over the limit, 
+//we evict right away. Pass max_count = 0 to go back to normal.
+void map_set_capacity(map *md, uint32_t max_count, map_evict_fn *on_evict, void *ctx);
+
+//Flags for map_clone. By default the copy shares keys and values with 
+//the original and doesn't own any of them, which means the original 
+//has to keep them alive for as long as you use the copy (and anything 
+//the original overwrites or deletes will dangle in the copy). With 
+//the DEEP flags, every key/value the original owns is duplicated and 
+//the copy owns the duplicate. This only works for the built-in kinds 
+//since we need to know how to duplicate things.
+#define MAP_CLONE_SHALLOW   0
+#define MAP_CLONE_DEEP_KEYS (1<<0)
+#define MAP_CLONE_DEEP_VALS (1<<1)
+#define MAP_CLONE_DEEP      (MAP_CLONE_DEEP_KEYS | MAP_CLONE_DEEP_VALS)
+
+//Makes copy into a duplicate of md. The whole entries array is copied 
+//in one go and the list pointers are fixed up afterwards, so this is a 
+//lot cheaper than inserting everything into a new map. Does not free 
+//existing data in copy. Returns 0 on success, or negative if a DEEP 
+//flag was given for a key/value kind we don't know how to duplicate 
+//(in which case copy is left untouched).
+int map_clone(map const *md, map *copy, int flags);
+
 //Some little helper macros
 #define map_full(m) (list_empty(&(m)->empties))
 #define __map_first_free_entry(m) ((m)->empties.next)
@@ -242,6 +521,8 @@ int map_search_delete(map *md, void const *k_needle, void const *v_needle);
 //(thanks, Godbolt!)
 #define RV_AMP(x) ((__typeof__(x)[1]){x})
 #define STR_AMP(x) ((char const*[1]){(char const*)(x)})
+//For STRV maps: map_search(my_map, STRV_AMP(buf + 7, 5))
+#define STRV_AMP(p, n) ((map_strv[1]){{(char const*)(p), (n)}})
 
 //TODO: is there any nice way to deal with key_is_ptr? 
 #define map_assert_type(m, ktype, vtype, x) \
@@ -250,16 +531,17 @@ int map_search_delete(map *md, void const *k_needle, void const *v_needle);
 #define map_assert_custom_type(m,ktype,vtype,hsh,kcmp,vcmp,kfree,vfree,ksz,vsz) \
 do {                                                               \
     MAP_STRUCT(ktype,vtype) *dummy = NULL;                         \
-    assert((m)->hash == hsh);                                      \
+    assert((m)->hash == hsh || (m)->hash == __map_stronger_hash(hsh)); \
     assert((m)->key_comp == kcmp);                                 \
     assert((m)->val_comp == vcmp);                                 \
     assert((m)->key_free == kfree);                                \
     assert((m)->val_free == vfree);                                \
-    assert((m)->entry_sz == sizeof(*dummy));                       \
+    assert((m)->boxes || (m)->entry_sz == sizeof(*dummy));         \
     assert((m)->list_head_off == anon_offsetof(dummy,entry_list)); \
     assert((m)->flag_off == anon_offsetof(dummy,flags));           \
+    assert((m)->hash_off == anon_offsetof(dummy,hash));            \
     assert((m)->key_off == anon_offsetof(dummy,key));              \
-    assert((m)->val_off == anon_offsetof(dummy,val));              \
+    assert((m)->boxes || (m)->val_off == anon_offsetof(dummy,val)); \
 } while (0)
 
 
@@ -271,10 +553,222 @@ typedef list_head *map_iter;
 do {                                                                  \
     void *entry = ((void*)it) - (m)->list_head_off;                   \
     void *pk = entry + (m)->key_off;                                  \
-    void *pv = entry + (m)->val_off;                                  \
+    void *pv = (m)->boxes ? *(void**)(entry + (m)->val_off)           \
+                          : entry + (m)->val_off;                     \
     memcpy(k_dst, pk, (m)->key_is_ptr ? sizeof(void*) : (m)->key_sz); \
     memcpy(v_dst, pv, (m)->val_is_ptr ? sizeof(void*) : (m)->val_sz); \
 } while(0)
 #define map_end(m) ((list_head*)((m)->entries + (m)->list_head_off))
 
+//The iterator above has to chase the list of filled entries, so there's 
+//no way to split the work up. These let you split the slots in entries 
+//into nparts contiguous ranges and walk one range linearly (just checking 
+//is_filled on each slot). Entries come out in array order, not in list 
+//order. The map must not be modified while you're walking it.
+typedef struct {
+    map const *md;
+    uint32_t cur; //Next slot to look at
+    uint32_t end; //One past the last slot in this range
+} map_part_iter;
+
+void map_part_init(map const *md, map_part_iter *it, unsigned part, unsigned nparts);
+
+//Returns NULL when the range is done. Otherwise, the returned iterator 
+//works with map_iter_deref (but NOT with map_iter_step)
+map_iter map_part_next(map_part_iter *it);
+
+//Called once per filled entry. key and val point into the entry (same 
+//as what map_search gives you), and part says which range (i.e. which 
+//thread) is calling, which is handy for per-thread accumulators.
+typedef void map_visit_fn(void *key, void *val, void *ctx, unsigned part);
+
+//Splits the map into nthreads ranges and runs fn on every filled entry, 
+//with one thread per range (the calling thread does range 0). Pass 0 to 
+//use one thread per online CPU. fn can be called concurrently, so it 
+//has to do its own locking if it touches shared state in ctx. Returns 
+//once every thread is done.
+void map_for_each_parallel(map const *md, map_visit_fn *fn, void *ctx, unsigned nthreads);
+
+//A map_iter points straight into entries, so anything that makes the
+//map grow (and reallocate) breaks it, which means a full walk has to 
+//keep writers out the whole time. map_scan works like Redis's SCAN 
+//instead: start with a cursor of 0, and each call visits up to about 
+//max_items entries and returns the cursor to pass next time, or 0 once
+//the whole map has been covered. You can insert, delete and grow the
+//map as much as you like in between calls. Every key that's in the map
+//for the whole scan gets visited exactly once; keys that come or go
+//partway through might or might not be. (The one exception is a 
+//change of hash function or seed in the middle, i.e. map_set_seed or
+//the hash flooding defense kicking in, since that moves every key.)
+//A call can go a little over max_items, since it always finishes the
+//bucket it's on, or come back with fewer if the map is sparse. fn must
+//not modify the map.
+typedef void map_scan_fn(void *key, void *val, void *ctx);
+uint64_t map_scan(map const *md, uint64_t cursor, map_scan_fn *fn, void *ctx, unsigned max_items);
+
+//Skewed workloads look up the same few thousand keys over and over,
+//and every time we redo the slot computation and walk a chain that could be 
+//spread all over entries. This puts a small 2-way cache in front of
+//map_search: nslots (rounded up to a power of two) slots of 8 bytes 
+//each, indexed by the low bits of the hash. A hit goes straight to 
+//the right entry and does one key comparison. Entries 
+//that move or get deleted are dropped from the cache, and rehashing 
+//clears it. Overwriting a value doesn't need to do anything, since 
+//the cache points at the entry and the value is updated in place.
+//Check md->front->hits and md->front->misses to see if it's paying 
+//for itself.
+//
+//Only map_search_touch puts keys in the cache. map_search checks it 
+//but never changes it (it only bumps the counters, which are safe to
+//race on but can lose a few counts), so searches from several threads
+//at once are still fine.
+void map_front_enable(map *md, unsigned nslots);
+void map_front_disable(map *md);
+
+//A lookup for a key that isn't there has to walk the whole chain at 
+//its home slot. This puts a blocked Bloom filter in front of lookups:
+//each key sets one bit in each of the 8 words of a 64-byte block picked
+//by its hash, so most missing keys get turned away after reading one 
+//cache line, without touching the entries. bits_per_key is how many 
+//bits to spend per slot (0 means MAP_FILTER_BITS). It's worth it when
+//most lookups miss and the filter (bits_per_key/8 bytes per slot) fits
+//in cache; lookups that hit pay for one more cache line.
+//
+//Inserts add to the filter and growing rebuilds it from the stored 
+//hashes. A Bloom filter can't forget a key, so deletes just get 
+//counted, and once they add up to half the slots we rebuild. Inserts 
+//still walk the chain to check for the key even if the filter says 
+//it's new, since that walk is how we notice hash flooding.
+//
+//false_pos / (rejected + false_pos) is the false positive rate on keys
+//that aren't there. Like the front cache's counters, these can lose a
+//few counts when several threads search at once, but searching from 
+//several threads is fine. Turns a small map into a hashed one.
+#define MAP_FILTER_BITS 12
+void map_filter_enable(map *md, unsigned bits_per_key);
+void map_filter_disable(map *md);
+
+//Big values make everything that moves entries around expensive: 
+//growing copies every value, and so does kicking an entry out of its
+//home slot on a collision. They also mean the pointer map_search gives
+//you goes stale the next time the map grows. This moves the values 
+//out into a slab of fixed-size boxes that never move, so entries only
+//hold a pointer. After this, map_search (and map_emplace, map_iter_deref,
+//etc.) point into the box, and that pointer stays good until the key 
+//is deleted, however much the map grows or shuffles entries around.
+//Overwriting a key's value reuses its box. The cost is one more 
+//pointer chase on every lookup, so it's only worth it for values that
+//are a lot bigger than a pointer. Can be called on a map that already
+//has things in it. Returns -1 for sets and maps with pointer values 
+//(which are already out of line).
+int map_box_values(map *md);
+
+//Ordered scans over string keys (STR and STRV kinds only). The hash 
+//table has no idea what order its keys are in, so this keeps a B+tree
+//of the keys next to it. Every insert and delete pays for a tree 
+//update (O(log n), plus a strlen for STR keys), so it's off by 
+//default. Returns 0 on success or negative if the map's keys aren't
+//strings. Enabling it on a map that already has keys builds the tree
+//from scratch.
+int map_index_enable(map *md);
+void map_index_disable(map *md);
+
+//Hooks for map.c. pk is a key the way it's stored in an entry.
+void __map_index_insert(map *md, void const *pk);
+void __map_index_remove(map *md, void const *pk);
+void __map_index_clear(map *md);
+//Like map_search, but gives back the entry instead of the value
+void *__map_search_entry(map const *md, void const *k);
+
+enum {
+    MAP_RANGE_ALL,    //Run to the end of the index
+    MAP_RANGE_BEFORE, //Stop at the first key >= bound
+    MAP_RANGE_PREFIX  //Stop at the first key that doesn't start with bound
+};
+
+typedef struct {
+    map const *md;
+    void *leaf;   //Current tree node (NULL once we're done)
+    unsigned pos; //Next key to look at in that node
+    int stop;
+    map_strv bound;
+} map_range_iter;
+
+//Scans keys in lo <= key < hi, in byte order (shorter keys first when
+//one is a prefix of the other). Either bound can be NULL to leave that
+//side open. lo and hi are passed the same way as keys to map_search, 
+//and hi has to stay alive for as long as you use the iterator. On a
+//map without an index, the scan is just empty.
+map_range_iter map_range_begin(map const *md, void const *lo, void const *hi);
+
+//Scans every key that starts with the len bytes at prefix
+map_range_iter map_prefix_scan(map const *md, char const *prefix, unsigned len);
+
+//Returns NULL when the scan is done. Otherwise, the returned iterator
+//works with map_iter_deref (but NOT with map_iter_step). Each step 
+//looks the key up in the hash table, the same way map_search does (so
+//in cache mode it doesn't count as a use). The map must not be 
+//modified during the scan.
+map_iter map_range_next(map_range_iter *it);
+
+
+//A set is just a map whose entries don't have a value. Everything runs
+//on the same engine (val_sz is 0, so nothing ever gets copied into or
+//out of the missing value), but entries are smaller, which means more
+//of them fit in cache. Use these instead of the map_ functions so that
+//you don't have to pass dummy values around.
+typedef map set;
+
+#define SET_STRUCT(ktype) \
+struct {                  \
+    list_head entry_list; \
+    __entry_flags flags;  \
+    uint32_t hash;        \
+    ktype key;            \
+}
+
+#define SET_VAL map_val_hash,map_val_comp,map_val_free,sizeof(entries->key)
+#define SET_PTR map_ptr_hash,map_ptr_comp,map_ptr_free,sizeof(*entries->key)
+#define SET_STR map_str_hash,map_str_comp,map_str_free,0
+#define SET_STRV map_strv_hash,map_strv_comp,map_strv_free,sizeof(entries->key)
+
+#define set_init(s,ktype,x) EXPAND(DEFER(set_custom_init)(s,ktype,x))
+
+//Same deal as map_custom_init. The value "lives" right past the end of
+//the entry and has size 0.
+#define set_custom_init(s,ktype,hsh,kcmp,kfree,ksz)                  \
+do {                                                                 \
+    SET_STRUCT(ktype) *entries = calloc(MAP_INIT_SZ,sizeof(*entries)); \
+    if (!entries) FAST_FAIL("out of memory");                        \
+    __map_setup(s,entries,hsh,kcmp,map_val_comp,kfree,map_val_free,  \
+                ksz,0,sizeof(*entries));                             \
+} while(0)
+
+//Returns 0 if k was added, or 1 if it was already there. In that case,
+//the set keeps the key it already had and you still own k.
+int set_insert(set *s, void const *k, int free_key);
+#define set_contains(s,k) (map_search((s),(k)) != NULL)
+//Returns 0 if k was removed, or 1 if it wasn't there
+#define set_remove(s,k) map_search_delete((s),(k),NULL)
+#define set_free(s) map_free(s)
+#define set_count(s) ((s)->count)
+#define set_clear(s) map_clear(s)
+//pred gets NULL for its val
+#define set_remove_if(s,pred,ctx) map_remove_if((s),(pred),(ctx))
+
+#define set_union(d,s) map_merge((d),(s),MAP_MERGE_KEEP_DST)
+#define set_intersect(d,s) map_intersect((d),(s))
+#define set_subtract(d,s) map_subtract((d),(s))
+
+typedef map_iter set_iter;
+#define set_begin(s) map_begin(s)
+#define set_end(s) map_end(s)
+#define set_iter_step(it) map_iter_step(it)
+#define set_iter_deref(s, it, k_dst)                                  \
+do {                                                                  \
+    void *entry = ((void*)it) - (s)->list_head_off;                   \
+    void *pk = entry + (s)->key_off;                                  \
+    memcpy(k_dst, pk, (s)->key_is_ptr ? sizeof(void*) : (s)->key_sz); \
+} while(0)
+
 #endif
\ No newline at end of file
@@ -0,0 +1,454 @@
+#include "util.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "map.h"
+#include "fast_fail.h"
+
+//The ordered index is a B+tree. Leaves hold every key in the map, in
+//order, as a map_strv pointing at the characters the map already
+//stores (so the index costs 16 bytes per key, not a copy of each
+//string). The separators in internal nodes are different: they stick
+//around after the key they came from gets deleted, so each one is
+//its own copy.
+//
+//We don't point at entries because entries move around all the time
+//(claiming a home slot, deleting from the middle of a chain, rehashing)
+//but the characters a key points at don't. The catch is that a scan
+//has to go back through the hash table to find each entry, which is
+//still O(1) per key.
+
+//Max keys per node. A node is around 800 bytes, so a search touches
+//a dozen or so cache lines per level, which is about the same as a
+//binary search over the keys would.
+#define IDX_MAX 32
+#define IDX_MIN (IDX_MAX / 2)
+//How full map_index_enable makes each node. Leaving some room means 
+//the inserts that come after don't start out splitting every leaf.
+#define IDX_FILL (IDX_MAX * 3 / 4)
+
+typedef struct idx_node {
+    unsigned n;
+    unsigned leaf;
+    //One extra of each so that a node can overflow by one before we
+    //split it
+    map_strv keys[IDX_MAX + 1];
+    union {
+        struct idx_node *kids[IDX_MAX + 2]; //Internal nodes
+        struct idx_node *next;              //Leaves: the one to the right
+    };
+} idx_node;
+
+struct map_index {
+    idx_node *root;
+};
+
+static idx_node *new_node(int leaf) {
+    idx_node *nd = calloc(1, sizeof(*nd));
+    if (!nd) FAST_FAIL("out of memory");
+    nd->leaf = leaf;
+    return nd;
+}
+
+static map_strv copy_key(map_strv k) {
+    char *p = malloc(k.len ? k.len : 1);
+    if (!p) FAST_FAIL("out of memory");
+    memcpy(p, k.ptr, k.len);
+    return (map_strv) {p, k.len};
+}
+
+static void free_tree(idx_node *nd) {
+    unsigned i;
+    if (!nd->leaf) {
+        for (i = 0; i < nd->n; i++) free((void*) nd->keys[i].ptr);
+        for (i = 0; i <= nd->n; i++) free_tree(nd->kids[i]);
+    }
+    free(nd);
+}
+
+static inline int strv_cmp(map_strv a, map_strv b) {
+    return key_cmp(a.ptr, a.len, b.ptr, b.len);
+}
+
+//Turns a key the way it's stored in an entry (i.e. after the
+//key_is_ptr trick) into a view of its characters
+static map_strv key_view(map const *md, void const *pk) {
+    if (md->key_comp == map_str_comp) {
+        char const *s = *(char const* const*) pk;
+        return (map_strv) {s, strlen(s)};
+    }
+    return *(map_strv const*) pk;
+}
+
+//Same thing, but for a key the way users pass it in
+static map_strv user_key_view(map const *md, void const *k) {
+    return key_view(md, md->key_is_ptr ? (void const*) &k : k);
+}
+
+//First position in the node whose key is >= k
+static unsigned lower_bound(idx_node const *nd, map_strv k) {
+    unsigned lo = 0, hi = nd->n;
+    while (lo < hi) {
+        unsigned mid = (lo + hi) / 2;
+        if (strv_cmp(nd->keys[mid], k) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+//Which child of an internal node k belongs under. Separator i is the
+//smallest key in kids[i+1], so we want the first separator > k.
+static unsigned child_idx(idx_node const *nd, map_strv k) {
+    unsigned lo = 0, hi = nd->n;
+    while (lo < hi) {
+        unsigned mid = (lo + hi) / 2;
+        if (strv_cmp(nd->keys[mid], k) <= 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+//Leaves and internal nodes split a little differently. In a leaf, the
+//first key of the new right half gets copied up; in an internal node,
+//the middle key moves up and isn't kept in either half.
+static idx_node *split(idx_node *nd, map_strv *sep) {
+    idx_node *right = new_node(nd->leaf);
+    unsigned mid = nd->n / 2;
+
+    if (nd->leaf) {
+        right->n = nd->n - mid;
+        memcpy(right->keys, nd->keys + mid, right->n * sizeof(map_strv));
+        right->next = nd->next;
+        nd->next = right;
+        nd->n = mid;
+        *sep = copy_key(right->keys[0]);
+    } else {
+        *sep = nd->keys[mid];
+        right->n = nd->n - mid - 1;
+        memcpy(right->keys, nd->keys + mid + 1, right->n * sizeof(map_strv));
+        memcpy(right->kids, nd->kids + mid + 1, (right->n + 1) * sizeof(idx_node*));
+        nd->n = mid;
+    }
+
+    return right;
+}
+
+//Returns the new right sibling if nd had to split (with its separator
+//in *sep), or NULL otherwise
+static idx_node *insert_rec(idx_node *nd, map_strv k, map_strv *sep) {
+    unsigned i;
+
+    if (nd->leaf) {
+        i = lower_bound(nd, k);
+        if (i < nd->n && strv_cmp(nd->keys[i], k) == 0) {
+            //Already here, but the map might have swapped in a new
+            //copy of the key
+            nd->keys[i] = k;
+            return NULL;
+        }
+        memmove(nd->keys + i + 1, nd->keys + i, (nd->n - i) * sizeof(map_strv));
+        nd->keys[i] = k;
+        nd->n++;
+    } else {
+        i = child_idx(nd, k);
+        map_strv kid_sep;
+        idx_node *right = insert_rec(nd->kids[i], k, &kid_sep);
+        if (!right) return NULL;
+
+        memmove(nd->keys + i + 1, nd->keys + i, (nd->n - i) * sizeof(map_strv));
+        memmove(nd->kids + i + 2, nd->kids + i + 1, (nd->n - i) * sizeof(idx_node*));
+        nd->keys[i] = kid_sep;
+        nd->kids[i+1] = right;
+        nd->n++;
+    }
+
+    return (nd->n > IDX_MAX) ? split(nd, sep) : NULL;
+}
+
+//Takes separator i (and the child to its right) out of an internal
+//node. Doesn't free anything.
+static void drop_sep(idx_node *nd, unsigned i) {
+    memmove(nd->keys + i, nd->keys + i + 1, (nd->n - i - 1) * sizeof(map_strv));
+    memmove(nd->kids + i + 1, nd->kids + i + 2, (nd->n - i - 1) * sizeof(idx_node*));
+    nd->n--;
+}
+
+//kids[i] of nd has fewer than IDX_MIN keys. Borrow a key from a
+//sibling if one can spare it, otherwise merge with a sibling.
+static void fix_underflow(idx_node *nd, unsigned i) {
+    idx_node *kid = nd->kids[i];
+    idx_node *left = (i > 0) ? nd->kids[i-1] : NULL;
+    idx_node *right = (i < nd->n) ? nd->kids[i+1] : NULL;
+
+    if (left && left->n > IDX_MIN) {
+        memmove(kid->keys + 1, kid->keys, kid->n * sizeof(map_strv));
+        if (kid->leaf) {
+            kid->keys[0] = left->keys[left->n - 1];
+            free((void*) nd->keys[i-1].ptr);
+            nd->keys[i-1] = copy_key(kid->keys[0]);
+        } else {
+            //Rotate through the parent
+            memmove(kid->kids + 1, kid->kids, (kid->n + 1) * sizeof(idx_node*));
+            kid->keys[0] = nd->keys[i-1];
+            kid->kids[0] = left->kids[left->n];
+            nd->keys[i-1] = left->keys[left->n - 1];
+        }
+        kid->n++;
+        left->n--;
+    } else if (right && right->n > IDX_MIN) {
+        if (kid->leaf) {
+            kid->keys[kid->n] = right->keys[0];
+            memmove(right->keys, right->keys + 1, (right->n - 1) * sizeof(map_strv));
+            free((void*) nd->keys[i].ptr);
+            nd->keys[i] = copy_key(right->keys[0]);
+        } else {
+            kid->keys[kid->n] = nd->keys[i];
+            kid->kids[kid->n + 1] = right->kids[0];
+            nd->keys[i] = right->keys[0];
+            memmove(right->keys, right->keys + 1, (right->n - 1) * sizeof(map_strv));
+            memmove(right->kids, right->kids + 1, right->n * sizeof(idx_node*));
+        }
+        kid->n++;
+        right->n--;
+    } else {
+        //Neither sibling has anything to spare, so merge kid with one
+        //of them. Either way it's kids[j+1] that goes into kids[j].
+        unsigned j = left ? i - 1 : i;
+        idx_node *a = nd->kids[j], *b = nd->kids[j+1];
+
+        if (a->leaf) {
+            memcpy(a->keys + a->n, b->keys, b->n * sizeof(map_strv));
+            a->n += b->n;
+            a->next = b->next;
+            free((void*) nd->keys[j].ptr);
+        } else {
+            a->keys[a->n] = nd->keys[j];
+            memcpy(a->keys + a->n + 1, b->keys, b->n * sizeof(map_strv));
+            memcpy(a->kids + a->n + 1, b->kids, (b->n + 1) * sizeof(idx_node*));
+            a->n += b->n + 1;
+        }
+        free(b);
+        drop_sep(nd, j);
+    }
+}
+
+static void remove_rec(idx_node *nd, map_strv k) {
+    if (nd->leaf) {
+        unsigned i = lower_bound(nd, k);
+        if (i == nd->n || strv_cmp(nd->keys[i], k) != 0) return;
+        memmove(nd->keys + i, nd->keys + i + 1, (nd->n - i - 1) * sizeof(map_strv));
+        nd->n--;
+        return;
+    }
+
+    unsigned i = child_idx(nd, k);
+    remove_rec(nd->kids[i], k);
+    if (nd->kids[i]->n < IDX_MIN) fix_underflow(nd, i);
+}
+
+static void index_add(map_index *ix, map_strv k) {
+    map_strv sep;
+    idx_node *right = insert_rec(ix->root, k, &sep);
+    if (right) {
+        idx_node *root = new_node(0);
+        root->n = 1;
+        root->keys[0] = sep;
+        root->kids[0] = ix->root;
+        root->kids[1] = right;
+        ix->root = root;
+    }
+}
+
+void __map_index_insert(map *md, void const *pk) {
+    index_add(md->index, key_view(md, pk));
+}
+
+void __map_index_remove(map *md, void const *pk) {
+    map_index *ix = md->index;
+    remove_rec(ix->root, key_view(md, pk));
+
+    //The root is allowed to be small, but an internal root with one
+    //child is just wasting a level
+    if (!ix->root->leaf && ix->root->n == 0) {
+        idx_node *old = ix->root;
+        ix->root = old->kids[0];
+        free(old);
+    }
+}
+
+void __map_index_clear(map *md) {
+    free_tree(md->index->root);
+    md->index->root = new_node(1);
+}
+
+static int key_qsort_cmp(void const *a, void const *b) {
+    return strv_cmp(*(map_strv const*) a, *(map_strv const*) b);
+}
+
+//How many nodes to spread n things over so that each one gets about
+//fill of them, but never more than max. As long as n >= max, that 
+//also keeps every node at or above half of max.
+static unsigned ngroups(unsigned n, unsigned fill, unsigned max) {
+    unsigned g = n / fill;
+    if (g == 0) g = 1;
+    if ((n + g - 1) / g > max) g = (n + max - 1) / max;
+    return g;
+}
+
+//Builds a tree over n keys (sorted, no duplicates) one level at a 
+//time, starting from the leaves
+static idx_node *bulk_load(map_strv const *keys, unsigned n) {
+    if (n == 0) return new_node(1);
+
+    unsigned nl = ngroups(n, IDX_FILL, IDX_MAX);
+    idx_node **level = malloc(nl * sizeof(*level));
+    map_strv *lows = malloc(nl * sizeof(*lows)); //Smallest key under each node
+    if (!level || !lows) FAST_FAIL("out of memory");
+
+    unsigned i, j, off = 0;
+    for (i = 0; i < nl; i++) {
+        idx_node *nd = new_node(1);
+        nd->n = n / nl + (i < n % nl);
+        memcpy(nd->keys, keys + off, nd->n * sizeof(map_strv));
+        if (i) level[i-1]->next = nd;
+        level[i] = nd;
+        lows[i] = keys[off];
+        off += nd->n;
+    }
+
+    //Each pass replaces the first few slots of level (and lows) with
+    //the parents of everything in it. Group i starts at or after slot
+    //i, so we never overwrite something we haven't read yet.
+    unsigned m = nl;
+    while (m > 1) {
+        unsigned np = ngroups(m, IDX_FILL + 1, IDX_MAX + 1);
+        off = 0;
+        for (i = 0; i < np; i++) {
+            unsigned nkids = m / np + (i < m % np);
+            idx_node *nd = new_node(0);
+            nd->n = nkids - 1;
+            for (j = 0; j < nkids; j++) {
+                nd->kids[j] = level[off + j];
+                if (j) nd->keys[j-1] = copy_key(lows[off + j]);
+            }
+            level[i] = nd;
+            lows[i] = lows[off];
+            off += nkids;
+        }
+        m = np;
+    }
+
+    idx_node *root = level[0];
+    free(level);
+    free(lows);
+    return root;
+}
+
+int map_index_enable(map *md) {
+    if (md->key_comp != map_str_comp && md->key_comp != map_strv_comp) return -1;
+    if (md->index) return 0;
+
+    //Sorting everything and building the tree bottom-up is a lot 
+    //quicker than inserting one key at a time, and leaves every node
+    //evenly filled
+    map_strv *keys = malloc((md->count ? md->count : 1) * sizeof(*keys));
+    if (!keys) FAST_FAIL("out of memory");
+    uint32_t n = 0;
+    list_head *head = md->entries + md->list_head_off;
+    list_head *cur;
+    for (cur = head->next; cur != head; cur = cur->next) {
+        void *entry = ((void*)cur) - md->list_head_off;
+        keys[n++] = key_view(md, entry + md->key_off);
+    }
+    qsort(keys, n, sizeof(*keys), key_qsort_cmp);
+
+    map_index *ix = malloc(sizeof(*ix));
+    if (!ix) FAST_FAIL("out of memory");
+    ix->root = bulk_load(keys, n);
+    md->index = ix;
+    free(keys);
+
+    return 0;
+}
+
+void map_index_disable(map *md) {
+    if (!md->index) return;
+    free_tree(md->index->root);
+    free(md->index);
+    md->index = NULL;
+}
+
+//Walks down to the leaf where k is (or would be), and returns the
+//position of the first key >= k
+static idx_node *seek(map_index const *ix, map_strv k, unsigned *pos) {
+    idx_node *nd = ix->root;
+    while (!nd->leaf) nd = nd->kids[child_idx(nd, k)];
+    *pos = lower_bound(nd, k);
+    return nd;
+}
+
+static map_range_iter range_start(map const *md, map_strv const *lo) {
+    map_range_iter it = {.md = md};
+    if (!md->index) return it; //Comes out empty
+
+    if (lo) {
+        it.leaf = seek(md->index, *lo, &it.pos);
+    } else {
+        idx_node *nd = md->index->root;
+        while (!nd->leaf) nd = nd->kids[0];
+        it.leaf = nd;
+    }
+    return it;
+}
+
+map_range_iter map_range_begin(map const *md, void const *lo, void const *hi) {
+    map_strv lo_view;
+    if (lo) lo_view = user_key_view(md, lo);
+    map_range_iter it = range_start(md, lo ? &lo_view : NULL);
+    if (hi) {
+        it.stop = MAP_RANGE_BEFORE;
+        it.bound = user_key_view(md, hi);
+    }
+    return it;
+}
+
+map_range_iter map_prefix_scan(map const *md, char const *prefix, unsigned len) {
+    map_strv p = {prefix, len};
+    //Everything with the prefix sorts right after the prefix itself
+    map_range_iter it = range_start(md, &p);
+    it.stop = MAP_RANGE_PREFIX;
+    it.bound = p;
+    return it;
+}
+
+map_iter map_range_next(map_range_iter *it) {
+    idx_node *nd = it->leaf;
+    if (!nd) return NULL;
+
+    while (it->pos == nd->n) {
+        nd = nd->next;
+        it->leaf = nd;
+        it->pos = 0;
+        if (!nd) return NULL;
+    }
+
+    map_strv k = nd->keys[it->pos];
+    if (it->stop == MAP_RANGE_BEFORE && strv_cmp(k, it->bound) >= 0) {
+        it->leaf = NULL;
+        return NULL;
+    }
+    if (it->stop == MAP_RANGE_PREFIX && (
+        k.len < it->bound.len || memcmp(k.ptr, it->bound.ptr, it->bound.len)
+    )) {
+        it->leaf = NULL;
+        return NULL;
+    }
+    it->pos++;
+
+    //Go back through the hash table for the entry itself
+    map const *md = it->md;
+    void const *user_key = (md->key_comp == map_str_comp) ? (void const*) k.ptr : (void const*) &k;
+    void *entry = __map_search_entry(md, user_key);
+    return (map_iter) (entry + md->list_head_off);
+}
@@ -0,0 +1,233 @@
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "map_perf.h"
+
+typedef struct {
+    int fd;
+    struct perf_event_mmap_page *page; //NULL if we can't rdpmc
+} counter;
+
+//How deep operations can nest (e.g. insert -> expand)
+#define MAX_DEPTH 8
+
+//Everything is per thread, since perf counters follow a thread and
+//operations on different threads shouldn't see each other
+typedef struct {
+    int active;
+    counter ctrs[MAP_PERF_NCOUNTERS]; //ctrs[MAP_PERF_NS] is unused
+    map_perf_report rep;
+
+    //Counter values the last time we charged something
+    uint64_t snap[MAP_PERF_NCOUNTERS];
+    int stack[MAX_DEPTH];
+    int depth;
+    //Begins past MAX_DEPTH that didn't get a frame. Their ends have to
+    //be swallowed too, or they'd pop frames that belong to someone else
+    //(and their time just stays with whatever's on top).
+    int overflow;
+} perf_state;
+
+static __thread perf_state ps;
+
+static struct {
+    uint32_t type;
+    uint64_t config;
+} const events[MAP_PERF_NCOUNTERS] = {
+    [MAP_PERF_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [MAP_PERF_LLC_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    [MAP_PERF_DTLB_MISSES] = {
+        PERF_TYPE_HW_CACHE,
+        PERF_COUNT_HW_CACHE_DTLB
+            | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+    },
+    [MAP_PERF_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+static char const *const op_names[MAP_PERF_NOPS] = {
+    "search", "insert", "delete", "expand"
+};
+
+static char const *const ctr_names[MAP_PERF_NCOUNTERS] = {
+    "ns", "cycles", "LLC-miss", "dTLB-miss", "br-miss"
+};
+
+static int open_counter(counter *c, uint32_t type, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    c->fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    c->page = NULL;
+    if (c->fd < 0) return -1;
+
+    //The first page of the mapping tells us if we're allowed to read
+    //the counter straight from userspace
+    void *p = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, c->fd, 0);
+    if (p != MAP_FAILED) {
+        c->page = p;
+        if (!c->page->cap_user_rdpmc) {
+            munmap(p, sysconf(_SC_PAGESIZE));
+            c->page = NULL;
+        }
+    }
+    return 0;
+}
+
+static void close_counter(counter *c) {
+    if (c->page) munmap(c->page, sysconf(_SC_PAGESIZE));
+    if (c->fd >= 0) close(c->fd);
+    c->fd = -1;
+    c->page = NULL;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline uint64_t rdpmc(uint32_t idx) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdpmc" : "=a" (lo), "=d" (hi) : "c" (idx));
+    return lo | ((uint64_t) hi << 32);
+}
+#endif
+
+static uint64_t read_counter(counter const *c) {
+#if defined(__x86_64__) || defined(__i386__)
+    //This is the sequence the kernel documents in perf_event.h
+    struct perf_event_mmap_page volatile *pg = c->page;
+    if (pg) {
+        uint32_t seq, idx;
+        uint64_t val;
+        do {
+            seq = pg->lock;
+            __asm__ volatile("" ::: "memory");
+            idx = pg->index;
+            val = pg->offset;
+            if (idx) {
+                uint64_t width = pg->pmc_width;
+                int64_t pmc = rdpmc(idx - 1);
+                pmc <<= 64 - width;
+                pmc >>= 64 - width;
+                val += pmc;
+            }
+            __asm__ volatile("" ::: "memory");
+        } while (pg->lock != seq);
+        if (idx) return val;
+        //idx == 0 means the counter isn't on the PMU right now, so
+        //fall through and ask the kernel
+    }
+#endif
+    uint64_t val = 0;
+    if (read(c->fd, &val, sizeof(val)) != sizeof(val)) return 0;
+    return val;
+}
+
+static void read_all(uint64_t *dst) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    dst[MAP_PERF_NS] = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+    int i;
+    for (i = 1; i < MAP_PERF_NCOUNTERS; i++) {
+        if (ps.rep.available[i]) dst[i] = read_counter(&ps.ctrs[i]);
+    }
+}
+
+//Charges everything since the last snapshot to the op on top of the
+//stack
+static void charge(void) {
+    uint64_t now[MAP_PERF_NCOUNTERS];
+    read_all(now);
+    int op = ps.stack[ps.depth - 1];
+    int i;
+    for (i = 0; i < MAP_PERF_NCOUNTERS; i++) {
+        if (i == MAP_PERF_NS || ps.rep.available[i]) {
+            ps.rep.totals[op][i] += now[i] - ps.snap[i];
+        }
+        ps.snap[i] = now[i];
+    }
+}
+
+void __map_perf_begin(int op) {
+    if (!ps.active) return;
+    if (ps.depth == MAX_DEPTH) {
+        ps.overflow++;
+        return;
+    }
+
+    if (ps.depth) charge();
+    else read_all(ps.snap);
+
+    ps.stack[ps.depth++] = op;
+    ps.rep.calls[op]++;
+}
+
+void __map_perf_end(void) {
+    if (!ps.active) return;
+    if (ps.overflow) {
+        ps.overflow--;
+        return;
+    }
+    if (ps.depth == 0) return;
+    charge();
+    ps.depth--;
+}
+
+int map_perf_start(void) {
+    //What matters is whether map.c has the hooks, not this file
+    if (!__map_perf_hooks) return -1;
+    if (ps.active) map_perf_stop(NULL);
+    memset(&ps, 0, sizeof(ps));
+
+    int i, n = 0;
+    ps.rep.available[MAP_PERF_NS] = 1;
+    for (i = 1; i < MAP_PERF_NCOUNTERS; i++) {
+        if (open_counter(&ps.ctrs[i], events[i].type, events[i].config) == 0) {
+            ps.rep.available[i] = 1;
+            n++;
+        }
+    }
+
+    ps.active = 1;
+    return n;
+}
+
+void map_perf_stop(map_perf_report *out) {
+    if (!ps.active) return;
+    ps.active = 0;
+
+    int i;
+    for (i = 1; i < MAP_PERF_NCOUNTERS; i++) {
+        if (ps.rep.available[i]) close_counter(&ps.ctrs[i]);
+    }
+    if (out) *out = ps.rep;
+}
+
+void map_perf_print(map_perf_report const *r, FILE *f) {
+    int op, i;
+
+    fprintf(f, "%-8s %12s", "op", "calls");
+    for (i = 0; i < MAP_PERF_NCOUNTERS; i++) fprintf(f, " %11s", ctr_names[i]);
+    fprintf(f, "   (per call)\n");
+
+    for (op = 0; op < MAP_PERF_NOPS; op++) {
+        fprintf(f, "%-8s %12llu", op_names[op], (unsigned long long) r->calls[op]);
+        for (i = 0; i < MAP_PERF_NCOUNTERS; i++) {
+            if (!r->available[i]) fprintf(f, " %11s", "n/a");
+            else if (!r->calls[op]) fprintf(f, " %11s", "-");
+            else fprintf(f, " %11.1f", (double) r->totals[op][i] / r->calls[op]);
+        }
+        fprintf(f, "\n");
+    }
+}
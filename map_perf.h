@@ -0,0 +1,74 @@
+#ifndef MAP_PERF_H
+#define MAP_PERF_H 1
+
+#include <stdio.h>
+#include <stdint.h>
+
+//Hardware counter instrumentation for the map. When map.c is built 
+//with -DMAP_PERF, the main operations mark where they start and end,
+//and if map_perf_start has been called on the current thread, the 
+//counters below get attributed to whichever operation is running. 
+//Attribution is exclusive: when map_insert has to call map_expand,
+//the rehash is charged to EXPAND and only the rest to INSERT.
+//
+//The counters come from perf_event_open and are read with rdpmc when
+//the kernel allows it (otherwise a read() per boundary, which is slow
+//enough to swamp small operations, so take those numbers with a 
+//grain of salt). If the machine has no PMU (e.g. most VMs) or 
+//perf_event_paranoid says no, the hardware counters are just marked 
+//unavailable and you still get the time spent in each operation.
+//Each boundary also reads the clock, and part of that lands in the 
+//numbers, so expect a few tens of ns of overhead per call.
+//
+//Without -DMAP_PERF, the hooks compile to nothing and map_perf_start
+//returns -1. Only map.c's build has to have the define; it tells us 
+//which way it went through __map_perf_hooks.
+
+enum {
+    MAP_PERF_SEARCH, //map_search, map_search_hashed
+    MAP_PERF_INSERT, //map_insert, map_insert_hashed, map_emplace
+    MAP_PERF_DELETE, //map_search_delete
+    MAP_PERF_EXPAND, //Any rehash: map_expand, map_reserve, new seeds
+    MAP_PERF_NOPS
+};
+
+enum {
+    MAP_PERF_NS,
+    MAP_PERF_CYCLES,
+    MAP_PERF_LLC_MISSES,
+    MAP_PERF_DTLB_MISSES,
+    MAP_PERF_BRANCH_MISSES,
+    MAP_PERF_NCOUNTERS
+};
+
+typedef struct {
+    uint64_t calls[MAP_PERF_NOPS];
+    uint64_t totals[MAP_PERF_NOPS][MAP_PERF_NCOUNTERS];
+    int available[MAP_PERF_NCOUNTERS];
+} map_perf_report;
+
+//Opens the counters for the calling thread and starts attributing.
+//Returns how many hardware counters could be opened (0 means only 
+//time is measured), or -1 if the hooks weren't compiled in.
+int map_perf_start(void);
+
+//Stops attributing, closes the counters, and fills in out (if given)
+//with everything since map_perf_start
+void map_perf_stop(map_perf_report *out);
+
+//Prints a table with per-call averages
+void map_perf_print(map_perf_report const *r, FILE *f);
+
+void __map_perf_begin(int op);
+void __map_perf_end(void);
+extern int const __map_perf_hooks; //Defined in map.c
+
+#ifdef MAP_PERF
+#define MAP_PERF_BEGIN(op) __map_perf_begin(op)
+#define MAP_PERF_END() __map_perf_end()
+#else
+#define MAP_PERF_BEGIN(op) do {} while (0)
+#define MAP_PERF_END() do {} while (0)
+#endif
+
+#endif
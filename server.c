@@ -0,0 +1,349 @@
+//Needed for accept4
+#define _GNU_SOURCE
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include "list.h"
+#include "kv.h"
+#include "server.h"
+#include "fast_fail.h"
+
+//How much we read from a connection at a time
+#define READ_CHUNK (64 << 10)
+//A command longer than this is probably garbage, so we hang up
+#define LINE_MAX_LEN (64 << 10)
+//Stop reading from a client that isn't picking up its responses once
+//this much is waiting
+#define OUT_HIGH (4 << 20)
+#define MAX_EVENTS 256
+
+typedef struct {
+    list_head node;
+    int fd;
+    char *in;
+    size_t in_len;
+    size_t in_cap;
+    kv_out out;
+    size_t out_off;  //How much of out has already been sent
+    uint32_t events; //What we're currently asking epoll for
+} conn;
+
+static volatile sig_atomic_t stop_serving;
+
+static void on_signal(int sig) {
+    (void) sig;
+    stop_serving = 1;
+}
+
+static int set_events(int ep, conn *c, uint32_t events) {
+    if (c->events == events) return 0;
+    struct epoll_event ev = {.events = events, .data.ptr = c};
+    c->events = events;
+    return epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void close_conn(int ep, conn *c) {
+    epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    list_del(&c->node);
+    free(c->in);
+    free(c->out.buf);
+    free(c);
+}
+
+//Sends as much of the pending output as the socket will take. Returns
+//negative if the client went away.
+static int flush_out(conn *c) {
+    while (c->out_off < c->out.len) {
+        ssize_t rc = send(c->fd, c->out.buf + c->out_off, c->out.len - c->out_off, MSG_NOSIGNAL);
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        c->out_off += rc;
+    }
+    c->out.len = c->out_off = 0;
+    return 0;
+}
+
+//Reads whatever the client has sent and runs every complete command
+//in it. Returns negative if the connection should be closed.
+static int handle_input(kv *db, conn *c) {
+    if (c->in_cap - c->in_len < READ_CHUNK) {
+        c->in_cap = c->in_len + READ_CHUNK;
+        c->in = realloc(c->in, c->in_cap);
+        if (!c->in) FAST_FAIL("out of memory");
+    }
+
+    ssize_t rc = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len);
+    if (rc < 0) return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    if (rc == 0) return -1;
+    c->in_len += rc;
+
+    char *start = c->in, *end = c->in + c->in_len, *nl;
+    while ((nl = memchr(start, '\n', end - start))) {
+        *nl = '\0';
+        kv_exec(db, start, &c->out);
+        start = nl + 1;
+    }
+
+    //Keep the partial command (if any) for next time
+    c->in_len = end - start;
+    if (c->in_len > LINE_MAX_LEN) return -1;
+    memmove(c->in, start, c->in_len);
+    return 0;
+}
+
+static void accept_all(int ep, int lfd, list_head *conns) {
+    for (;;) {
+        int fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) return; //EAGAIN, or nothing we can do anything about
+
+        conn *c = calloc(1, sizeof(*c));
+        if (!c) FAST_FAIL("out of memory");
+        c->fd = fd;
+        c->events = EPOLLIN;
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+        if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            free(c);
+            continue;
+        }
+        list_add(conns, &c->node);
+    }
+}
+
+static int listen_on(char const *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    unlink(path);
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(fd, 512) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int kv_serve(kv *db, char const *path) {
+    int lfd = listen_on(path);
+    if (lfd < 0) return -1;
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    if (ep < 0) {
+        close(lfd);
+        return -1;
+    }
+    struct epoll_event lev = {.events = EPOLLIN, .data.ptr = NULL};
+    epoll_ctl(ep, EPOLL_CTL_ADD, lfd, &lev);
+
+    //No SA_RESTART, so epoll_wait comes back with EINTR
+    struct sigaction sa = {.sa_handler = on_signal};
+    sigemptyset(&sa.sa_mask);
+    struct sigaction old_int, old_term;
+    stop_serving = 0;
+    sigaction(SIGINT, &sa, &old_int);
+    sigaction(SIGTERM, &sa, &old_term);
+
+    list_head conns = LIST_HEAD_INIT(conns);
+    struct epoll_event evs[MAX_EVENTS];
+
+    while (!stop_serving) {
+        int n = epoll_wait(ep, evs, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        int i;
+        for (i = 0; i < n; i++) {
+            conn *c = evs[i].data.ptr;
+            if (!c) {
+                accept_all(ep, lfd, &conns);
+                continue;
+            }
+
+            int rc = 0;
+            if (evs[i].events & EPOLLIN) rc = handle_input(db, c);
+            else if (evs[i].events & (EPOLLERR | EPOLLHUP)) rc = -1;
+            if (rc == 0) rc = flush_out(c);
+            if (rc < 0) {
+                close_conn(ep, c);
+                continue;
+            }
+
+            //If the client is slow to read, wait for room in the
+            //socket, and once there's a lot backed up, stop taking new
+            //commands from it until it catches up
+            size_t pending = c->out.len - c->out_off;
+            uint32_t want = EPOLLIN;
+            if (pending) want = (pending > OUT_HIGH) ? EPOLLOUT : EPOLLIN | EPOLLOUT;
+            if (set_events(ep, c, want) < 0) close_conn(ep, c);
+        }
+    }
+
+    while (!list_empty(&conns)) {
+        close_conn(ep, container_of(conns.next, conn, node));
+    }
+    close(ep);
+    close(lfd);
+    unlink(path);
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGTERM, &old_term, NULL);
+    return 0;
+}
+
+typedef struct {
+    kv_load_opts const *opts;
+    unsigned seed;
+    double *lat; //Latency of every command, in seconds
+    unsigned done;
+    int failed;
+} load_worker;
+
+static int connect_to(char const *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void *load_thread(void *arg) {
+    load_worker *lw = arg;
+    kv_load_opts const *o = lw->opts;
+
+    int fd = connect_to(o->path);
+    if (fd < 0) {
+        lw->failed = 1;
+        return NULL;
+    }
+
+    kv_out req = {0};
+    char resp[READ_CHUNK];
+    while (lw->done < o->nops) {
+        unsigned batch = o->nops - lw->done;
+        if (batch > o->depth) batch = o->depth;
+
+        req.len = 0;
+        unsigned i;
+        for (i = 0; i < batch; i++) {
+            char cmd[64];
+            unsigned key = rand_r(&lw->seed) % o->keyspace;
+            int len;
+            if ((unsigned) rand_r(&lw->seed) % 100 < o->get_pct) {
+                len = sprintf(cmd, "get k%u\n", key);
+            } else {
+                len = sprintf(cmd, "set k%u %u\n", key, rand_r(&lw->seed));
+            }
+            kv_out_append(&req, cmd, len);
+        }
+
+        double sent = now_sec();
+        size_t off = 0;
+        while (off < req.len) {
+            ssize_t rc = send(fd, req.buf + off, req.len - off, MSG_NOSIGNAL);
+            if (rc <= 0) goto fail;
+            off += rc;
+        }
+
+        //Every response is one line, so count newlines
+        unsigned got = 0;
+        while (got < batch) {
+            ssize_t rc = read(fd, resp, sizeof(resp));
+            if (rc <= 0) goto fail;
+            double t = now_sec() - sent;
+            char *p = resp, *end = resp + rc;
+            while ((p = memchr(p, '\n', end - p))) {
+                lw->lat[lw->done + got++] = t;
+                p++;
+            }
+        }
+        lw->done += batch;
+    }
+
+    free(req.buf);
+    close(fd);
+    return NULL;
+
+fail:
+    lw->failed = 1;
+    free(req.buf);
+    close(fd);
+    return NULL;
+}
+
+static int dbl_cmp(void const *a, void const *b) {
+    double x = *(double const*) a, y = *(double const*) b;
+    return (x > y) - (x < y);
+}
+
+int kv_load(kv_load_opts const *opts) {
+    if (!opts->conns || !opts->depth || !opts->keyspace) return -1;
+
+    load_worker *lw = calloc(opts->conns, sizeof(*lw));
+    pthread_t *tids = calloc(opts->conns, sizeof(*tids));
+    double *lat = malloc((size_t) opts->conns * opts->nops * sizeof(*lat));
+    if (!lw || !tids || (opts->nops && !lat)) FAST_FAIL("out of memory");
+
+    double start = now_sec();
+    unsigned i;
+    for (i = 0; i < opts->conns; i++) {
+        lw[i].opts = opts;
+        lw[i].seed = i + 1;
+        lw[i].lat = lat + (size_t) i * opts->nops;
+        if (pthread_create(&tids[i], NULL, load_thread, &lw[i])) {
+            FAST_FAIL("could not start load thread");
+        }
+    }
+
+    //Squash everyone's latencies together so we can sort them once
+    size_t total = 0;
+    int failed = 0;
+    for (i = 0; i < opts->conns; i++) {
+        pthread_join(tids[i], NULL);
+        memmove(lat + total, lw[i].lat, lw[i].done * sizeof(*lat));
+        total += lw[i].done;
+        failed |= lw[i].failed;
+    }
+    double secs = now_sec() - start;
+
+    printf(
+        "%u conns, depth %u, %u%% gets: %zu ops in %.3f s = %.0f ops/s\n",
+        opts->conns, opts->depth, opts->get_pct, total, secs, total / secs
+    );
+    if (total) {
+        qsort(lat, total, sizeof(*lat), dbl_cmp);
+        printf(
+            "latency us: p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+            lat[total / 2] * 1e6, lat[total * 99 / 100] * 1e6,
+            lat[total * 999 / 1000] * 1e6, lat[total - 1] * 1e6
+        );
+    }
+    if (failed) fprintf(stderr, "Some connections failed\n");
+
+    free(lat);
+    free(tids);
+    free(lw);
+    return failed ? -1 : 0;
+}
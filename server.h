@@ -0,0 +1,33 @@
+#ifndef SERVER_H
+#define SERVER_H 1
+
+#include "kv.h"
+
+//Serves db over a Unix domain socket at path, using the protocol in 
+//kv_exec: newline-terminated commands in, one newline-terminated 
+//response per command out. Everything runs on one thread with an 
+//epoll loop, so there's no locking around the map. Clients are free 
+//to pipeline: each read can pull in any number of commands, and all
+//of their responses go back in a single write.
+//
+//Runs until SIGINT or SIGTERM, then returns 0 (or negative if the 
+//socket couldn't be set up). Removes the socket file on the way out.
+int kv_serve(kv *db, char const *path);
+
+//Load generator for kv_serve. Opens conns connections (one thread 
+//each), and on each one keeps sending batches of depth commands and 
+//waiting for all the responses. Prints the overall throughput and 
+//the latency percentiles of individual commands, where a command's
+//latency is from when its batch was sent until its response arrived.
+typedef struct {
+    char const *path;
+    unsigned conns;
+    unsigned depth;    //Commands per batch
+    unsigned nops;     //Commands per connection
+    unsigned keyspace; //Keys are k0 to k<keyspace-1>
+    unsigned get_pct;  //The rest are sets
+} kv_load_opts;
+
+int kv_load(kv_load_opts const *opts);
+
+#endif
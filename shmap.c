@@ -0,0 +1,313 @@
+//Needed for memfd_create
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shmap.h"
+#include "map.h"
+
+#define SHMAP_MAGIC 0x50414d48 //"HMAP"
+
+//How many times in a row a reader will see the same odd sequence number
+//before deciding the writer died in the middle of a change. Each try
+//is a sched_yield, so this works out to somewhere around a second.
+#define SHMAP_SPIN_LIMIT (1u << 20)
+
+//This is what sits at the start of the region. It's followed by 
+//capacity bucket heads and then capacity entries. All the links 
+//(bucket heads, entry next fields and free_head) are entry indices 
+//plus one, so that 0 can mean "nothing".
+struct shmap_hdr {
+    uint32_t magic;
+    uint32_t seq;       //Odd while the writer is in the middle of a change
+    uint32_t capacity;
+    uint32_t key_sz;
+    uint32_t val_sz;
+    uint32_t entry_sz;
+    uint32_t count;
+    uint32_t free_head; //Free entries are chained through their next field
+    uint64_t entries_off;
+    uint64_t seed;      //For map_val_hash
+};
+
+//Each entry is laid out as:
+//  uint32_t next; 
+//  char key[key_sz]; 
+//  char val[val_sz];
+//We only ever memcpy keys and values, so there's no need to align them.
+#define ENTRY_KEY_OFF sizeof(uint32_t)
+
+static inline uint32_t *bucket_heads(shmap_hdr *h) {
+    return (void*)h + sizeof(shmap_hdr);
+}
+
+static inline void *entry_at(shmap_hdr *h, uint32_t link) {
+    //link is index+1
+    return (void*)h + h->entries_off + (uint64_t)(link - 1)*h->entry_sz;
+}
+
+//The links get read by readers while the writer might be changing them,
+//so we always touch them through these. Relaxed is enough because the 
+//sequence number does the real ordering work.
+static inline uint32_t load_link(uint32_t const *p) {
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+static inline void store_link(uint32_t *p, uint32_t v) {
+    __atomic_store_n(p, v, __ATOMIC_RELAXED);
+}
+
+static inline void write_begin(shmap_hdr *h) {
+    __atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void write_end(shmap_hdr *h) {
+    __atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELEASE);
+}
+
+//Returns 0 if the sizes are too big to fit in the header
+static uint32_t entry_size(uint32_t key_sz, uint32_t val_sz) {
+    uint64_t sz = ENTRY_KEY_OFF + (uint64_t)key_sz + val_sz;
+    sz = (sz + 7) & ~(uint64_t)7;
+    return sz > UINT32_MAX ? 0 : sz;
+}
+
+static size_t region_size(uint32_t capacity, uint32_t entry_sz, uint64_t *entries_off) {
+    uint64_t off = sizeof(shmap_hdr) + (uint64_t)capacity*sizeof(uint32_t);
+    off = (off + 63) & ~(uint64_t)63; //Start entries on a cache line
+    *entries_off = off;
+    return off + (uint64_t)capacity*entry_sz;
+}
+
+static int map_region(shmap *sm, int fd, size_t len, int writable) {
+    int prot = writable ? PROT_READ|PROT_WRITE : PROT_READ;
+    void *base = mmap(NULL, len, prot, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) return -1;
+
+    *sm = (shmap) {
+        .hdr = base,
+        .len = len,
+        .fd = fd,
+        .writable = writable
+    };
+
+    return 0;
+}
+
+int shmap_create(
+    shmap *sm, char const *name, 
+    uint32_t capacity, unsigned key_sz, unsigned val_sz
+) {
+    if (capacity == 0 || key_sz == 0) return -1;
+
+    uint32_t entry_sz = entry_size(key_sz, val_sz);
+    if (!entry_sz) return -1;
+    uint64_t entries_off;
+    size_t len = region_size(capacity, entry_sz, &entries_off);
+
+    int fd = name ? shm_open(name, O_CREAT|O_EXCL|O_RDWR, 0600) : memfd_create("shmap", 0);
+    if (fd < 0) return -1;
+
+    //ftruncate gives us zeroed memory, so all the buckets start empty
+    if (ftruncate(fd, len) < 0 || map_region(sm, fd, len, 1) < 0) {
+        close(fd);
+        if (name) shm_unlink(name);
+        return -1;
+    }
+
+    shmap_hdr *h = sm->hdr;
+    h->capacity = capacity;
+    h->key_sz = key_sz;
+    h->val_sz = val_sz;
+    h->entry_sz = entry_sz;
+    h->entries_off = entries_off;
+    h->seed = __map_random_seed();
+
+    //Chain every entry into the free list
+    uint32_t i;
+    for (i = 1; i < capacity; i++) {
+        *(uint32_t*)entry_at(h, i) = i + 1;
+    }
+    *(uint32_t*)entry_at(h, capacity) = 0;
+    h->free_head = 1;
+
+    //Write the magic number last so nobody who attaches early mistakes
+    //a half-built region for a real one
+    __atomic_store_n(&h->magic, SHMAP_MAGIC, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+int shmap_attach_fd(shmap *sm, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(shmap_hdr)) return -1;
+
+    if (map_region(sm, fd, st.st_size, 0) < 0) return -1;
+
+    //Make sure this is actually a shmap, and that it's as big as it 
+    //says it is (otherwise a bad header could send us off the end). 
+    //Searches copy key_sz and val_sz bytes out of each entry, so those
+    //have to agree with entry_sz too.
+    shmap_hdr *h = sm->hdr;
+    uint64_t entries_off;
+    if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != SHMAP_MAGIC 
+        || h->capacity == 0
+        || h->key_sz == 0
+        || h->entry_sz != entry_size(h->key_sz, h->val_sz)
+        || region_size(h->capacity, h->entry_sz, &entries_off) > sm->len
+        || entries_off != h->entries_off
+    ) {
+        munmap(sm->hdr, sm->len);
+        return -1;
+    }
+
+    return 0;
+}
+
+int shmap_attach(shmap *sm, char const *name) {
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) return -1;
+
+    if (shmap_attach_fd(sm, fd) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+void shmap_detach(shmap *sm) {
+    munmap(sm->hdr, sm->len);
+    close(sm->fd);
+    sm->hdr = NULL;
+}
+
+int shmap_unlink(char const *name) {
+    return shm_unlink(name);
+}
+
+int shmap_search(shmap const *sm, void const *key, void *val_dst) {
+    shmap_hdr *h = sm->hdr;
+    uint32_t key_sz = h->key_sz;
+    uint32_t capacity = h->capacity;
+    uint32_t bucket = map_val_hash(key, key_sz, h->seed) % capacity;
+    uint32_t stuck_seq = 0, stuck = 0;
+
+    while (1) {
+        uint32_t seq = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            //Writer is busy. Give it a chance to finish, but if it 
+            //never does, it's probably dead and we'd spin forever
+            if (seq != stuck_seq) {
+                stuck_seq = seq;
+                stuck = 0;
+            } else if (++stuck >= SHMAP_SPIN_LIMIT) {
+                return -1;
+            }
+            sched_yield();
+            continue;
+        }
+
+        int found = 0;
+        uint32_t link = load_link(bucket_heads(h) + bucket);
+        //If the writer changes things under us we could see a garbage
+        //link or even a loop, so don't trust anything we read until the
+        //sequence number checks out. The hop limit stops us from 
+        //spinning forever on a loop.
+        uint32_t hops = 0;
+        while (link && link <= capacity && hops++ < capacity) {
+            void *entry = entry_at(h, link);
+            if (!memcmp(entry + ENTRY_KEY_OFF, key, key_sz)) {
+                memcpy(val_dst, entry + ENTRY_KEY_OFF + key_sz, h->val_sz);
+                found = 1;
+                break;
+            }
+            link = load_link(entry);
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&h->seq, __ATOMIC_RELAXED) == seq) {
+            return found ? 0 : 1;
+        }
+    }
+}
+
+//Writer-side lookup. Since there's only one writer, nothing can change
+//under us, so no sequence number games. Sets *prev_link to whatever
+//points at the entry we found (either a bucket head or a next field).
+static uint32_t writer_find(shmap_hdr *h, void const *key, uint32_t **prev_link) {
+    uint32_t *prev = bucket_heads(h) + map_val_hash(key, h->key_sz, h->seed) % h->capacity;
+    uint32_t link = *prev;
+    while (link) {
+        void *entry = entry_at(h, link);
+        if (!memcmp(entry + ENTRY_KEY_OFF, key, h->key_sz)) break;
+        prev = entry;
+        link = *prev;
+    }
+
+    *prev_link = prev;
+    return link;
+}
+
+int shmap_insert(shmap *sm, void const *key, void const *val) {
+    if (!sm->writable) return -2;
+    shmap_hdr *h = sm->hdr;
+
+    uint32_t *prev;
+    uint32_t link = writer_find(h, key, &prev);
+    if (link) {
+        write_begin(h);
+        memcpy(entry_at(h, link) + ENTRY_KEY_OFF + h->key_sz, val, h->val_sz);
+        write_end(h);
+        return 1;
+    }
+
+    if (!h->free_head) return -1; //Full
+
+    //prev is now the last next field in the chain (or the bucket head
+    //if the chain was empty), so we can just tack the new entry on
+    write_begin(h);
+    link = h->free_head;
+    void *entry = entry_at(h, link);
+    h->free_head = *(uint32_t*)entry;
+    memcpy(entry + ENTRY_KEY_OFF, key, h->key_sz);
+    memcpy(entry + ENTRY_KEY_OFF + h->key_sz, val, h->val_sz);
+    store_link(entry, 0);
+    store_link(prev, link);
+    h->count++;
+    write_end(h);
+
+    return 0;
+}
+
+int shmap_delete(shmap *sm, void const *key) {
+    if (!sm->writable) return -2;
+    shmap_hdr *h = sm->hdr;
+
+    uint32_t *prev;
+    uint32_t link = writer_find(h, key, &prev);
+    if (!link) return 1;
+
+    write_begin(h);
+    uint32_t *entry = entry_at(h, link);
+    store_link(prev, *entry);
+    store_link(entry, h->free_head);
+    h->free_head = link;
+    h->count--;
+    write_end(h);
+
+    return 0;
+}
+
+uint32_t shmap_count(shmap const *sm) {
+    return __atomic_load_n(&sm->hdr->count, __ATOMIC_RELAXED);
+}
+
+uint32_t shmap_version(shmap const *sm) {
+    return __atomic_load_n(&sm->hdr->seq, __ATOMIC_ACQUIRE) / 2;
+}
@@ -0,0 +1,85 @@
+#ifndef SHMAP_H
+#define SHMAP_H 1
+
+#include <stdint.h>
+#include <stddef.h>
+
+//A fixed-capacity map that lives in a shared memory region, so that 
+//one writer process and any number of reader processes can all use 
+//the same copy of the table. The regular map can't do this: its 
+//list_heads and string keys are pointers that only make sense in the 
+//process that made them, and nothing stops a reader from seeing half 
+//of an insert. So this one is different in a few ways:
+//
+// - Everything in the region is addressed by index, never by pointer,
+//   so it doesn't matter where each process ends up mapping it.
+// - Keys and values are fixed-size blobs that are stored inline and 
+//   compared with memcmp (hashed with map_val_hash). If you want 
+//   string keys, use a zero-padded char array.
+// - The capacity is fixed when the region is created. There's no 
+//   map_expand, because readers would have to remap.
+// - The writer bumps a sequence number before and after every change 
+//   (a seqlock). Readers copy what they need out of the region and 
+//   then check that the sequence number didn't move; if it did, they 
+//   just try again. Readers never write to the region, so there's 
+//   no cost to having lots of them.
+//
+//Only the process that called shmap_create may write. Everyone else 
+//attaches read-only.
+//
+//If the writer dies in the middle of a change, the sequence number is
+//left odd and nobody can tell what state the table is in. Readers give
+//up after a while (see shmap_search) rather than spinning forever, but
+//there's no recovering the region; make a new one.
+
+typedef struct shmap_hdr shmap_hdr;
+
+typedef struct {
+    shmap_hdr *hdr; //Start of the mapping
+    size_t len;     //Size of the mapping
+    int fd;
+    int writable;
+} shmap;
+
+//Creates a new region big enough for capacity entries and maps it for 
+//writing. If name is given, it's a POSIX shared memory name (like 
+//"/my_table") that other processes can shmap_attach to. If name is 
+//NULL, we use an anonymous memfd instead; share it by forking or by 
+//passing sm->fd over a Unix socket, then use shmap_attach_fd. Returns
+//0 on success or negative on error (errno is left set).
+int shmap_create(
+    shmap *sm, char const *name, 
+    uint32_t capacity, unsigned key_sz, unsigned val_sz
+);
+
+//Maps an existing region read-only. Returns 0 on success or negative
+//on error (including if the region doesn't look like a shmap).
+int shmap_attach(shmap *sm, char const *name);
+int shmap_attach_fd(shmap *sm, int fd);
+
+//Unmaps the region and closes our fd. The region itself sticks around
+//until it's unlinked (or, for a memfd, until every fd is closed).
+void shmap_detach(shmap *sm);
+int shmap_unlink(char const *name);
+
+//Copies the value for key into val_dst. Returns 0 if found, 1 if not,
+//or negative if the writer seems to have died partway through a change
+//(the sequence number stayed odd for about a second). Safe to call from
+//any number of processes while the writer is busy.
+int shmap_search(shmap const *sm, void const *key, void *val_dst);
+
+//Writer only. Returns 0 on success, 1 if previous value overwritten,
+//or negative on error (the map is full, or we're not the writer).
+int shmap_insert(shmap *sm, void const *key, void const *val);
+
+//Writer only. Returns 0 if the entry was deleted, 1 if it wasn't 
+//found, or negative on error.
+int shmap_delete(shmap *sm, void const *key);
+
+uint32_t shmap_count(shmap const *sm);
+
+//Goes up by one for every change the writer makes. Readers can use 
+//this to notice that something changed since they last looked.
+uint32_t shmap_version(shmap const *sm);
+
+#endif
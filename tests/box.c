@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "map.h"
+#include "test.h"
+
+typedef struct {
+    unsigned k;
+    char pad[252];
+} big;
+
+static big make(unsigned v) {
+    big b;
+    memset(&b, v & 0xff, sizeof(b));
+    b.k = v;
+    return b;
+}
+
+static int is(big const *b, unsigned v) {
+    big want = make(v);
+    return b && !memcmp(b, &want, sizeof(want));
+}
+
+static int odd(void *key, void *val, void *ctx) {
+    (void) key;
+    (void) ctx;
+    return ((big*) val)->k & 1;
+}
+
+//Random ops on a boxed map (boxed after it already has things in it)
+//against the same ops on a plain one
+static void matches_plain(void) {
+    map a, b, c;
+    map_init(&a, unsigned, big, VAL2VAL);
+    map_init(&b, unsigned, big, VAL2VAL);
+    map_front_enable(&a, 64);
+    unsigned i;
+    for (i = 0; i < 500; i++) {
+        big v = make(i);
+        map_insert(&a, &i, 0, &v, 0);
+        map_insert(&b, &i, 0, &v, 0);
+    }
+    CHECK(map_box_values(&a) == 0);
+    CHECK(map_box_values(&a) == 0);
+    CHECK(a.entry_sz < b.entry_sz);
+    for (i = 0; i < 500; i++) CHECK(is(map_search(&a, &i), i));
+
+    unsigned seed = 1;
+    for (i = 0; i < 500000; i++) {
+        unsigned k = rand_r(&seed) % 20000, op = rand_r(&seed) % 10;
+        big v = make(rand_r(&seed));
+        if (op < 4) {
+            CHECK(map_insert(&a, &k, 0, &v, 0) == map_insert(&b, &k, 0, &v, 0));
+        } else if (op < 6) {
+            CHECK(map_search_delete(&a, &k, NULL) == map_search_delete(&b, &k, NULL));
+        } else if (op < 7) {
+            int x_new, y_new;
+            big *x = map_emplace(&a, &k, 0, &x_new), *y = map_emplace(&b, &k, 0, &y_new);
+            CHECK(x_new == y_new);
+            CHECK(!memcmp(x, y, sizeof(big)));
+        } else {
+            big *x = op < 9 ? map_search(&a, &k) : map_search_touch(&a, &k);
+            big *y = map_search(&b, &k);
+            CHECK(!x == !y);
+            CHECK(!x || !memcmp(x, y, sizeof(big)));
+        }
+        if (i == 150000) {
+            CHECK(map_clone(&a, &c, 0) == 0);
+            map_free(&a);
+            CHECK(map_clone(&c, &a, 0) == 0);
+            map_free(&c);
+            CHECK(a.boxes);
+        }
+        if (i == 300000) CHECK(map_remove_if(&a, odd, NULL) == map_remove_if(&b, odd, NULL));
+    }
+    CHECK(a.count == b.count);
+    unsigned n = 0;
+    map_iter it;
+    for (it = map_begin(&a); it != map_end(&a); map_iter_step(it)) {
+        unsigned k;
+        big v;
+        map_iter_deref(&a, it, &k, &v);
+        CHECK(!memcmp(&v, map_search(&b, &k), sizeof(v)));
+        n++;
+    }
+    CHECK(n == a.count);
+    map_free(&a);
+    map_free(&b);
+}
+
+//The whole point: pointers into boxes survive growth, and merging
+//works between boxed and plain maps in both directions
+static void stable(void) {
+    map a, b, c;
+    map_init(&a, unsigned, big, VAL2VAL);
+    map_init(&b, unsigned, big, VAL2VAL);
+    map_init(&c, unsigned, big, VAL2VAL);
+    CHECK(map_box_values(&a) == 0);
+    CHECK(map_box_values(&c) == 0);
+
+    static big *ptrs[1000];
+    unsigned i;
+    for (i = 0; i < 100000; i++) {
+        big v = make(i);
+        map_insert(&a, &i, 0, &v, 0);
+        if (i < 1000) ptrs[i] = map_search(&a, &i);
+    }
+    for (i = 0; i < 1000; i++) {
+        CHECK(map_search(&a, &i) == ptrs[i]);
+        CHECK(is(ptrs[i], i));
+    }
+
+    map_merge(&b, &a, MAP_MERGE_TAKE_SRC);
+    map_merge(&c, &b, MAP_MERGE_KEEP_DST);
+    CHECK(b.count == 100000 && c.count == 100000);
+    for (i = 0; i < 100000; i++) {
+        CHECK(is(map_search(&b, &i), i));
+        CHECK(is(map_search(&c, &i), i));
+    }
+    map_free(&a);
+    map_free(&b);
+    map_free(&c);
+}
+
+//String keys with the index and cache mode on top, where evictions 
+//have to give the boxes back
+static void with_extras(void) {
+    map m;
+    map_init(&m, char const*, big, STR2VAL);
+    CHECK(map_index_enable(&m) == 0);
+    CHECK(map_box_values(&m) == 0);
+    map_set_capacity(&m, 5000, NULL, NULL);
+    unsigned i;
+    for (i = 0; i < 20000; i++) {
+        char buf[16];
+        sprintf(buf, "k%05u", i);
+        big v = make(i);
+        map_insert(&m, strdup(buf), 1, &v, 0);
+    }
+    CHECK(m.count == 5000);
+
+    unsigned n = 0;
+    map_range_iter r = map_prefix_scan(&m, "k1", 2);
+    map_iter it;
+    while ((it = map_range_next(&r))) {
+        char const *k;
+        big v;
+        map_iter_deref(&m, it, &k, &v);
+        CHECK(is(&v, atoi(k + 1)));
+        n++;
+    }
+    CHECK(n > 0);
+    map_free(&m);
+
+    set s;
+    set_init(&s, unsigned, SET_VAL);
+    CHECK(map_box_values(&s) == -1);
+    set_free(&s);
+}
+
+int main(void) {
+    matches_plain();
+    stable();
+    with_extras();
+    puts("box ok");
+    return 0;
+}
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "map.h"
+#include "test.h"
+
+#define KEYS 100000
+#define CAP 1000
+
+static char present[KEYS];
+static unsigned evicted;
+
+static void on_evict(void *key, void *val, void *ctx) {
+    (void) ctx;
+    unsigned k = atoi(*(char**) key + 1);
+    CHECK(*(uint32_t*) val == k && present[k]);
+    present[k] = 0;
+    evicted++;
+}
+
+//Looks up k1..k3 and then inserts k4. Returns which of k0..k3 got 
+//evicted to make room.
+static int evicted_after(int touch) {
+    map m;
+    map_init(&m, char const*, uint32_t, STR2VAL);
+    map_set_capacity(&m, 4, NULL, NULL);
+    uint32_t i;
+    char buf[16];
+    for (i = 0; i < 4; i++) {
+        sprintf(buf, "k%u", i);
+        map_insert(&m, strdup(buf), 1, &i, 0);
+    }
+    for (i = 1; i < 4; i++) {
+        sprintf(buf, "k%u", i);
+        CHECK(*(uint32_t*) (touch ? map_search_touch(&m, buf) : map_search(&m, buf)) == i);
+    }
+    map_insert(&m, strdup("k4"), 1, &i, 0);
+    CHECK(m.count == 4);
+
+    int gone = -1;
+    for (i = 0; i < 4; i++) {
+        sprintf(buf, "k%u", i);
+        if (!map_search(&m, buf)) gone = i;
+    }
+    map_free(&m);
+    return gone;
+}
+
+//Skewed traffic: a few hot keys and a long tail. The cache should keep
+//the hot keys, never go over its limit, and tell us about everything
+//it throws out.
+static void skewed(void) {
+    map m;
+    map_init(&m, char const*, uint32_t, STR2VAL);
+    map_set_capacity(&m, CAP, on_evict, NULL);
+
+    unsigned seed = 3, inserted = 0, hot_tries = 0, hot_hits = 0, i;
+    for (i = 0; i < 500000; i++) {
+        uint32_t k = rand_r(&seed) % 4 ? rand_r(&seed) % 50 : rand_r(&seed) % KEYS;
+        char buf[16];
+        sprintf(buf, "k%u", k);
+        unsigned op = rand_r(&seed) % 20;
+        if (op < 10) {
+            uint32_t *v = map_search_touch(&m, buf);
+            CHECK(!v == !present[k]);
+            CHECK(!v || *v == k);
+            if (k < 50) {
+                hot_tries++;
+                hot_hits += v != NULL;
+            }
+        } else if (op < 19) {
+            if (map_insert(&m, strdup(buf), 1, &k, 0) == 0) {
+                present[k] = 1;
+                inserted++;
+            }
+        } else if (map_search_delete(&m, buf, NULL) == 0) {
+            present[k] = 0;
+            inserted--;
+        }
+        CHECK(m.count <= CAP);
+    }
+    CHECK(m.count == inserted - evicted);
+    CHECK(hot_hits > hot_tries / 100 * 85);
+
+    map_set_capacity(&m, 10, on_evict, NULL);
+    CHECK(m.count == 10);
+    map c;
+    CHECK(map_clone(&m, &c, MAP_CLONE_DEEP) == 0);
+    CHECK(c.count == 10);
+    map_free(&c);
+    map_free(&m);
+}
+
+int main(void) {
+    //Only the touched keys are safe. Plain searches don't protect 
+    //anything, so which key goes depends on where the hand starts 
+    //(which depends on the random seed), and over enough tries it 
+    //won't always be k0.
+    int i, not_k0 = 0;
+    for (i = 0; i < 50; i++) {
+        CHECK(evicted_after(1) == 0);
+        not_k0 += evicted_after(0) != 0;
+    }
+    CHECK(not_k0 > 0);
+    skewed();
+    puts("cache ok");
+    return 0;
+}
@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "map.h"
+#include "test.h"
+
+#define N 5000
+
+static char *str_of(unsigned i) {
+    char buf[16];
+    sprintf(buf, "k%u", i);
+    return strdup(buf);
+}
+
+//A deep copy owns its own keys and values, so it doesn't care what 
+//happens to the original afterwards (including being freed). A 
+//shallow one shares them, so it's only good until the original 
+//changes.
+static void deep_and_shallow(void) {
+    map m, deep, shallow;
+    map_init(&m, char const*, char const*, STR2STR);
+    unsigned i;
+    for (i = 0; i < N; i++) map_insert(&m, str_of(i), 1, str_of(i * 2), 1);
+    for (i = 0; i < N; i += 3) {
+        char *k = str_of(i);
+        map_search_delete(&m, k, NULL);
+        free(k);
+    }
+    CHECK(map_clone(&m, &deep, MAP_CLONE_DEEP) == 0);
+    CHECK(map_clone(&m, &shallow, MAP_CLONE_SHALLOW) == 0);
+    CHECK(deep.count == m.count && shallow.count == m.count);
+
+    for (i = 0; i < N; i++) {
+        char *k = str_of(i);
+        char const **dv = map_search(&deep, k), **sv = map_search(&shallow, k);
+        char const **mv = map_search(&m, k);
+        if (i % 3 == 0) {
+            CHECK(!dv && !sv);
+        } else {
+            CHECK(dv && sv && mv);
+            CHECK(*sv == *mv);
+            CHECK(*dv != *mv && !strcmp(*dv, *mv));
+        }
+        free(k);
+    }
+    map_free(&shallow);
+
+    //Change the copy; the original doesn't notice
+    for (i = 0; i < N; i += 2) {
+        char *k = str_of(i);
+        map_search_delete(&deep, k, NULL);
+        free(k);
+    }
+    for (i = N; i < 2 * N; i++) map_insert(&deep, str_of(i), 1, str_of(i * 2), 1);
+    map_free(&m);
+
+    unsigned n = 0;
+    map_iter it;
+    for (it = map_begin(&deep); it != map_end(&deep); map_iter_step(it)) n++;
+    CHECK(n == deep.count);
+    for (i = 0; i < 2 * N; i++) {
+        char *k = str_of(i), *want = str_of(i * 2);
+        char const **v = map_search(&deep, k);
+        int present = i >= N || (i % 3 && i % 2);
+        CHECK(!v == !present);
+        CHECK(!v || !strcmp(*v, want));
+        free(k);
+        free(want);
+    }
+    map_free(&deep);
+}
+
+static int my_str_comp(void const *a, void const *b, unsigned sz) {
+    (void) sz;
+    return strcmp(*(char const**) a, *(char const**) b);
+}
+
+//Small maps, boxed values and plain values all copy too
+static void kinds(void) {
+    map m, c;
+    map_init(&m, uint64_t, uint64_t, VAL2VAL);
+    uint64_t i;
+    for (i = 0; i < 5; i++) map_insert(&m, &i, 0, &i, 0);
+    CHECK(m.small);
+    CHECK(map_clone(&m, &c, MAP_CLONE_DEEP) == 0);
+    CHECK(c.count == 5);
+    for (i = 0; i < 5; i++) CHECK(*(uint64_t*) map_search(&c, &i) == i);
+    map_free(&c);
+
+    for (; i < 1000; i++) map_insert(&m, &i, 0, &i, 0);
+    CHECK(map_box_values(&m) == 0);
+    CHECK(map_clone(&m, &c, MAP_CLONE_SHALLOW) == 0);
+    map_free(&m);
+    for (i = 0; i < 1000; i++) CHECK(*(uint64_t*) map_search(&c, &i) == i);
+    map_free(&c);
+
+    //We don't know how to copy keys with a custom compare function
+    map_init(&m, char const*, uint32_t, STR2VAL);
+    m.key_comp = my_str_comp;
+    CHECK(map_clone(&m, &c, MAP_CLONE_DEEP_KEYS) < 0);
+    CHECK(map_clone(&m, &c, MAP_CLONE_SHALLOW) == 0);
+    map_free(&c);
+    map_free(&m);
+}
+
+int main(void) {
+    deep_and_shallow();
+    kinds();
+    puts("clone ok");
+    return 0;
+}
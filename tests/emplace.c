@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "map.h"
+#include "test.h"
+
+#define KEYS 2000
+
+static int ref_has[KEYS];
+static uint32_t ref_val[KEYS];
+
+static void check_all(map const *m) {
+    char buf[32];
+    unsigned k, n = 0;
+    for (k = 0; k < KEYS; k++) {
+        sprintf(buf, "k%u", k);
+        uint32_t *v = map_search(m, buf);
+        uint32_t *hv = map_search_hashed(m, buf, map_hash_key(m, buf));
+        CHECK(v == hv);
+        CHECK(!v == !ref_has[k]);
+        CHECK(!v || *v == ref_val[k]);
+        n += ref_has[k];
+    }
+    CHECK(m->count == n);
+}
+
+//map_emplace and map_insert_hashed against a reference array, across
+//growth (which is where a stale precomputed hash would bite)
+static void matches_ref(void) {
+    map m;
+    map_init(&m, char const*, uint32_t, STR2VAL);
+    unsigned seed = 1, i;
+    for (i = 0; i < 200000; i++) {
+        unsigned k = rand_r(&seed) % KEYS, op = rand_r(&seed) % 3;
+        char buf[32];
+        sprintf(buf, "k%u", k);
+        if (op == 0) {
+            char *c = strdup(buf);
+            int inserted;
+            uint32_t *v = map_emplace(&m, c, 1, &inserted);
+            CHECK(inserted == !ref_has[k]);
+            if (inserted) CHECK(*v == 0);
+            else free(c);
+            *v = ref_val[k] = rand_r(&seed);
+            ref_has[k] = 1;
+        } else if (op == 1) {
+            uint32_t val = rand_r(&seed);
+            char *c = strdup(buf);
+            int rc = map_insert_hashed(&m, c, 1, &val, 0, map_hash_key(&m, c));
+            CHECK(rc == ref_has[k]);
+            ref_has[k] = 1;
+            ref_val[k] = val;
+        } else {
+            CHECK(map_search_delete(&m, buf, NULL) == !ref_has[k]);
+            ref_has[k] = 0;
+        }
+        if (i % 9973 == 0) check_all(&m);
+    }
+    check_all(&m);
+    map_free(&m);
+}
+
+//The usual reason for emplace: counting things in one probe each
+static void word_count(void) {
+    static char const *words[] = {"a", "b", "a", "c", "a", "b"};
+    map m;
+    map_init(&m, char const*, unsigned, STR2VAL);
+    unsigned i;
+    for (i = 0; i < sizeof(words) / sizeof(*words); i++) {
+        int inserted;
+        (*(unsigned*) map_emplace(&m, words[i], 0, &inserted))++;
+    }
+    CHECK(m.count == 3);
+    CHECK(*(unsigned*) map_search(&m, "a") == 3);
+    CHECK(*(unsigned*) map_search(&m, "b") == 2);
+    CHECK(*(unsigned*) map_search(&m, "c") == 1);
+    map_free(&m);
+}
+
+//A hash is good for any map with the same hash function and seed
+static void shared_hash(void) {
+    map a, b;
+    map_init(&a, uint64_t, uint32_t, VAL2VAL);
+    map_init(&b, uint64_t, uint32_t, VAL2VAL);
+    map_set_seed(&a, 42);
+    map_set_seed(&b, 42);
+    uint64_t k;
+    for (k = 0; k < 1000; k++) {
+        uint32_t h = map_hash_key(&a, &k), v = k;
+        CHECK(map_hash_key(&b, &k) == h);
+        CHECK(map_insert_hashed(&a, &k, 0, &v, 0, h) == 0);
+        v++;
+        CHECK(map_insert_hashed(&b, &k, 0, &v, 0, h) == 0);
+    }
+    for (k = 0; k < 1000; k++) {
+        uint32_t h = map_hash_key(&a, &k);
+        CHECK(*(uint32_t*) map_search_hashed(&a, &k, h) == k);
+        CHECK(*(uint32_t*) map_search_hashed(&b, &k, h) == k + 1);
+    }
+    map_free(&a);
+    map_free(&b);
+}
+
+int main(void) {
+    matches_ref();
+    word_count();
+    shared_hash();
+    puts("emplace ok");
+    return 0;
+}
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "map.h"
+#include "test.h"
+
+#define KEYS 5000
+
+static char ref[KEYS];
+static uint32_t ref_val[KEYS];
+
+static uint64_t key_of(unsigned k) {
+    return k * 7919ull;
+}
+
+//Checks every key we might have inserted, plus some we never did
+static void compare(map const *m) {
+    unsigned k, n = 0;
+    for (k = 0; k < KEYS; k++) {
+        uint64_t kk = key_of(k);
+        uint32_t *v = map_search(m, &kk);
+        if (ref[k]) {
+            CHECK(v && *v == ref_val[k]);
+            n++;
+        } else {
+            CHECK(!v);
+        }
+    }
+    CHECK(m->count == n);
+    for (k = KEYS; k < KEYS + 2000; k++) {
+        uint64_t kk = key_of(k);
+        CHECK(!map_search(m, &kk));
+    }
+}
+
+static int is_one_mod_3(void *key, void *val, void *ctx) {
+    (void) val;
+    (void) ctx;
+    return *(uint64_t*) key / 7919 % 3 == 1;
+}
+
+//The filter must never turn away a key that's there, through inserts,
+//deletes (which leave stale bits until a rebuild) and everything else
+//that rebuilds or copies it
+static void matches_ref(void) {
+    map m;
+    map_init(&m, uint64_t, uint32_t, VAL2VAL);
+    map_filter_enable(&m, 0);
+    CHECK(!m.small && m.filter);
+
+    unsigned seed = 5, i;
+    for (i = 0; i < 200000; i++) {
+        unsigned k = rand_r(&seed) % KEYS, op = rand_r(&seed) % 10;
+        uint64_t kk = key_of(k);
+        if (op < 5) {
+            uint32_t v = rand_r(&seed);
+            CHECK(map_insert(&m, &kk, 0, &v, 0) == ref[k]);
+            ref[k] = 1;
+            ref_val[k] = v;
+        } else if (op < 9) {
+            CHECK(map_search_delete(&m, &kk, NULL) == !ref[k]);
+            ref[k] = 0;
+        } else {
+            uint32_t *v = map_search(&m, &kk);
+            CHECK(ref[k] ? v && *v == ref_val[k] : !v);
+        }
+
+        if (i % 20000 == 0) compare(&m);
+        if (i == 100000) {
+            map_clear(&m);
+            memset(ref, 0, sizeof(ref));
+            compare(&m);
+        } else if (i == 120000) {
+            map c;
+            CHECK(map_clone(&m, &c, 0) == 0);
+            CHECK(c.filter);
+            compare(&c);
+            map_free(&c);
+        } else if (i == 130000) {
+            map_set_seed(&m, 1234);
+            compare(&m);
+        } else if (i == 140000) {
+            uint32_t n = map_remove_if(&m, is_one_mod_3, NULL);
+            unsigned k2;
+            for (k2 = 0; k2 < KEYS; k2++) {
+                if (ref[k2] && k2 % 3 == 1) {
+                    ref[k2] = 0;
+                    n--;
+                }
+            }
+            CHECK(n == 0);
+            compare(&m);
+        } else if (i == 150000) {
+            map_reserve(&m, 100000);
+            compare(&m);
+        }
+    }
+    compare(&m);
+    map_filter *f = m.filter;
+    CHECK(f->rejected > 0 && f->passed > 0);
+    CHECK(f->false_pos < f->passed);
+
+    map_filter_disable(&m);
+    compare(&m);
+    map_filter_enable(&m, 20);
+    compare(&m);
+    map_free(&m);
+}
+
+#define READERS 4
+
+static void *reader(void *arg) {
+    int i;
+    for (i = 0; i < 5; i++) compare(arg);
+    return NULL;
+}
+
+//Several threads searching at once, most of them for keys that aren't
+//there (run.sh also builds this one with TSan)
+static void concurrent(void) {
+    map m;
+    map_init(&m, uint64_t, uint32_t, VAL2VAL);
+    map_filter_enable(&m, 0);
+    unsigned k;
+    for (k = 0; k < KEYS; k++) {
+        ref[k] = k % 4 == 0;
+        ref_val[k] = k;
+        uint64_t kk = key_of(k);
+        if (ref[k]) map_insert(&m, &kk, 0, &k, 0);
+    }
+
+    //Nothing's been deleted, so the filter should be doing its job
+    compare(&m);
+    CHECK(m.filter->false_pos * 20 < m.filter->rejected);
+
+    pthread_t t[READERS];
+    for (k = 0; k < READERS; k++) CHECK(pthread_create(t + k, NULL, reader, &m) == 0);
+    for (k = 0; k < READERS; k++) pthread_join(t[k], NULL);
+    map_free(&m);
+}
+
+int main(void) {
+    matches_ref();
+    concurrent();
+    puts("filter ok");
+    return 0;
+}
@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "map.h"
+#include "test.h"
+
+#define BASE 40000
+#define ATTACK 300
+
+//Someone who knows the seed picks keys that all land in one slot. The
+//map should notice the long chain, switch to SipHash with a new seed,
+//and still have every key.
+static void attack(void) {
+    map m;
+    map_init(&m, uint64_t, uint32_t, VAL2VAL);
+    uint64_t k;
+    uint32_t x = 0;
+    for (k = 0; k < BASE; k++) map_insert(&m, &k, 0, &x, 0);
+    CHECK(m.stats.rehashes == 0);
+
+    static uint64_t bad[ATTACK];
+    unsigned n = 0;
+    uint32_t const slots = m.slots;
+    for (k = 1ull << 40; n < ATTACK; k++) {
+        uint32_t h = map_val_hash(&k, sizeof(k), m.seed);
+        if (test_home_slot(slots, h) == 12345) bad[n++] = k;
+    }
+    uint64_t old_seed = m.seed;
+    for (n = 0; n < ATTACK; n++) {
+        x = n;
+        CHECK(map_insert(&m, &bad[n], 0, &x, 0) == 0);
+    }
+    CHECK(m.slots == slots);
+    CHECK(m.stats.rehashes >= 1);
+    CHECK(m.hash == map_val_shash && m.seed != old_seed);
+    CHECK(m.stats.harden_kind == MAP_HARDEN_KEYED_HASH && m.slot_key == 0);
+
+    for (n = 0; n < ATTACK; n++) CHECK(*(uint32_t*) map_search(&m, &bad[n]) == n);
+    for (k = 0; k < BASE; k++) CHECK(map_search(&m, &k));
+    CHECK(m.count == BASE + ATTACK);
+    map_free(&m);
+}
+
+//A custom hash that ignores the seed (and barely hashes at all)
+static uint32_t low_half(void const *key, unsigned sz, uint64_t seed) {
+    (void) sz;
+    (void) seed;
+    return (uint32_t) *(uint64_t const*) key;
+}
+
+static void init_low_half(map *m) {
+    map_custom_init(m, uint64_t, uint32_t, low_half, map_val_comp, map_val_comp,
+                    NULL, NULL, sizeof(uint64_t), sizeof(uint32_t));
+    uint64_t k;
+    uint32_t x = 0;
+    for (k = 0; k < BASE; k++) map_insert(m, &k, 0, &x, 0);
+    CHECK(m->stats.rehashes == 0);
+}
+
+//Inserts keys (starting from *next) whose hashes all land in one slot
+//as long as the map hasn't been given a slot key
+static void aim(map *m, uint64_t *next, uint64_t *keys) {
+    unsigned n = 0;
+    for (; n < ATTACK; ++*next) {
+        if (test_home_slot(m->slots, low_half(next, 0, 0)) == 12345) keys[n++] = *next;
+    }
+    for (n = 0; n < ATTACK; n++) CHECK(map_insert(m, &keys[n], 0, &n, 0) == 0);
+}
+
+//We can't swap out a custom hash, and a new seed does nothing for one
+//that ignores it, so the map has to start keying its slots instead.
+//After that, keys aimed at a slot the old way don't pile up anymore.
+static void custom_slots(void) {
+    map m;
+    init_low_half(&m);
+    static uint64_t bad[ATTACK];
+    uint64_t next = 1 << 20;
+    uint32_t const slots = m.slots;
+    aim(&m, &next, bad);
+    CHECK(m.slots == slots);
+    CHECK(m.stats.rehashes == 1 && m.stats.hopeless == 0);
+    CHECK(m.stats.harden_kind == MAP_HARDEN_KEYED_SLOTS && m.slot_key != 0);
+    CHECK(m.hash == low_half);
+    unsigned n;
+    for (n = 0; n < ATTACK; n++) CHECK(*(uint32_t*) map_search(&m, &bad[n]) == n);
+
+    m.stats.longest_chain = 0;
+    aim(&m, &next, bad);
+    CHECK(m.stats.longest_chain < MAP_CHAIN_LIMIT / 2);
+    CHECK(m.stats.rehashes == 1);
+    for (n = 0; n < ATTACK; n++) CHECK(*(uint32_t*) map_search(&m, &bad[n]) == n);
+    CHECK(m.count == BASE + 2 * ATTACK);
+    map_free(&m);
+}
+
+//Keys with the exact same hash can't be split up by anything the map
+//does, so it shouldn't waste its one rehash on them. A slot attack 
+//afterwards still gets the rehash.
+static void custom_hopeless(void) {
+    map m;
+    init_low_half(&m);
+    uint64_t k;
+    uint32_t x = 0;
+    for (k = 1; k <= ATTACK; k++) {
+        uint64_t same = k << 32 | 7;
+        CHECK(map_insert(&m, &same, 0, &x, 0) == 0);
+    }
+    CHECK(m.stats.rehashes == 0 && m.stats.hopeless > 0);
+    CHECK(m.stats.harden_kind == MAP_HARDEN_NONE && m.slot_key == 0);
+    for (k = 1; k <= ATTACK; k++) {
+        uint64_t same = k << 32 | 7;
+        CHECK(map_search(&m, &same));
+    }
+
+    static uint64_t bad[ATTACK];
+    uint64_t next = 1 << 20;
+    aim(&m, &next, bad);
+    CHECK(m.stats.rehashes == 1 && m.stats.harden_kind == MAP_HARDEN_KEYED_SLOTS);
+    CHECK(m.count == BASE + 2 * ATTACK);
+    map_free(&m);
+}
+
+//Every map gets its own seed, and map_set_seed rehashes in place
+static void seeds(void) {
+    map a, b;
+    map_init(&a, char const*, uint32_t, STR2VAL);
+    map_init(&b, char const*, uint32_t, STR2VAL);
+    CHECK(a.seed != b.seed);
+
+    uint32_t i;
+    for (i = 0; i < 1000; i++) {
+        char buf[16];
+        sprintf(buf, "k%u", i);
+        map_insert(&a, strdup(buf), 1, &i, 0);
+    }
+    map_set_seed(&a, b.seed);
+    CHECK(a.seed == b.seed);
+    for (i = 0; i < 1000; i++) {
+        char buf[16];
+        sprintf(buf, "k%u", i);
+        CHECK(*(uint32_t*) map_search(&a, buf) == i);
+        CHECK(map_hash_key(&a, buf) == map_hash_key(&b, buf));
+    }
+    map_free(&a);
+    map_free(&b);
+}
+
+//Pre-fork workers each need their own seeds. Without the fork handler,
+//every child would hand out the same seeds as its parent.
+static void forked(void) {
+    map m;
+    map_init(&m, uint64_t, uint32_t, VAL2VAL);
+    map_free(&m);
+
+    uint64_t seeds[3];
+    int i, fds[2];
+    CHECK(pipe(fds) == 0);
+    for (i = 0; i < 2; i++) {
+        pid_t pid = fork();
+        CHECK(pid >= 0);
+        if (pid == 0) {
+            map_init(&m, uint64_t, uint32_t, VAL2VAL);
+            _exit(write(fds[1], &m.seed, sizeof(m.seed)) != sizeof(m.seed));
+        }
+        int status;
+        CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        CHECK(read(fds[0], &seeds[i], sizeof(seeds[i])) == sizeof(seeds[i]));
+    }
+    close(fds[0]);
+    close(fds[1]);
+    map_init(&m, uint64_t, uint32_t, VAL2VAL);
+    seeds[2] = m.seed;
+    map_free(&m);
+    CHECK(seeds[0] != seeds[1] && seeds[0] != seeds[2] && seeds[1] != seeds[2]);
+}
+
+int main(void) {
+    attack();
+    custom_slots();
+    custom_hopeless();
+    seeds();
+    forked();
+    puts("flood ok");
+    return 0;
+}
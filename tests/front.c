@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "map.h"
+#include "test.h"
+
+//Random inserts, deletes and lookups on a map with the front cache,
+//checked against the same thing on a plain map. The cache has to drop
+//entries that move or go away, including across growth and clone.
+static void matches_plain(void) {
+    map a, b, c;
+    map *m = &a;
+    map_init(&a, unsigned, unsigned, VAL2VAL);
+    map_init(&b, unsigned, unsigned, VAL2VAL);
+    map_front_enable(&a, 64);
+
+    unsigned seed = 1, i;
+    for (i = 0; i < 1000000; i++) {
+        unsigned k = rand_r(&seed) % 5000, v = rand_r(&seed), op = rand_r(&seed) % 10;
+        if (op < 3) {
+            CHECK(map_insert(m, &k, 0, &v, 0) == map_insert(&b, &k, 0, &v, 0));
+        } else if (op < 5) {
+            CHECK(map_search_delete(m, &k, NULL) == map_search_delete(&b, &k, NULL));
+        } else {
+            unsigned *x = op < 8 ? map_search_touch(m, &k) : map_search(m, &k);
+            unsigned *y = map_search(&b, &k);
+            CHECK(!x == !y);
+            CHECK(!x || *x == *y);
+        }
+        if (i == 500000) {
+            CHECK(map_clone(&a, &c, 0) == 0);
+            map_free(&a);
+            m = &c;
+            CHECK(m->front);
+        }
+    }
+    CHECK(m->front->hits > 0 && m->front->misses > 0);
+    map_free(m);
+    map_free(&b);
+}
+
+//map_search only looks at the cache. map_search_touch is what fills it.
+static void search_is_read_only(void) {
+    map m;
+    map_init(&m, unsigned, unsigned, VAL2VAL);
+    unsigned i;
+    for (i = 0; i < 1000; i++) map_insert(&m, &i, 0, &i, 0);
+    map_front_enable(&m, 256);
+
+    size_t sz = (m.front->mask + 1) * sizeof(map_front_slot);
+    map_front_slot *before = malloc(sz);
+    memcpy(before, m.front->slots, sz);
+    for (i = 0; i < 1000; i++) CHECK(*(unsigned*) map_search(&m, &i) == i);
+    CHECK(!memcmp(before, m.front->slots, sz));
+    CHECK(m.front->hits == 0 && m.front->misses == 1000);
+
+    unsigned k = 7;
+    CHECK(*(unsigned*) map_search_touch(&m, &k) == 7);
+    CHECK(memcmp(before, m.front->slots, sz));
+    CHECK(*(unsigned*) map_search(&m, &k) == 7);
+    CHECK(m.front->hits == 1);
+    free(before);
+    map_free(&m);
+}
+
+#define READERS 4
+
+static void *reader(void *arg) {
+    map const *m = arg;
+    unsigned i, k;
+    for (i = 0; i < 200000; i++) {
+        k = i % 2000;
+        unsigned *v = map_search(m, &k);
+        CHECK(k < 1000 ? v && *v == k : !v);
+    }
+    return NULL;
+}
+
+//Several threads searching at once (run.sh also builds this one with
+//TSan, which would complain if map_search wrote anything it shouldn't)
+static void concurrent(void) {
+    map m;
+    map_init(&m, unsigned, unsigned, VAL2VAL);
+    unsigned i;
+    for (i = 0; i < 1000; i++) map_insert(&m, &i, 0, &i, 0);
+    map_front_enable(&m, 256);
+    for (i = 0; i < 1000; i += 3) map_search_touch(&m, &i);
+
+    pthread_t t[READERS];
+    for (i = 0; i < READERS; i++) CHECK(pthread_create(t + i, NULL, reader, &m) == 0);
+    for (i = 0; i < READERS; i++) pthread_join(t[i], NULL);
+    CHECK(m.front->hits > 0);
+    map_free(&m);
+}
+
+int main(void) {
+    matches_plain();
+    search_is_read_only();
+    concurrent();
+    puts("front ok");
+    return 0;
+}
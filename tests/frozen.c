@@ -0,0 +1,256 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "map.h"
+#include "frozen.h"
+#include "test.h"
+
+#define N 100000
+#define PATH "frozen_test.bin"
+
+typedef struct {
+    double a;
+    int b;
+} big;
+
+//Saves fz, frees it and loads it back, so every check after this goes
+//through the fix-up pass in frozen_load
+static void reload(frozen_map *fz) {
+    CHECK(frozen_save(fz, PATH) == 0);
+    frozen_free(fz);
+    CHECK(frozen_load(fz, PATH) == 0);
+}
+
+static off_t file_size(void) {
+    struct stat st;
+    CHECK(stat(PATH, &st) == 0);
+    return st.st_size;
+}
+
+//Where record i of fz starts in the file frozen_save wrote
+static off_t rec_pos(frozen_map const *fz, uint32_t i) {
+    off_t hdr_sz = file_size() - fz->blob_sz;
+    return hdr_sz + (fz->recs - fz->blob) + (off_t) i * fz->rec_sz;
+}
+
+static void poke(off_t pos, void const *bytes, size_t len) {
+    FILE *f = fopen(PATH, "r+");
+    CHECK(f);
+    fseek(f, pos, SEEK_SET);
+    CHECK(fwrite(bytes, len, 1, f) == 1);
+    fclose(f);
+}
+
+//Short keys live in the record and long ones in the pool, so try both
+static void str_keys(char const *fmt) {
+    map m;
+    map_init(&m, char const*, uint32_t, STR2VAL);
+    char buf[64];
+    uint32_t i;
+    for (i = 0; i < N; i++) {
+        sprintf(buf, fmt, i * 7);
+        map_insert(&m, strdup(buf), 1, &i, 0);
+    }
+
+    frozen_map fz;
+    CHECK(map_freeze(&m, &fz) == 0);
+    CHECK(frozen_count(&fz) == N);
+    int pass;
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < N; i++) {
+            sprintf(buf, fmt, i * 7);
+            uint32_t *v = frozen_search(&fz, buf);
+            CHECK(v && *v == i);
+            sprintf(buf, fmt, i * 7 + 1);
+            CHECK(!frozen_search(&fz, buf));
+        }
+        reload(&fz);
+    }
+    frozen_free(&fz);
+    map_free(&m);
+}
+
+//Inline keys and values, from a map that's had deletes and has its
+//values boxed
+static void val_keys(void) {
+    map m;
+    map_init(&m, uint64_t, uint32_t, VAL2VAL);
+    uint64_t i;
+    for (i = 0; i < N; i++) {
+        uint64_t k = i * 0x9E3779B97F4A7C15ull;
+        uint32_t v = i;
+        map_insert(&m, &k, 0, &v, 0);
+    }
+    for (i = 0; i < N; i += 3) {
+        uint64_t k = i * 0x9E3779B97F4A7C15ull;
+        map_search_delete(&m, &k, NULL);
+    }
+    CHECK(map_box_values(&m) == 0);
+
+    frozen_map fz;
+    CHECK(map_freeze(&m, &fz) == 0);
+    CHECK(frozen_count(&fz) == m.count);
+    int pass;
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < N; i++) {
+            uint64_t k = i * 0x9E3779B97F4A7C15ull;
+            uint32_t *v = frozen_search(&fz, &k);
+            if (i % 3 == 0) CHECK(!v);
+            else CHECK(v && *v == i);
+        }
+        reload(&fz);
+    }
+    frozen_free(&fz);
+    map_free(&m);
+}
+
+//STR values (some of them NULL) have to survive being turned into
+//offsets and back. The map gets freed before we look at anything, to
+//make sure nothing points back into it.
+static void strv_keys(void) {
+    map m;
+    map_init(&m, map_strv, char const*, STRV2STR);
+    char *store = malloc(N * 32);
+    char buf[64];
+    uint32_t i;
+    for (i = 0; i < N; i++) {
+        int n = sprintf(store + i * 32, i % 2 ? "s%u" : "strv-key-that-is-long-%u", i);
+        map_strv k = {store + i * 32, n};
+        char *v = NULL;
+        if (i % 5) {
+            sprintf(buf, "v%u", i);
+            v = strdup(buf);
+        }
+        map_insert(&m, &k, 0, v, v != NULL);
+    }
+
+    frozen_map fz;
+    CHECK(map_freeze(&m, &fz) == 0);
+    map_free(&m);
+    reload(&fz);
+    for (i = 0; i < N; i++) {
+        int n = sprintf(buf, i % 2 ? "s%u" : "strv-key-that-is-long-%u", i);
+        char const **v = frozen_search(&fz, STRV_AMP(buf, n));
+        CHECK(v);
+        if (i % 5) {
+            char want[32];
+            sprintf(want, "v%u", i);
+            CHECK(*v && !strcmp(*v, want));
+        } else {
+            CHECK(!*v);
+        }
+    }
+    CHECK(!frozen_search(&fz, STRV_AMP("nope", 4)));
+    frozen_free(&fz);
+    free(store);
+}
+
+static void ptr_vals(void) {
+    map m;
+    map_init(&m, int*, big*, PTR2PTR);
+    int i;
+    for (i = 0; i < 1000; i++) {
+        int *k = malloc(sizeof(int));
+        big *v = malloc(sizeof(big));
+        *k = i;
+        v->a = i * 0.5;
+        v->b = -i;
+        map_insert(&m, k, 1, v, 1);
+    }
+
+    frozen_map fz;
+    CHECK(map_freeze(&m, &fz) == 0);
+    map_free(&m);
+    reload(&fz);
+    for (i = 0; i < 1000; i++) {
+        big **v = frozen_search(&fz, &i);
+        CHECK(v && (uintptr_t) *v % _Alignof(big) == 0);
+        CHECK((*v)->a == i * 0.5 && (*v)->b == -i);
+    }
+    frozen_free(&fz);
+}
+
+static void sets(void) {
+    set s;
+    set_init(&s, char const*, SET_STR);
+    frozen_map fz;
+    CHECK(map_freeze(&s, &fz) == 0);
+    CHECK(!frozen_search(&fz, "x"));
+    reload(&fz);
+    CHECK(!frozen_search(&fz, "x"));
+    frozen_free(&fz);
+
+    set_insert(&s, "x", 0);
+    set_insert(&s, "", 0);
+    CHECK(map_freeze(&s, &fz) == 0);
+    CHECK(frozen_search(&fz, "x") && frozen_search(&fz, ""));
+    CHECK(!frozen_search(&fz, "y"));
+    frozen_free(&fz);
+    set_free(&s);
+
+    //Custom compare functions can't be frozen
+    map m;
+    map_init(&m, int, int, VAL2VAL);
+    m.key_comp = NULL;
+    CHECK(map_freeze(&m, &fz) < 0);
+    map_free(&m);
+}
+
+//frozen_load has to turn away anything that would point outside the
+//blob, rather than handing back a map that reads garbage
+static void bad_files(void) {
+    map m;
+    map_init(&m, char const*, char const*, STR2STR);
+    char buf[64];
+    unsigned i;
+    for (i = 0; i < 100; i++) {
+        sprintf(buf, "a-long-enough-key-%u", i);
+        map_insert(&m, strdup(buf), 1, strdup(buf), 1);
+    }
+    frozen_map fz, g;
+    CHECK(map_freeze(&m, &fz) == 0);
+    map_free(&m);
+
+    //A key offset past the end of the pool
+    CHECK(frozen_save(&fz, PATH) == 0);
+    uint32_t off = UINT32_MAX - 4;
+    poke(rec_pos(&fz, 7) + sizeof(uint32_t), &off, sizeof(off));
+    CHECK(frozen_load(&g, PATH) < 0);
+
+    //A value offset past the end of the pool
+    CHECK(frozen_save(&fz, PATH) == 0);
+    uintptr_t voff = fz.blob_sz;
+    poke(rec_pos(&fz, 3) + fz.val_off, &voff, sizeof(voff));
+    CHECK(frozen_load(&g, PATH) < 0);
+
+    //Bad magic
+    CHECK(frozen_save(&fz, PATH) == 0);
+    poke(0, "X", 1);
+    CHECK(frozen_load(&g, PATH) < 0);
+
+    //Cut short
+    CHECK(frozen_save(&fz, PATH) == 0);
+    CHECK(frozen_load(&g, PATH) == 0);
+    frozen_free(&g);
+    CHECK(truncate(PATH, file_size() - 1) == 0);
+    CHECK(frozen_load(&g, PATH) < 0);
+
+    unlink(PATH);
+    CHECK(frozen_load(&g, PATH) < 0);
+    frozen_free(&fz);
+}
+
+int main(void) {
+    str_keys("key%u");
+    str_keys("a-much-longer-key-%u");
+    val_keys();
+    strv_keys();
+    ptr_vals();
+    sets();
+    bad_files();
+    puts("frozen ok");
+    return 0;
+}
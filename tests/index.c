@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "map.h"
+#include "test.h"
+
+static int str_qsort_cmp(void const *a, void const *b) {
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+//Checks a full scan, a random range and a random prefix against a
+//sorted copy of the keys
+static void check(map *m, unsigned seed) {
+    char **ks = malloc((m->count + 1) * sizeof(*ks));
+    unsigned n = 0, i;
+    map_iter it;
+    for (it = map_begin(m); it != map_end(m); map_iter_step(it)) {
+        char const *k;
+        unsigned v;
+        map_iter_deref(m, it, &k, &v);
+        ks[n++] = (char*) k;
+    }
+    qsort(ks, n, sizeof(*ks), str_qsort_cmp);
+
+    map_range_iter r = map_range_begin(m, NULL, NULL);
+    map_iter e;
+    i = 0;
+    while ((e = map_range_next(&r))) {
+        char const *k;
+        unsigned v;
+        map_iter_deref(m, e, &k, &v);
+        CHECK(i < n && !strcmp(k, ks[i]));
+        CHECK(*(unsigned*) map_search(m, k) == v);
+        i++;
+    }
+    CHECK(i == n);
+
+    char lo[16], hi[16];
+    sprintf(lo, "k%u", rand_r(&seed) % 100);
+    sprintf(hi, "k%u", rand_r(&seed) % 1000);
+    unsigned want = 0, got = 0;
+    for (i = 0; i < n; i++) want += strcmp(ks[i], lo) >= 0 && strcmp(ks[i], hi) < 0;
+    r = map_range_begin(m, lo, hi);
+    char const *prev = NULL;
+    while ((e = map_range_next(&r))) {
+        char const *k;
+        unsigned v;
+        map_iter_deref(m, e, &k, &v);
+        CHECK(strcmp(k, lo) >= 0 && strcmp(k, hi) < 0);
+        CHECK(!prev || strcmp(prev, k) < 0);
+        prev = k;
+        got++;
+    }
+    CHECK(got == want);
+
+    char pre[16];
+    sprintf(pre, "k%u", rand_r(&seed) % 50);
+    unsigned pl = strlen(pre);
+    want = got = 0;
+    for (i = 0; i < n; i++) want += !strncmp(ks[i], pre, pl);
+    r = map_prefix_scan(m, pre, pl);
+    while (map_range_next(&r)) got++;
+    CHECK(got == want);
+
+    free(ks);
+}
+
+static void insert_key(map *m, unsigned k, unsigned v) {
+    char buf[16];
+    sprintf(buf, "k%u", k);
+    map_insert(m, strdup(buf), 1, &v, 0);
+}
+
+static void delete_key(map *m, unsigned k) {
+    char buf[16];
+    sprintf(buf, "k%u", k);
+    map_search_delete(m, buf, NULL);
+}
+
+//Turning the index on for a map that already has keys builds the tree
+//in one go. Try sizes around where the number of leaves and levels
+//change, then make sure inserts and deletes still work on top of it
+//(deletes are where a badly filled node would show up).
+static void bulk(void) {
+    static unsigned const sizes[] = {
+        0, 1, 23, 24, 25, 31, 32, 33, 47, 48, 49, 64, 65, 600, 601,
+        792, 793, 825, 826, 5000, 20000, 100000
+    };
+    unsigned s;
+    for (s = 0; s < sizeof(sizes) / sizeof(*sizes); s++) {
+        map m;
+        map_init(&m, char const*, unsigned, STR2VAL);
+        unsigned i;
+        for (i = 0; i < sizes[s]; i++) insert_key(&m, i, i);
+        CHECK(map_index_enable(&m) == 0);
+        check(&m, s);
+
+        unsigned seed = s;
+        for (i = 0; i < sizes[s] / 2 + 100; i++) insert_key(&m, rand_r(&seed) % (sizes[s] + 100), i);
+        check(&m, s);
+        for (i = 0; i < sizes[s] + 100; i++) delete_key(&m, rand_r(&seed) % (sizes[s] + 100));
+        check(&m, s);
+        for (i = 0; i < sizes[s] + 100; i++) delete_key(&m, i);
+        CHECK(m.count == 0);
+        check(&m, s);
+        map_free(&m);
+    }
+}
+
+//Random inserts and deletes with the index on from the start, plus
+//the bulk operations that have to keep it up to date
+static void churn(void) {
+    map m;
+    map_init(&m, char const*, unsigned, STR2VAL);
+    CHECK(map_index_enable(&m) == 0);
+
+    unsigned seed = 1, i;
+    for (i = 0; i < 200000; i++) {
+        unsigned k = rand_r(&seed) % 20000;
+        unsigned op = rand_r(&seed) % 10;
+        if (op < 5) {
+            insert_key(&m, k, i);
+        } else if (op < 7) {
+            char buf[16];
+            sprintf(buf, "k%u", k);
+            char *c = strdup(buf);
+            int inserted;
+            unsigned *v = map_emplace(&m, c, 1, &inserted);
+            *v = i;
+            if (!inserted) free(c);
+        } else {
+            delete_key(&m, k);
+        }
+        if (i % 20000 == 0) check(&m, i);
+    }
+    check(&m, 0);
+
+    map c, m2;
+    CHECK(map_clone(&m, &c, MAP_CLONE_DEEP_KEYS) == 0);
+    check(&c, 1);
+    map_init(&m2, char const*, unsigned, STR2VAL);
+    for (i = 0; i < 5000; i++) insert_key(&m2, rand_r(&seed) % 30000, i);
+    CHECK(map_merge(&c, &m2, MAP_MERGE_TAKE_SRC) == 0);
+    check(&c, 2);
+    CHECK(map_intersect(&c, &m) == 0);
+    check(&c, 3);
+    CHECK(map_subtract(&c, &c) == 0);
+    CHECK(c.count == 0);
+    check(&c, 4);
+    map_free(&c);
+    map_free(&m2);
+
+    map_set_capacity(&m, 1000, NULL, NULL);
+    check(&m, 5);
+    map_clear(&m);
+    check(&m, 6);
+    map_free(&m);
+}
+
+static void strv_keys(void) {
+    map sv;
+    map_init(&sv, map_strv, unsigned, STRV2VAL);
+    static char big[] = "user:1:a user:1:b user:12:c user:2:d user:1:e";
+    unsigned const offs[] = {0, 9, 18, 28, 37}, lens[] = {8, 8, 9, 8, 8};
+    unsigned i;
+    for (i = 0; i < 5; i++) map_insert(&sv, STRV_AMP(big + offs[i], lens[i]), 0, &i, 0);
+    CHECK(map_index_enable(&sv) == 0);
+
+    char got[64] = "";
+    map_range_iter r = map_prefix_scan(&sv, "user:1:", 7);
+    map_iter e;
+    while ((e = map_range_next(&r))) {
+        map_strv k;
+        unsigned v;
+        map_iter_deref(&sv, e, &k, &v);
+        sprintf(got + strlen(got), "%.*s=%u ", (int) k.len, k.ptr, v);
+    }
+    CHECK(!strcmp(got, "user:1:a=0 user:1:b=1 user:1:e=4 "));
+    map_free(&sv);
+
+    //Only string keys can have an index
+    map vi;
+    map_init(&vi, int, int, VAL2VAL);
+    CHECK(map_index_enable(&vi) < 0);
+    map_free(&vi);
+}
+
+int main(void) {
+    bulk();
+    churn();
+    strv_keys();
+    puts("index ok");
+    return 0;
+}
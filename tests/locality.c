@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "map.h"
+#include "test.h"
+
+#define N 200000
+
+//The free bitmap and the free list have to agree: every slot on the
+//list has its bit set, and there are exactly as many set bits as 
+//free slots
+static void check_free(map const *m) {
+    if (m->small) return;
+    uint32_t set = 0, listed = 0, w;
+    for (w = 0; w <= m->slots/64; w++) set += __builtin_popcountll(m->free_bits[w]);
+    list_head const *cur;
+    for (cur = m->empties.next; cur != &m->empties; cur = cur->next) {
+        uint32_t idx = ((void*) cur - m->list_head_off - m->entries) / m->entry_sz;
+        CHECK(idx >= 1 && idx <= m->slots);
+        CHECK(m->free_bits[idx >> 6] >> (idx & 63) & 1);
+        listed++;
+    }
+    CHECK(set == listed);
+    CHECK(set == m->slots - m->count);
+}
+
+//Average number of distinct 4 KiB pages touched walking from each 
+//key's home slot to its entry
+static double pages_per_lookup(map const *m) {
+    double pages = 0;
+    list_head const *head = m->entries + m->list_head_off, *cur;
+    for (cur = head->next; cur != head; cur = cur->next) {
+        void const *e = (void const*) cur - m->list_head_off;
+        uint32_t h = *(uint32_t const*) (e + m->hash_off);
+        void const *w = m->entries + (size_t) m->entry_sz * (test_home_slot(m->slots, h) + 1);
+        uintptr_t page = (uintptr_t) w >> 12;
+        pages++;
+        while (w != e) {
+            w = (void const*) ((list_head const*) (w + m->list_head_off))->next - m->list_head_off;
+            if ((uintptr_t) w >> 12 != page) {
+                pages++;
+                page = (uintptr_t) w >> 12;
+            }
+        }
+    }
+    return pages / m->count;
+}
+
+//Fill up and then churn (delete a random key, insert a new one) for a
+//long time, checking against a plain array, that the bitmap stays in 
+//step, and that chains stay close to home
+static void churn(int front) {
+    map m, c;
+    map_init(&m, unsigned, unsigned, VAL2VAL);
+    if (front) map_front_enable(&m, 1024);
+    static unsigned live[N];
+    unsigned i, next = N, seed = 1;
+    for (i = 0; i < N; i++) {
+        unsigned k = i * 2654435761u;
+        live[i] = i;
+        CHECK(map_insert(&m, &k, 0, &i, 0) == 0);
+    }
+    check_free(&m);
+    CHECK(m.stats.near_claims > 0);
+    CHECK(pages_per_lookup(&m) < 1.3);
+
+    for (i = 0; i < 4 * N; i++) {
+        unsigned j = rand_r(&seed) % N, k = live[j] * 2654435761u;
+        CHECK(map_search_delete(&m, &k, NULL) == 0);
+        live[j] = next++;
+        k = live[j] * 2654435761u;
+        CHECK(map_insert(&m, &k, 0, &live[j], 0) == 0);
+        if (i % (N / 2) == 0) check_free(&m);
+    }
+    check_free(&m);
+    CHECK(m.count == N);
+    for (i = 0; i < N; i++) {
+        unsigned k = live[i] * 2654435761u, *v = map_search(&m, &k);
+        CHECK(v && *v == live[i]);
+    }
+    CHECK(pages_per_lookup(&m) < 1.3);
+    //Nearly every collision should have found somewhere close by
+    CHECK(m.stats.far_claims < m.stats.near_claims / 10);
+
+    CHECK(map_clone(&m, &c, 0) == 0);
+    check_free(&c);
+    map_free(&m);
+    for (i = 0; i < N; i += 2) {
+        unsigned k = live[i] * 2654435761u;
+        CHECK(map_search_delete(&c, &k, NULL) == 0);
+    }
+    check_free(&c);
+    map_free(&c);
+}
+
+//A small map turning into a hashed one has to set the bitmap up, and
+//a full-ish map with no room nearby has to fall back to the free list
+static void edges(void) {
+    map m;
+    map_init(&m, unsigned, unsigned, VAL2VAL);
+    unsigned i;
+    for (i = 0; i < MAP_SMALL_MAX + 1; i++) {
+        map_insert(&m, &i, 0, &i, 0);
+        check_free(&m);
+    }
+    CHECK(!m.small);
+    map_reserve(&m, 64);
+    check_free(&m);
+    for (i = 0; m.count < m.slots; i++) {
+        map_insert(&m, &i, 0, &i, 0);
+        check_free(&m);
+    }
+    CHECK(map_full(&m));
+    map_free(&m);
+}
+
+int main(void) {
+    churn(0);
+    churn(1);
+    edges();
+    puts("locality ok");
+    return 0;
+}
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "map.h"
+#include "test.h"
+
+#define N 200000
+
+//Keys lo, lo+step, ... below N, with values that say which map they
+//came from
+static void fill(map *m, uint32_t step, uint32_t tag, uint64_t const *seed) {
+    map_init(m, char const*, uint32_t, STR2VAL);
+    if (seed) map_set_seed(m, *seed);
+    uint32_t i;
+    for (i = 0; i < N; i += step) {
+        char buf[16];
+        sprintf(buf, "k%u", i);
+        uint32_t v = i * 10 + tag;
+        map_insert(m, strdup(buf), 1, &v, 0);
+    }
+}
+
+//want says whether key i should be there and with what value
+typedef int want_fn(uint32_t i, uint32_t *val);
+
+static void check(map const *m, want_fn *want) {
+    uint32_t i, n = 0;
+    for (i = 0; i < N; i++) {
+        char buf[16];
+        sprintf(buf, "k%u", i);
+        uint32_t *v = map_search(m, buf), w;
+        int in = want(i, &w);
+        CHECK(!v == !in);
+        CHECK(!v || *v == w);
+        n += in;
+    }
+    CHECK(m->count == n);
+}
+
+//a has the even keys (tag 1), b has multiples of 3 (tag 2)
+static int keep_dst(uint32_t i, uint32_t *w) {
+    *w = i * 10 + (i % 2 == 0 ? 1 : 2);
+    return i % 2 == 0 || i % 3 == 0;
+}
+
+static int take_src(uint32_t i, uint32_t *w) {
+    *w = i * 10 + (i % 3 == 0 ? 2 : 1);
+    return i % 2 == 0 || i % 3 == 0;
+}
+
+static int intersected(uint32_t i, uint32_t *w) {
+    *w = i * 10 + 1;
+    return i % 6 == 0;
+}
+
+static int subtracted(uint32_t i, uint32_t *w) {
+    *w = i * 10 + 1;
+    return i % 2 == 0 && i % 3 != 0;
+}
+
+//Once with different seeds (every key gets rehashed) and once with the
+//same seed (src's stored hashes get reused)
+static void ops(uint64_t const *seed) {
+    map a, b;
+
+    fill(&a, 2, 1, seed);
+    fill(&b, 3, 2, seed);
+    CHECK(map_merge(&a, &b, MAP_MERGE_KEEP_DST) == 0);
+    check(&a, keep_dst);
+    map_free(&b);
+    map_free(&a);
+
+    fill(&a, 2, 1, seed);
+    fill(&b, 3, 2, seed);
+    CHECK(map_merge(&a, &b, MAP_MERGE_TAKE_SRC) == 0);
+    check(&a, take_src);
+    map_free(&b);
+    map_free(&a);
+
+    fill(&a, 2, 1, seed);
+    fill(&b, 3, 2, seed);
+    CHECK(map_intersect(&a, &b) == 0);
+    check(&a, intersected);
+    map_free(&a);
+
+    fill(&a, 2, 1, seed);
+    CHECK(map_subtract(&a, &b) == 0);
+    check(&a, subtracted);
+    CHECK(map_subtract(&a, &a) == 0);
+    CHECK(a.count == 0);
+    map_free(&a);
+    map_free(&b);
+}
+
+static void mismatched(void) {
+    map a, b;
+    map_init(&a, char const*, uint32_t, STR2VAL);
+    map_init(&b, uint64_t, uint32_t, VAL2VAL);
+    CHECK(map_merge(&a, &b, MAP_MERGE_KEEP_DST) < 0);
+    CHECK(map_intersect(&a, &b) < 0);
+    CHECK(map_subtract(&a, &b) < 0);
+    map_free(&a);
+    map_free(&b);
+}
+
+int main(void) {
+    uint64_t seed = 42;
+    ops(NULL);
+    ops(&seed);
+    mismatched();
+    puts("merge ok");
+    return 0;
+}
@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "map.h"
+#include "test.h"
+
+#define N 100000
+#define MAX_PARTS 64
+
+static unsigned char seen[N];
+static uint64_t sums[MAX_PARTS];
+
+//Every part walks its own range, and together they cover every entry
+//exactly once
+static void parts(map const *m, unsigned nparts) {
+    memset(seen, 0, sizeof(seen));
+    unsigned p, n = 0;
+    for (p = 0; p < nparts; p++) {
+        map_part_iter it;
+        map_part_init(m, &it, p, nparts);
+        map_iter e;
+        while ((e = map_part_next(&it))) {
+            uint64_t k;
+            uint32_t v;
+            map_iter_deref(m, e, &k, &v);
+            CHECK(k < N && v == k * 7 && !seen[k]);
+            seen[k] = 1;
+            n++;
+        }
+    }
+    CHECK(n == m->count);
+}
+
+//Sums the values into per-part slots, and looks every key up again 
+//while it's at it, since searching from all the threads at once is
+//supposed to be fine (TSan checks that)
+static void visit(void *key, void *val, void *ctx, unsigned part) {
+    map const *m = ctx;
+    CHECK(part < MAX_PARTS);
+    CHECK(map_search(m, key) == val);
+    sums[part] += *(uint32_t*) val;
+}
+
+static void for_each(map const *m, uint64_t want) {
+    unsigned t;
+    for (t = 0; t <= 9; t++) {
+        memset(sums, 0, sizeof(sums));
+        map_for_each_parallel(m, visit, (void*) m, t);
+        uint64_t got = 0;
+        unsigned i;
+        for (i = 0; i < MAX_PARTS; i++) got += sums[i];
+        CHECK(got == want);
+    }
+}
+
+int main(void) {
+    map m;
+    map_init(&m, uint64_t, uint32_t, VAL2VAL);
+    parts(&m, 1);
+    parts(&m, 4);
+    for_each(&m, 0);
+
+    uint64_t i, want = 0;
+    for (i = 0; i < 5; i++) {
+        uint32_t v = i * 7;
+        map_insert(&m, &i, 0, &v, 0);
+        want += v;
+    }
+    parts(&m, 3);
+    for_each(&m, want);
+
+    for (; i < N; i++) {
+        uint32_t v = i * 7;
+        map_insert(&m, &i, 0, &v, 0);
+        want += v;
+    }
+    unsigned nparts;
+    for (nparts = 1; nparts <= MAX_PARTS; nparts *= 3) parts(&m, nparts);
+    for_each(&m, want);
+
+    //Same again with the lookup accelerators on
+    map_front_enable(&m, 1024);
+    map_filter_enable(&m, 0);
+    for (i = 0; i < N; i += 5) map_search_touch(&m, &i);
+    for_each(&m, want);
+
+    map_free(&m);
+    puts("par ok");
+    return 0;
+}
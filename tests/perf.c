@@ -0,0 +1,54 @@
+#include <stdint.h>
+#include <time.h>
+#include "map.h"
+#include "map_perf.h"
+#include "test.h"
+
+//Built with -DMAP_PERF (see run.sh)
+
+static void spin_ms(int ms) {
+    struct timespec a, b;
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &b);
+    } while ((b.tv_sec - a.tv_sec)*1000 + (b.tv_nsec - a.tv_nsec)/1000000 < ms);
+}
+
+int main(void) {
+    map_perf_report r;
+    CHECK(map_perf_start() >= 0);
+
+    //Nest way past the stack limit. Once everything but the outer 
+    //frame has ended, the time has to go to the outer frame.
+    int i;
+    __map_perf_begin(MAP_PERF_INSERT);
+    for (i = 0; i < 20; i++) __map_perf_begin(MAP_PERF_EXPAND);
+    for (i = 0; i < 20; i++) __map_perf_end();
+    spin_ms(20);
+    __map_perf_end();
+    __map_perf_end(); //Unmatched ends are ignored
+
+    map_perf_stop(&r);
+    CHECK(r.calls[MAP_PERF_INSERT] == 1);
+    CHECK(r.totals[MAP_PERF_INSERT][MAP_PERF_NS] >= 20000000);
+    CHECK(r.totals[MAP_PERF_EXPAND][MAP_PERF_NS] < 20000000);
+
+    //The real hooks
+    map m;
+    map_init(&m, uint64_t, uint64_t, VAL2VAL);
+    CHECK(map_perf_start() >= 0);
+    uint64_t k;
+    for (k = 0; k < 1000; k++) map_insert(&m, &k, 0, &k, 0);
+    for (k = 0; k < 2000; k++) map_search(&m, &k);
+    for (k = 0; k < 500; k++) map_search_delete(&m, &k, NULL);
+    map_perf_stop(&r);
+    CHECK(r.calls[MAP_PERF_INSERT] == 1000);
+    CHECK(r.calls[MAP_PERF_SEARCH] == 2000);
+    CHECK(r.calls[MAP_PERF_DELETE] == 500);
+    CHECK(r.calls[MAP_PERF_EXPAND] > 0);
+    map_perf_print(&r, stdout);
+    map_free(&m);
+
+    puts("perf ok");
+    return 0;
+}
@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "map.h"
+#include "test.h"
+
+#define N 100000
+
+static unsigned calls;
+
+static int mult_of_3(void *key, void *val, void *ctx) {
+    (void) key;
+    (void) ctx;
+    calls++;
+    return *(unsigned*) val % 3 == 0;
+}
+
+static int everything(void *key, void *val, void *ctx) {
+    (void) key;
+    (void) val;
+    (void) ctx;
+    return 1;
+}
+
+//With the index, the front cache and cache mode all on, since they all
+//have to hear about entries going away
+static void with_extras(void) {
+    map m;
+    map_init(&m, char const*, unsigned, STR2VAL);
+    CHECK(map_index_enable(&m) == 0);
+    map_front_enable(&m, 256);
+    unsigned i;
+    for (i = 0; i < N; i++) {
+        char buf[16];
+        sprintf(buf, "k%u", i);
+        map_insert(&m, strdup(buf), 1, &i, 0);
+        if (i % 7 == 0) map_search_touch(&m, buf);
+    }
+
+    calls = 0;
+    CHECK(map_remove_if(&m, mult_of_3, NULL) == (N + 2) / 3);
+    CHECK(calls == N);
+    CHECK(m.count == N - (N + 2) / 3);
+    for (i = 0; i < N; i++) {
+        char buf[16];
+        sprintf(buf, "k%u", i);
+        unsigned *v = map_search(&m, buf);
+        CHECK(!v == (i % 3 == 0));
+        CHECK(!v || *v == i);
+    }
+    unsigned n = 0;
+    map_range_iter r = map_range_begin(&m, NULL, NULL);
+    while (map_range_next(&r)) n++;
+    CHECK(n == m.count);
+
+    //Everything still works on top of what's left
+    for (i = 0; i < N; i += 3) {
+        char buf[16];
+        sprintf(buf, "k%u", i);
+        CHECK(map_insert(&m, strdup(buf), 1, &i, 0) == 0);
+    }
+    CHECK(m.count == N);
+
+    map_clear(&m);
+    CHECK(m.count == 0 && map_begin(&m) == map_end(&m));
+    r = map_range_begin(&m, NULL, NULL);
+    CHECK(!map_range_next(&r));
+    CHECK(!map_search(&m, "k1"));
+    for (i = 0; i < 1000; i++) {
+        char buf[16];
+        sprintf(buf, "k%u", i);
+        map_insert(&m, strdup(buf), 1, &i, 0);
+    }
+    CHECK(m.count == 1000);
+    CHECK(map_remove_if(&m, everything, NULL) == 1000);
+    CHECK(m.count == 0);
+    map_free(&m);
+}
+
+//Owned values get freed (ASan would notice if they didn't), and cache
+//mode's clock hand can't be left pointing at a removed entry
+static void owned_and_cached(void) {
+    map m;
+    map_init(&m, char const*, char const*, STR2STR);
+    map_set_capacity(&m, 500, NULL, NULL);
+    unsigned i;
+    for (i = 0; i < 2000; i++) {
+        char buf[16];
+        sprintf(buf, "k%u", i);
+        map_insert(&m, strdup(buf), 1, strdup(buf), 1);
+        if (i % 100 == 99) CHECK(map_remove_if(&m, everything, NULL) > 0);
+    }
+    CHECK(m.count <= 500);
+    map_clear(&m);
+    map_free(&m);
+}
+
+int main(void) {
+    with_extras();
+    owned_and_cached();
+    puts("remove_if ok");
+    return 0;
+}
@@ -0,0 +1,43 @@
+#!/bin/sh
+# Builds and runs every test. Run it from the top of the repo. Each test
+# gets built with ASan, and the ones that start threads get built again
+# with TSan. Pass test names (like "wal tier") to run just those.
+
+CFLAGS="-Wall -Wextra -g -O1 -I."
+THREADED="par wal server tier front filter merge"
+SRCS=$(ls *.c | grep -v '^main\.c$')
+OUT=${TMPDIR:-/tmp}/map_tests
+mkdir -p "$OUT"
+
+if [ $# -eq 0 ]; then
+    set -- $(cd tests && ls *.c | sed 's/\.c$//')
+fi
+
+fail=0
+run() {
+    name=$1 san=$2 extra=
+    case $name in perf) extra=-DMAP_PERF ;; esac
+    # shmap.c's seqlock needs standalone fences (readers map the region
+    # read-only, so they can't use a read-modify-write on the sequence
+    # number instead), and gcc warns that TSan doesn't understand 
+    # fences. None of the tests built with TSan use shmap anyway.
+    case $san in thread) extra="$extra -Wno-tsan" ;; esac
+    if ! gcc $CFLAGS $extra -fsanitize=$san -o "$OUT/$name.$san" tests/$name.c $SRCS -pthread -lm; then
+        echo "FAIL $name ($san): build"
+        fail=1
+        return
+    fi
+    if (cd "$OUT" && "./$name.$san") > "$OUT/$name.$san.log" 2>&1; then
+        echo "ok   $name ($san)"
+    else
+        echo "FAIL $name ($san): see $OUT/$name.$san.log"
+        fail=1
+    fi
+}
+
+for t in "$@"; do
+    run $t address,undefined
+    case " $THREADED " in *" $t "*) run $t thread ;; esac
+done
+
+exit $fail
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "map.h"
+#include "test.h"
+
+static unsigned char *seen;
+
+static void visit(void *key, void *val, void *ctx) {
+    (void) ctx;
+    unsigned k = *(unsigned*) key;
+    CHECK(*(unsigned*) val == k);
+    CHECK(seen[k] < 255);
+    seen[k]++;
+}
+
+//Keys [0, n) stay put the whole time while new keys pour in (making the
+//map grow several times) and some of the new ones get deleted again. 
+//The stable keys have to come out exactly once, and nothing can come
+//out twice.
+static void with_churn(unsigned seed, unsigned n, int extras) {
+    unsigned churn = 4 * n;
+    seen = calloc(churn + 40 * n, 1);
+    map m;
+    map_init(&m, unsigned, unsigned, VAL2VAL);
+    if (extras) {
+        map_front_enable(&m, 64);
+        map_filter_enable(&m, 0);
+    }
+    unsigned i, next = churn;
+    for (i = 0; i < n; i++) map_insert(&m, &i, 0, &i, 0);
+    unsigned slots = m.slots;
+
+    uint64_t cursor = 0;
+    do {
+        cursor = map_scan(&m, cursor, visit, NULL, 1 + rand_r(&seed) % 10);
+        int j;
+        for (j = 0; j < 20; j++, next++) map_insert(&m, &next, 0, &next, 0);
+        for (j = 0; j < 5; j++) {
+            unsigned k = churn + rand_r(&seed) % (next - churn);
+            map_search_delete(&m, &k, NULL);
+        }
+        CHECK(next < churn + 40 * n);
+    } while (cursor);
+
+    for (i = 0; i < n; i++) CHECK(seen[i] == 1);
+    for (i = n; i < next; i++) CHECK(seen[i] <= 1);
+    CHECK(m.slots > 4 * slots);
+    map_free(&m);
+    free(seen);
+}
+
+//Small maps, empty maps and maps that have been emptied out by deletes
+static void edges(void) {
+    map m;
+    map_init(&m, unsigned, unsigned, VAL2VAL);
+    seen = calloc(1000, 1);
+    CHECK(map_scan(&m, 0, visit, NULL, 10) == 0);
+
+    unsigned i;
+    for (i = 0; i < 5; i++) map_insert(&m, &i, 0, &i, 0);
+    uint64_t cursor = 0;
+    do cursor = map_scan(&m, cursor, visit, NULL, 1); while (cursor);
+    for (i = 0; i < 5; i++) CHECK(seen[i] == 1);
+
+    memset(seen, 0, 1000);
+    for (i = 5; i < 1000; i++) map_insert(&m, &i, 0, &i, 0);
+    for (i = 0; i < 1000; i++) if (i % 10) map_search_delete(&m, &i, NULL);
+    cursor = 0;
+    do cursor = map_scan(&m, cursor, visit, NULL, 1000000); while (cursor);
+    for (i = 0; i < 1000; i++) CHECK(seen[i] == (i % 10 == 0));
+    free(seen);
+    map_free(&m);
+}
+
+static uint32_t identity(void const *key, unsigned sz, uint64_t seed) {
+    (void) sz;
+    (void) seed;
+    return *(uint32_t const*) key;
+}
+
+//Small integer keys through a hash that doesn't mix at all. Every hash
+//has its high bits clear, so without the map doing its own mixing 
+//they'd all pile into the first slot. The scan cursor lives in the
+//mixed space too, so scanning has to keep working.
+static void weak_hash(void) {
+    map m;
+    map_custom_init(&m, unsigned, unsigned, identity, map_val_comp, map_val_comp,
+                    NULL, NULL, sizeof(unsigned), sizeof(unsigned));
+    unsigned i, n = 100000, next = n;
+    seen = calloc(2 * n, 1);
+    for (i = 0; i < n; i++) map_insert(&m, &i, 0, &i, 0);
+    CHECK(m.stats.longest_chain < MAP_CHAIN_LIMIT && m.stats.rehashes == 0);
+    for (i = 0; i < n; i++) CHECK(*(unsigned*) map_search(&m, &i) == i);
+
+    uint64_t cursor = 0;
+    do {
+        cursor = map_scan(&m, cursor, visit, NULL, 100);
+        int j;
+        for (j = 0; j < 20 && next < 2 * n; j++, next++) map_insert(&m, &next, 0, &next, 0);
+    } while (cursor);
+    for (i = 0; i < n; i++) CHECK(seen[i] == 1);
+    for (i = n; i < next; i++) CHECK(seen[i] <= 1);
+    CHECK(m.stats.longest_chain < MAP_CHAIN_LIMIT && m.stats.rehashes == 0);
+    free(seen);
+    map_free(&m);
+}
+
+int main(void) {
+    unsigned round;
+    for (round = 0; round < 20; round++) {
+        unsigned seed = round;
+        with_churn(seed, 1000 + rand_r(&seed) % 20000, round % 2);
+    }
+    edges();
+    weak_hash();
+    puts("scan ok");
+    return 0;
+}
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "kv.h"
+#include "server.h"
+#include "test.h"
+
+static char path[64];
+
+static int connect_to_server(void) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strcpy(addr.sun_path, path);
+    int tries;
+    for (tries = 0; tries < 500; tries++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        CHECK(fd >= 0);
+        if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0) return fd;
+        close(fd);
+        usleep(10000);
+    }
+    CHECK(!"server never came up");
+    return -1;
+}
+
+static void send_all(int fd, char const *p, size_t n) {
+    while (n) {
+        ssize_t rc = write(fd, p, n);
+        CHECK(rc > 0);
+        p += rc;
+        n -= rc;
+    }
+}
+
+//Reads exactly strlen(want) bytes and checks them
+static void expect(int fd, char const *want) {
+    size_t n = strlen(want), got = 0;
+    char *buf = malloc(n + 1);
+    while (got < n) {
+        ssize_t rc = read(fd, buf + got, n - got);
+        CHECK(rc > 0);
+        got += rc;
+    }
+    buf[n] = 0;
+    CHECK(!strcmp(buf, want));
+    free(buf);
+}
+
+//Pipelined commands, split up so that reads end in the middle of a 
+//command, and a second connection that sees what the first one wrote
+static void pipelined(void) {
+    int a = connect_to_server(), b = connect_to_server();
+    char const *cmds = "set x 1\nset y 2\nget x\nset x 3\nmget x y z\ndelk y\nget y\nset x\n";
+    size_t len = strlen(cmds), i;
+    for (i = 0; i < len; i += 5) {
+        send_all(a, cmds + i, len - i < 5 ? len - i : 5);
+        usleep(1000);
+    }
+    expect(a, "Written\nWritten\n1\nOverwritten\n3 2 (null)\nDeleted\n(null)\nError usage: set key value\n");
+
+    char const *more = "get x\nmset p 7 q 8\nmget p q\n";
+    send_all(b, more, strlen(more));
+    expect(b, "3\nStored 2\n7 8\n");
+    close(a);
+    close(b);
+}
+
+int main(void) {
+    alarm(300); //Rather than hang forever if the server gets stuck
+    sprintf(path, "server_test.%d.sock", (int) getpid());
+    pid_t pid = fork();
+    CHECK(pid >= 0);
+    if (pid == 0) {
+        kv db;
+        kv_init(&db);
+        int rc = kv_serve(&db, path);
+        kv_free(&db);
+        _exit(rc < 0);
+    }
+
+    pipelined();
+
+    //The load generator runs its connections on threads
+    kv_load_opts lo = {
+        .path = path, .conns = 3, .depth = 16, .nops = 3000,
+        .keyspace = 500, .get_pct = 50
+    };
+    CHECK(kv_load(&lo) == 0);
+
+    CHECK(kill(pid, SIGTERM) == 0);
+    int status;
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    CHECK(access(path, F_OK) < 0);
+    puts("server ok");
+    return 0;
+}
@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "map.h"
+#include "test.h"
+
+static int odd_key(void *key, void *val, void *ctx) {
+    (void) ctx;
+    CHECK(val == NULL);
+    return *(uint32_t*) key % 2;
+}
+
+static void strings(void) {
+    set s;
+    set_init(&s, char const*, SET_STR);
+    map m;
+    map_init(&m, char const*, uint32_t, STR2VAL);
+    //The whole point: no room spent on a value
+    CHECK(s.entry_sz < m.entry_sz);
+    map_free(&m);
+
+    uint32_t i;
+    for (i = 0; i < 10000; i++) {
+        char buf[16];
+        sprintf(buf, "k%u", i % 7000);
+        char *c = strdup(buf);
+        int rc = set_insert(&s, c, 1);
+        CHECK(rc == (i >= 7000));
+        if (rc) free(c);
+    }
+    CHECK(set_count(&s) == 7000);
+    for (i = 0; i < 7000; i += 2) {
+        char buf[16];
+        sprintf(buf, "k%u", i);
+        CHECK(set_remove(&s, buf) == 0);
+        CHECK(set_remove(&s, buf) == 1);
+    }
+    for (i = 0; i < 7000; i++) {
+        char buf[16];
+        sprintf(buf, "k%u", i);
+        CHECK(set_contains(&s, buf) == (i % 2));
+    }
+
+    unsigned n = 0;
+    set_iter it;
+    for (it = set_begin(&s); it != set_end(&s); set_iter_step(it)) {
+        char const *k;
+        set_iter_deref(&s, it, &k);
+        CHECK(atoi(k + 1) % 2);
+        n++;
+    }
+    CHECK(n == set_count(&s));
+    set_clear(&s);
+    CHECK(set_count(&s) == 0 && set_begin(&s) == set_end(&s));
+    set_free(&s);
+}
+
+static void algebra(void) {
+    set a, b;
+    set_init(&a, uint32_t, SET_VAL);
+    set_init(&b, uint32_t, SET_VAL);
+    uint32_t i;
+    for (i = 0; i < 3000; i++) set_insert(&a, &i, 0);
+    for (i = 2000; i < 5000; i++) set_insert(&b, &i, 0);
+
+    set c;
+    CHECK(map_clone(&a, &c, MAP_CLONE_SHALLOW) == 0);
+    CHECK(set_union(&c, &b) == 0);
+    CHECK(set_count(&c) == 5000);
+    map_free(&c);
+
+    CHECK(map_clone(&a, &c, MAP_CLONE_SHALLOW) == 0);
+    CHECK(set_intersect(&c, &b) == 0);
+    CHECK(set_count(&c) == 1000);
+    for (i = 0; i < 5000; i++) CHECK(set_contains(&c, &i) == (i >= 2000 && i < 3000));
+    map_free(&c);
+
+    CHECK(set_subtract(&a, &b) == 0);
+    CHECK(set_count(&a) == 2000);
+    CHECK(set_remove_if(&a, odd_key, NULL) == 1000);
+    for (i = 0; i < 5000; i++) CHECK(set_contains(&a, &i) == (i < 2000 && i % 2 == 0));
+    set_free(&a);
+    set_free(&b);
+}
+
+int main(void) {
+    strings();
+    algebra();
+    puts("set ok");
+    return 0;
+}
@@ -0,0 +1,153 @@
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "shmap.h"
+#include "test.h"
+
+//Keys and values are big enough that a torn copy would show up: every
+//word of a value is the same, and the low part says which key it's for
+#define NKEYS 1200
+typedef struct { uint32_t k[4]; } test_key;
+typedef struct { uint32_t v[16]; } test_val;
+
+static void fill(test_val *v, uint32_t x) {
+    int j;
+    for (j = 0; j < 16; j++) v->v[j] = x;
+}
+
+//Hammers sm with lookups while the writer is busy and exits with the
+//number of torn or mismatched values it saw
+static void reader(shmap *sm, unsigned iters) {
+    unsigned i, bad = 0;
+    for (i = 0; i < iters; i++) {
+        test_key k = {{i % NKEYS}};
+        test_val v;
+        int rc = shmap_search(sm, &k, &v);
+        if (rc < 0) bad++;
+        if (rc != 0) continue;
+        int j;
+        for (j = 1; j < 16; j++) bad += v.v[j] != v.v[0];
+        bad += v.v[0] % NKEYS != k.k[0];
+    }
+    _exit(bad != 0);
+}
+
+static void basics(void) {
+    shmap w;
+    CHECK(shmap_create(&w, NULL, 100, sizeof(test_key), sizeof(test_val)) == 0);
+
+    test_key k = {{7}};
+    test_val v, got;
+    fill(&v, 7);
+    CHECK(shmap_search(&w, &k, &got) == 1);
+    CHECK(shmap_insert(&w, &k, &v) == 0);
+    fill(&v, 7 + NKEYS);
+    CHECK(shmap_insert(&w, &k, &v) == 1);
+    CHECK(shmap_search(&w, &k, &got) == 0 && got.v[15] == 7 + NKEYS);
+    CHECK(shmap_count(&w) == 1);
+
+    //Readers see everything the writer did, and can't write
+    shmap r;
+    CHECK(shmap_attach_fd(&r, dup(w.fd)) == 0);
+    CHECK(shmap_search(&r, &k, &got) == 0 && got.v[0] == 7 + NKEYS);
+    CHECK(shmap_insert(&r, &k, &v) < 0);
+    CHECK(shmap_delete(&w, &k) == 0);
+    CHECK(shmap_delete(&w, &k) == 1);
+    CHECK(shmap_search(&r, &k, &got) == 1);
+    shmap_detach(&r);
+
+    //Fill it right up
+    uint32_t i;
+    for (i = 0; i < 100; i++) {
+        test_key k2 = {{i}};
+        CHECK(shmap_insert(&w, &k2, &v) == 0);
+    }
+    k.k[0] = 100;
+    CHECK(shmap_insert(&w, &k, &v) < 0);
+    CHECK(shmap_count(&w) == 100);
+
+    shmap_detach(&w);
+}
+
+//The header is the first few uint32_ts of the region: magic, seq,
+//capacity, key_sz, val_sz, entry_sz
+static void bad_headers(void) {
+    shmap w, r;
+    CHECK(shmap_create(&w, NULL, 10, sizeof(test_key), sizeof(test_val)) == 0);
+    uint32_t *raw = (uint32_t*) w.hdr;
+
+    //Entries that claim to be smaller than a key and value
+    uint32_t entry_sz = raw[5];
+    raw[5] = 8;
+    CHECK(shmap_attach_fd(&r, w.fd) < 0);
+    raw[5] = entry_sz;
+
+    //A val_sz that would run past the end of the last entry
+    raw[4] = 4096;
+    CHECK(shmap_attach_fd(&r, w.fd) < 0);
+    raw[4] = sizeof(test_val);
+
+    //Capacity bigger than the region
+    raw[2] = 1000;
+    CHECK(shmap_attach_fd(&r, w.fd) < 0);
+    raw[2] = 10;
+
+    CHECK(shmap_attach_fd(&r, dup(w.fd)) == 0);
+
+    //A writer that died halfway through a change leaves seq odd.
+    //Readers have to give up eventually instead of hanging.
+    raw[1] |= 1;
+    test_key k = {{1}};
+    test_val got;
+    CHECK(shmap_search(&r, &k, &got) < 0);
+
+    shmap_detach(&r);
+    shmap_detach(&w);
+}
+
+//One writer, several reader processes (attached by name)
+static void concurrent(void) {
+    char name[64];
+    sprintf(name, "/shmap_test.%d", (int) getpid());
+    shmap w;
+    CHECK(shmap_create(&w, name, 1000, sizeof(test_key), sizeof(test_val)) == 0);
+
+    int i;
+    for (i = 0; i < 4; i++) {
+        pid_t pid = fork();
+        CHECK(pid >= 0);
+        if (pid == 0) {
+            shmap r;
+            if (shmap_attach(&r, name) < 0) _exit(2);
+            reader(&r, 500000);
+        }
+    }
+
+    unsigned seed = 1;
+    for (i = 0; i < 1000000; i++) {
+        test_key k = {{rand_r(&seed) % NKEYS}};
+        test_val v;
+        fill(&v, k.k[0] + NKEYS*(rand_r(&seed) % 1000));
+        if (rand_r(&seed) % 4) {
+            CHECK(shmap_insert(&w, &k, &v) >= 0 || shmap_count(&w) == 1000);
+        } else {
+            CHECK(shmap_delete(&w, &k) >= 0);
+        }
+    }
+
+    int st;
+    while (wait(&st) > 0) CHECK(WIFEXITED(st) && WEXITSTATUS(st) == 0);
+
+    shmap_detach(&w);
+    CHECK(shmap_unlink(name) == 0);
+    CHECK(shmap_attach(&w, name) < 0);
+}
+
+int main(void) {
+    basics();
+    bad_headers();
+    concurrent();
+    puts("shmap ok");
+    return 0;
+}
@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "map.h"
+#include "test.h"
+
+#define KEYS 14
+
+static int there[KEYS];
+static uint32_t vals[KEYS];
+static int seen[KEYS];
+
+static uint64_t key_of(int k) {
+    return k * 1000003ull;
+}
+
+//A small map keeps its filled entries packed at the front of entries
+//(slots 1..count, in list order) and the empty ones after, with no 
+//free bitmap. Once it's hashed it has to have one.
+static void check_layout(map const *m) {
+    if (!m->small) {
+        CHECK(m->free_bits);
+        return;
+    }
+    CHECK(!m->free_bits && m->slots <= MAP_SMALL_MAX);
+    list_head const *head = m->entries + m->list_head_off, *cur = head->next;
+    uint32_t i;
+    for (i = 1; i <= m->count; i++, cur = cur->next) {
+        void const *e = m->entries + i*m->entry_sz;
+        CHECK(cur == e + m->list_head_off);
+        CHECK(((__entry_flags const*) (e + m->flag_off))->is_filled);
+        CHECK(*(uint32_t const*) (e + m->hash_off) == m->hash(e + m->key_off, m->key_sz, m->seed));
+    }
+    CHECK(cur == head);
+    for (cur = m->empties.next; i <= m->slots; i++, cur = cur->next) {
+        void const *e = m->entries + i*m->entry_sz;
+        CHECK(cur == e + m->list_head_off);
+        CHECK(!((__entry_flags const*) (e + m->flag_off))->is_filled);
+    }
+    CHECK(cur == &m->empties);
+}
+
+static void check_contents(map const *m) {
+    uint32_t n = 0, walked = 0;
+    int k;
+    for (k = 0; k < KEYS; k++) {
+        uint64_t key = key_of(k);
+        uint32_t *v = map_search(m, &key);
+        CHECK(!v == !there[k]);
+        CHECK(!v || *v == vals[k]);
+        n += there[k];
+    }
+    CHECK(m->count == n);
+    map_iter it;
+    for (it = map_begin(m); it != map_end(m); map_iter_step(it)) walked++;
+    CHECK(walked == n);
+}
+
+static int odd(void *key, void *val, void *ctx) {
+    (void) val;
+    (void) ctx;
+    return *(uint64_t*) key / 1000003 & 1;
+}
+
+static void count_seen(void *key, void *val, void *ctx) {
+    (void) val;
+    (void) ctx;
+    seen[*(uint64_t*) key / 1000003]++;
+}
+
+//Short random runs of every operation against a plain array. With 14
+//possible keys, maps keep crossing MAP_SMALL_MAX in both directions,
+//and every op has to work whichever mode the map is in.
+static void one_run(unsigned *seed) {
+    map m, c, o;
+    map_init(&m, uint64_t, uint32_t, VAL2VAL);
+    memset(there, 0, sizeof(there));
+    int steps = rand_r(seed) % 40, s, j;
+    for (s = 0; s < steps; s++) {
+        int op = rand_r(seed) % 20, k = rand_r(seed) % KEYS;
+        uint64_t key = key_of(k);
+        uint32_t v = rand_r(seed);
+        if (op < 8) {
+            CHECK(map_insert(&m, &key, 0, &v, 0) == there[k]);
+            there[k] = 1;
+            vals[k] = v;
+        } else if (op < 10) {
+            int inserted;
+            uint32_t *p = map_emplace(&m, &key, 0, &inserted);
+            CHECK(inserted == !there[k]);
+            if (inserted) {
+                CHECK(*p == 0);
+                vals[k] = 0;
+            }
+            there[k] = 1;
+        } else if (op < 14) {
+            CHECK(map_search_delete(&m, &key, NULL) == !there[k]);
+            there[k] = 0;
+        } else if (op == 14) {
+            uint32_t want = 0;
+            for (j = 1; j < KEYS; j += 2) {
+                want += there[j];
+                there[j] = 0;
+            }
+            CHECK(map_remove_if(&m, odd, NULL) == want);
+        } else if (op == 15) {
+            map_clear(&m);
+            memset(there, 0, sizeof(there));
+        } else if (op == 16) {
+            CHECK(map_clone(&m, &c, 0) == 0);
+            check_layout(&c);
+            check_contents(&c);
+            map_free(&m);
+            CHECK(map_clone(&c, &m, 0) == 0);
+            map_free(&c);
+        } else if (op == 17) {
+            memset(seen, 0, sizeof(seen));
+            uint64_t cursor = 0;
+            do cursor = map_scan(&m, cursor, count_seen, NULL, 2); while (cursor);
+            for (j = 0; j < KEYS; j++) CHECK(seen[j] == there[j]);
+        } else if (op == 18) {
+            if (v % 2) map_set_seed(&m, v);
+            else map_reserve(&m, v % 12);
+        } else {
+            int in_o[KEYS] = {0};
+            uint32_t o_vals[KEYS];
+            map_init(&o, uint64_t, uint32_t, VAL2VAL);
+            for (j = 0; j < 3; j++) {
+                k = rand_r(seed) % KEYS;
+                key = key_of(k);
+                v = rand_r(seed);
+                map_insert(&o, &key, 0, &v, 0);
+                in_o[k] = 1;
+                o_vals[k] = v;
+            }
+            map_merge(&m, &o, MAP_MERGE_KEEP_DST);
+            for (j = 0; j < KEYS; j++) {
+                if (in_o[j] && !there[j]) {
+                    there[j] = 1;
+                    vals[j] = o_vals[j];
+                }
+            }
+            map_free(&o);
+        }
+        check_layout(&m);
+        check_contents(&m);
+    }
+    map_free(&m);
+}
+
+//String keys (with and without the index), sets, and the things that
+//always turn a small map into a hashed one
+static void str_run(unsigned *seed) {
+    map m;
+    map_init(&m, char const*, uint32_t, STR2VAL);
+    if (rand_r(seed) % 2) CHECK(map_index_enable(&m) == 0);
+    int here[16] = {0}, s, j;
+    char buf[16];
+    for (s = 0; s < 30; s++) {
+        uint32_t k = rand_r(seed) % 16;
+        sprintf(buf, "k%u", k);
+        if (rand_r(seed) % 3) {
+            if (!here[k]) map_insert(&m, strdup(buf), 1, &k, 0);
+            else CHECK(*(uint32_t*) map_search(&m, buf) == k);
+            here[k] = 1;
+        } else {
+            CHECK(map_search_delete(&m, buf, NULL) == !here[k]);
+            here[k] = 0;
+        }
+        check_layout(&m);
+        if (m.index) {
+            int found = 0, want = here[1];
+            map_range_iter r = map_prefix_scan(&m, "k1", 2);
+            while (map_range_next(&r)) found++;
+            for (j = 10; j < 16; j++) want += here[j];
+            CHECK(found == want);
+        }
+    }
+    switch (rand_r(seed) % 3) {
+    case 0:
+        map_front_enable(&m, 8);
+        CHECK(!m.small);
+        break;
+    case 1:
+        map_set_capacity(&m, 3, NULL, NULL);
+        CHECK(!m.small && m.count <= 3);
+        break;
+    }
+    check_layout(&m);
+    map_free(&m);
+
+    set st;
+    set_init(&st, uint32_t, SET_VAL);
+    for (s = 0; s < 10; s++) {
+        uint32_t k = rand_r(seed) % 9;
+        set_insert(&st, &k, 0);
+        CHECK(set_contains(&st, &k));
+        check_layout(&st);
+    }
+    set_free(&st);
+
+    map b;
+    map_init(&b, uint32_t, uint64_t, VAL2VAL);
+    uint32_t k;
+    for (k = 0; k < 6; k++) {
+        uint64_t v = k * 3;
+        map_insert(&b, &k, 0, &v, 0);
+    }
+    CHECK(b.small);
+    CHECK(map_box_values(&b) == 0);
+    CHECK(!b.small);
+    for (k = 0; k < 6; k++) CHECK(*(uint64_t*) map_search(&b, &k) == k * 3);
+    map_free(&b);
+}
+
+int main(void) {
+    unsigned seed = 7, i;
+    for (i = 0; i < 20000; i++) one_run(&seed);
+    for (i = 0; i < 2000; i++) str_run(&seed);
+    puts("small ok");
+    return 0;
+}
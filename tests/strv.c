@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "map.h"
+#include "test.h"
+
+//Every substring (up to 20 bytes) of a buffer with NULs in it is its
+//own key, and the map stores views into the buffer, not copies
+static void substrings(void) {
+    static char const buf[] = "hello world\0binary\0keys and some longer stuff here";
+    uint32_t const len = sizeof(buf) - 1;
+    map m;
+    map_init(&m, map_strv, uint32_t, STRV2VAL);
+
+    uint32_t off, n, count = 0;
+    for (off = 0; off < len; off++) {
+        for (n = 0; off + n <= len && n < 20; n++) {
+            int inserted;
+            uint32_t *v = map_emplace(&m, STRV_AMP(buf + off, n), 0, &inserted);
+            if (inserted) count++;
+            *v = off * 100 + n;
+        }
+    }
+    CHECK(m.count == count);
+
+    for (off = 0; off < len; off++) {
+        for (n = 0; off + n <= len && n < 20; n++) {
+            uint32_t *v = map_search(&m, STRV_AMP(buf + off, n));
+            CHECK(v && *v % 100 == n);
+            CHECK(!memcmp(buf + *v / 100, buf + off, n));
+        }
+    }
+
+    //Same bytes from somewhere else still match, and a NUL in the 
+    //middle doesn't end the key
+    char copy[8];
+    memcpy(copy, "binary\0k", 8);
+    CHECK(map_search(&m, STRV_AMP(copy, 8)));
+    CHECK(map_search(&m, STRV_AMP(copy, 6)));
+    CHECK(!map_search(&m, STRV_AMP("binary\0x", 8)));
+    map_free(&m);
+}
+
+//With free_key set, the map frees the characters
+static void owned(void) {
+    map m;
+    map_init(&m, map_strv, uint32_t, STRV2VAL);
+    unsigned i;
+    for (i = 0; i < 1000; i++) {
+        char *p = malloc(16);
+        int n = sprintf(p, "key-%u", i);
+        map_insert(&m, STRV_AMP(p, n), 1, &i, 0);
+    }
+    for (i = 0; i < 1000; i += 2) {
+        char buf[16];
+        int n = sprintf(buf, "key-%u", i);
+        CHECK(map_search_delete(&m, STRV_AMP(buf, n), NULL) == 0);
+    }
+    for (i = 0; i < 1000; i++) {
+        char buf[16];
+        int n = sprintf(buf, "key-%u", i);
+        uint32_t *v = map_search(&m, STRV_AMP(buf, n));
+        CHECK(i % 2 ? v && *v == i : !v);
+    }
+    map_free(&m);
+}
+
+int main(void) {
+    substrings();
+    owned();
+    puts("strv ok");
+    return 0;
+}
@@ -0,0 +1,33 @@
+#ifndef TEST_H
+#define TEST_H 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+//Every file in tests/ is its own program. tests/run.sh builds each one
+//against all the library sources (everything but main.c) and runs it,
+//and a test passes if it exits with 0.
+
+#define CHECK(x) do {                                                    \
+    if (!(x)) {                                                          \
+        fprintf(stderr, "%s:%d: CHECK failed: %s\n",                     \
+            __FILE__, __LINE__, #x);                                     \
+        exit(1);                                                         \
+    }                                                                    \
+} while (0)
+
+//Which slot (counting from 0, so one less than home_idx in map.c) a 
+//hash lands in, for tests that need to aim keys at a slot or follow
+//chains by hand. Has to match slot_pos and pos_idx in map.c, for a
+//map that hasn't been given a slot_key.
+static inline uint32_t test_home_slot(uint32_t slots, uint32_t hash) {
+    hash ^= hash >> 16;
+    hash *= 0x85EBCA6B;
+    hash ^= hash >> 13;
+    hash *= 0xC2B2AE35;
+    hash ^= hash >> 16;
+    return ((uint64_t) hash * slots) >> 32;
+}
+
+#endif
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "tier.h"
+#include "test.h"
+
+#define KEYS 50000
+
+static char dir[64];
+static uint32_t ref[KEYS]; //UINT32_MAX if the key shouldn't be there
+
+static void check_all(tier *t) {
+    unsigned k;
+    for (k = 0; k < KEYS; k++) {
+        char key[32];
+        uint32_t v;
+        sprintf(key, "key%u", k);
+        int rc = tier_get(t, key, &v);
+        CHECK(rc == (ref[k] != UINT32_MAX));
+        CHECK(!rc || v == ref[k]);
+    }
+}
+
+//Random sets, deletes and gets against a plain array, with a budget
+//small enough that most of the data lives on disk and the compactor
+//(which runs in its own thread, so run.sh builds this with TSan too)
+//has plenty to do. Closing and reopening every so often checks that
+//everything made it to disk.
+static void matches_ref(void) {
+    tier_opts opts = TIER_DEFAULT_OPTS(dir);
+    opts.mem_bytes = 256 << 10;
+    opts.nparts = 8;
+    opts.compact_segs = 3;
+    tier t;
+    CHECK(tier_open(&t, &opts) == 0);
+
+    unsigned seed = 7, i;
+    uint64_t compactions = 0, disk_hits = 0;
+    for (i = 0; i < KEYS; i++) ref[i] = UINT32_MAX;
+    for (i = 0; i < 300000; i++) {
+        char key[32];
+        unsigned k = rand_r(&seed) % KEYS, op = rand_r(&seed) % 10;
+        sprintf(key, "key%u", k);
+        if (op < 4) {
+            uint32_t v = rand_r(&seed) % UINT32_MAX;
+            CHECK(tier_set(&t, key, v) == 0);
+            ref[k] = v;
+        } else if (op < 5) {
+            CHECK(tier_del(&t, key) == 0);
+            ref[k] = UINT32_MAX;
+        } else {
+            uint32_t v;
+            int rc = tier_get(&t, key, &v);
+            CHECK(rc == (ref[k] != UINT32_MAX));
+            CHECK(!rc || v == ref[k]);
+        }
+        if (i % 100000 == 99999) {
+            //Only safe to read once the compactor has stopped
+            tier_close(&t);
+            compactions += t.compactions;
+            disk_hits += t.disk_hits;
+            CHECK(tier_open(&t, &opts) == 0);
+        }
+    }
+    CHECK(compactions > 0 && disk_hits > 0);
+    check_all(&t);
+    tier_close(&t);
+
+    //nparts comes from the meta file once there's data
+    opts.nparts = 3;
+    CHECK(tier_open(&t, &opts) == 0);
+    CHECK(t.opts.nparts == 8);
+    check_all(&t);
+    tier_close(&t);
+}
+
+static void bad_keys(void) {
+    tier_opts opts = TIER_DEFAULT_OPTS(dir);
+    tier t;
+    char key[300];
+    CHECK(tier_open(&t, &opts) == 0);
+    memset(key, 'x', 256);
+    key[256] = '\0';
+    CHECK(tier_set(&t, key, 1) < 0);
+    CHECK(tier_set(&t, "", 1) < 0);
+    key[255] = '\0';
+    CHECK(tier_set(&t, key, 1) == 0);
+    uint32_t v;
+    CHECK(tier_get(&t, key, &v) == 1 && v == 1);
+    tier_close(&t);
+}
+
+int main(void) {
+    char cmd[128];
+    strcpy(dir, "tier_test.XXXXXX");
+    CHECK(mkdtemp(dir));
+    matches_ref();
+    bad_keys();
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    CHECK(system(cmd) == 0);
+    puts("tier ok");
+    return 0;
+}
@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "kv.h"
+#include "wal.h"
+#include "test.h"
+
+static char dir[64];
+
+static void open_db(kv *db, wal *w, wal_opts const *opts) {
+    kv_init(db);
+    CHECK(wal_open(w, opts, &db->m) == 0);
+    db->log = w;
+}
+
+static void close_db(kv *db) {
+    wal_close(db->log);
+    kv_free(db);
+}
+
+static void exec(kv *db, char const *cmd, char const *want) {
+    char line[256];
+    kv_out out = {0};
+    strcpy(line, cmd);
+    kv_exec(db, line, &out);
+    CHECK(out.len == strlen(want) && !memcmp(out.buf, want, out.len));
+    free(out.buf);
+}
+
+static off_t file_size(char const *name) {
+    char path[PATH_MAX];
+    struct stat st;
+    snprintf(path, PATH_MAX, "%s/%s", dir, name);
+    return stat(path, &st) < 0 ? -1 : st.st_size;
+}
+
+static void cut_file(char const *name, off_t len) {
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/%s", dir, name);
+    CHECK(truncate(path, len) == 0);
+}
+
+static void flip_byte(char const *name, off_t off) {
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/%s", dir, name);
+    FILE *f = fopen(path, "r+");
+    CHECK(f);
+    fseek(f, off, SEEK_SET);
+    int c = fgetc(f);
+    fseek(f, off, SEEK_SET);
+    fputc(c ^ 0x55, f);
+    fclose(f);
+}
+
+static void fresh_dir(void) {
+    char cmd[128];
+    if (dir[0]) {
+        snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+        CHECK(system(cmd) == 0);
+    }
+    strcpy(dir, "wal_test.XXXXXX");
+    CHECK(mkdtemp(dir));
+}
+
+static void roundtrip(void) {
+    fresh_dir();
+    wal_opts opts = WAL_DEFAULT_OPTS(dir);
+    kv db;
+    wal w;
+
+    open_db(&db, &w, &opts);
+    exec(&db, "set a 1", "Written\n");
+    exec(&db, "set b 2", "Written\n");
+    exec(&db, "set a 3", "Overwritten\n");
+    exec(&db, "delk b", "Deleted\n");
+    exec(&db, "mset c 4 d 5", "Stored 2\n");
+    close_db(&db);
+
+    open_db(&db, &w, &opts);
+    CHECK(db.m.count == 3);
+    exec(&db, "mget a b c d", "3 (null) 4 5\n");
+
+    //A broken log means the mset never happens at all
+    w.io_error = 1;
+    exec(&db, "mset e 6 f 7", "Error log failed\n");
+    CHECK(!kv_get(&db, "e") && !kv_get(&db, "f"));
+    w.io_error = 0;
+    close_db(&db);
+
+    //Chop the last batch in half. Replay has to drop all of it, and
+    //then appends carry on from the end of the good part.
+    off_t before = file_size("log.0");
+    open_db(&db, &w, &opts);
+    exec(&db, "mset g 8 h 9 i 10", "Stored 3\n");
+    close_db(&db);
+    cut_file("log.0", file_size("log.0") - 3);
+
+    open_db(&db, &w, &opts);
+    exec(&db, "mget a c g h i", "3 4 (null) (null) (null)\n");
+    CHECK(file_size("log.0") == before);
+    exec(&db, "set j 11", "Written\n");
+    close_db(&db);
+
+    open_db(&db, &w, &opts);
+    exec(&db, "mget a g j", "3 (null) 11\n");
+    close_db(&db);
+}
+
+//With the snapshot blocked, compaction still rotates the log but can
+//never delete the old ones, so we end up with at least two. A bad 
+//record in an older one has to stop replay there.
+static void torn_middle(void) {
+    fresh_dir();
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/snap.tmp", dir);
+    CHECK(mkdir(path, 0700) == 0);
+
+    wal_opts opts = WAL_DEFAULT_OPTS(dir);
+    opts.compact_bytes = 4096;
+    kv db;
+    wal w;
+    open_db(&db, &w, &opts);
+    int i;
+    for (i = 0; i < 2000; i++) {
+        char key[32];
+        sprintf(key, "k%d", i);
+        CHECK(kv_set(&db, key, i) == 1);
+    }
+    close_db(&db);
+    //The first compaction always rotates. Later ones might not, if 
+    //the (failing) snapshot thread hasn't been joined yet.
+    CHECK(w.gen >= 1);
+    CHECK(file_size("log.0") > 0 && file_size("log.1") > 0);
+
+    flip_byte("log.0", file_size("log.0") / 2);
+    open_db(&db, &w, &opts);
+    CHECK(db.m.count > 0 && db.m.count < 2000);
+    //What survived has to be exactly the keys before the bad record
+    for (i = 0; i < 2000; i++) {
+        char key[32];
+        sprintf(key, "k%d", i);
+        CHECK(!kv_get(&db, key) == (i >= (int) db.m.count));
+    }
+    CHECK(w.gen == 0);
+    close_db(&db);
+    CHECK(file_size("log.1") < 0 && file_size("log.1.skipped") > 0);
+}
+
+//Lots of compaction on the snapshot thread while the flusher runs
+static void compaction(void) {
+    fresh_dir();
+    wal_opts opts = WAL_DEFAULT_OPTS(dir);
+    opts.compact_bytes = 8192;
+    opts.commit_us = 200;
+    kv db;
+    wal w;
+    static uint32_t ref[5000];
+    memset(ref, 0xff, sizeof(ref));
+
+    open_db(&db, &w, &opts);
+    unsigned seed = 1;
+    int i;
+    for (i = 0; i < 50000; i++) {
+        unsigned k = rand_r(&seed) % 5000;
+        char key[32];
+        sprintf(key, "k%u", k);
+        if (rand_r(&seed) % 8) {
+            CHECK(kv_set(&db, key, i) >= 0);
+            ref[k] = i;
+        } else {
+            CHECK(kv_del(&db, key) >= 0);
+            ref[k] = UINT32_MAX;
+        }
+    }
+    close_db(&db);
+    CHECK(file_size("snap") > 0);
+
+    open_db(&db, &w, &opts);
+    for (i = 0; i < 5000; i++) {
+        char key[32];
+        sprintf(key, "k%d", i);
+        uint32_t *v = kv_get(&db, key);
+        if (ref[i] == UINT32_MAX) CHECK(!v);
+        else CHECK(v && *v == ref[i]);
+    }
+    close_db(&db);
+}
+
+int main(void) {
+    roundtrip();
+    torn_middle();
+    compaction();
+    fresh_dir(); //Cleans up the last one
+    rmdir(dir);
+    puts("wal ok");
+    return 0;
+}
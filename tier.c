@@ -0,0 +1,784 @@
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "map.h"
+#include "tier.h"
+#include "fast_fail.h"
+
+//Records in a block look like this (host byte order, like the WAL):
+//  uint8_t klen;  //0 means the rest of the block is padding
+//  uint8_t tomb;  //1 for a delete
+//  uint32_t val;
+//  char key[klen];
+//Records never straddle blocks, so every block can be read on its own.
+#define REC_HDR 6
+
+//How pending marks a delete
+#define TOMB (1ull << 32)
+
+//After the blocks comes the index (the first key of every block, as a
+//length byte and the characters), and then this
+#define SEG_MAGIC "TIERSEG1"
+typedef struct {
+    char magic[8];
+    uint64_t nrecs;
+    uint64_t index_off;
+    //A merged segment takes the place of every segment in its
+    //partition from covers_from up to its own seq. If we crash after
+    //it's renamed into place but before those are unlinked, we have to
+    //know to ignore them, since the merge may have dropped tombstones
+    //that were hiding keys in them.
+    uint64_t covers_from;
+    uint32_t nblocks;
+    uint32_t pad;
+} seg_trailer;
+
+struct tier_seg {
+    int fd;
+    uint64_t seq;
+    uint64_t covers_from;
+    uint64_t nrecs;
+    uint32_t nblocks;
+    char **first; //First key of every block
+};
+
+//Our guess at what a hot or pending entry costs on top of its key.
+//The entries array has up to twice as many slots as entries (it grows
+//by doubling), and every key is its own malloc.
+#define KEY_OVERHEAD 16
+static size_t entry_cost(map const *md) {
+    return 2*md->entry_sz + KEY_OVERHEAD;
+}
+
+//Partitions have to stay put across runs, so this can't use the
+//map's random seed
+static unsigned part_of(tier const *t, char const *key) {
+    uint32_t h = map_str_hash(&key, 0, 0);
+    return (unsigned) (((uint64_t) h * t->opts.nparts) >> 32);
+}
+
+static int pread_all(int fd, void *p, size_t n, off_t off) {
+    while (n) {
+        ssize_t rc = pread(fd, p, n, off);
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (rc == 0) return -1; //File is shorter than it should be
+        p += rc;
+        n -= rc;
+        off += rc;
+    }
+    return 0;
+}
+
+static void seg_free(tier_seg *s) {
+    if (!s) return;
+    uint32_t i;
+    if (s->first) {
+        for (i = 0; i < s->nblocks; i++) free(s->first[i]);
+    }
+    free(s->first);
+    if (s->fd >= 0) close(s->fd);
+    free(s);
+}
+
+static void seg_path(char *dst, tier const *t, unsigned part, uint64_t seq) {
+    snprintf(dst, PATH_MAX, "%s/seg.%u.%llu", t->opts.dir, part, (unsigned long long) seq);
+}
+
+//Opens a segment and reads its index into memory
+static tier_seg *seg_open(char const *path, uint64_t seq) {
+    tier_seg *s = calloc(1, sizeof(*s));
+    if (!s) FAST_FAIL("out of memory");
+    s->seq = seq;
+    s->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (s->fd < 0) goto bad;
+
+    struct stat st;
+    seg_trailer tr;
+    if (fstat(s->fd, &st) < 0 || (size_t) st.st_size < sizeof(tr)) goto bad;
+    size_t tr_off = st.st_size - sizeof(tr);
+    if (pread_all(s->fd, &tr, sizeof(tr), tr_off) < 0) goto bad;
+    if (memcmp(tr.magic, SEG_MAGIC, 8) || tr.index_off > tr_off) goto bad;
+    if (tr.index_off != (uint64_t) tr.nblocks * TIER_BLOCK) goto bad;
+    s->nrecs = tr.nrecs;
+    s->covers_from = tr.covers_from;
+
+    size_t isz = tr_off - tr.index_off;
+    unsigned char *idx = malloc(isz ? isz : 1);
+    s->first = calloc(tr.nblocks ? tr.nblocks : 1, sizeof(char*));
+    if (!idx || !s->first) FAST_FAIL("out of memory");
+    if (pread_all(s->fd, idx, isz, tr.index_off) < 0) {
+        free(idx);
+        goto bad;
+    }
+
+    size_t off = 0;
+    for (s->nblocks = 0; s->nblocks < tr.nblocks; s->nblocks++) {
+        if (off >= isz || off + 1 + idx[off] > isz) break;
+        char *k = malloc(idx[off] + 1);
+        if (!k) FAST_FAIL("out of memory");
+        memcpy(k, idx + off + 1, idx[off]);
+        k[idx[off]] = '\0';
+        s->first[s->nblocks] = k;
+        off += 1 + idx[off];
+    }
+    free(idx);
+    if (s->nblocks != tr.nblocks) goto bad;
+    return s;
+
+bad:
+    seg_free(s);
+    return NULL;
+}
+
+enum {
+    SEG_MISS,
+    SEG_SET,
+    SEG_TOMB
+};
+
+//Returns SEG_MISS, SEG_SET (and fills in *val), SEG_TOMB, or negative
+//if the read failed
+static int seg_find(tier *t, tier_seg *s, char const *key, size_t klen, uint32_t *val) {
+    //Last block whose first key is <= key
+    uint32_t lo = 0, hi = s->nblocks;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo)/2;
+        if (strcmp(s->first[mid], key) <= 0) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == 0) return SEG_MISS;
+
+    unsigned char block[TIER_BLOCK];
+    t->preads++;
+    if (pread_all(s->fd, block, TIER_BLOCK, (off_t) (lo - 1) * TIER_BLOCK) < 0) return -1;
+
+    size_t off = 0;
+    while (off + REC_HDR <= TIER_BLOCK && block[off]) {
+        size_t rlen = block[off];
+        int c = key_cmp((char*) block + off + REC_HDR, rlen, key, klen);
+        if (c == 0) {
+            if (block[off + 1]) return SEG_TOMB;
+            memcpy(val, block + off + 2, 4);
+            return SEG_SET;
+        }
+        if (c > 0) break; //Sorted, so it isn't here
+        off += REC_HDR + rlen;
+    }
+    return SEG_MISS;
+}
+
+//Writes a segment one record at a time (in key order)
+typedef struct {
+    tier *t;
+    FILE *f;
+    char tmp[PATH_MAX];
+    unsigned part;
+    uint64_t seq;
+    unsigned char block[TIER_BLOCK];
+    size_t used;
+    char **first;
+    uint32_t nblocks;
+    uint32_t cap;
+    uint64_t nrecs;
+} seg_writer;
+
+static int writer_start(seg_writer *w, tier *t, unsigned part, uint64_t seq) {
+    memset(w, 0, sizeof(*w));
+    w->t = t;
+    w->part = part;
+    w->seq = seq;
+    snprintf(w->tmp, PATH_MAX, "%s/seg.tmp.%llu", t->opts.dir, (unsigned long long) seq);
+    w->f = fopen(w->tmp, "w");
+    if (!w->f) return -1;
+    setvbuf(w->f, NULL, _IOFBF, 1 << 20);
+    return 0;
+}
+
+static void writer_end_block(seg_writer *w) {
+    memset(w->block + w->used, 0, TIER_BLOCK - w->used);
+    fwrite(w->block, TIER_BLOCK, 1, w->f);
+    w->used = 0;
+}
+
+static void writer_add(seg_writer *w, char const *key, size_t klen, uint64_t val) {
+    if (w->used + REC_HDR + klen > TIER_BLOCK) writer_end_block(w);
+
+    if (w->used == 0) {
+        if (w->nblocks == w->cap) {
+            w->cap = w->cap ? 2*w->cap : 64;
+            w->first = realloc(w->first, w->cap * sizeof(char*));
+            if (!w->first) FAST_FAIL("out of memory");
+        }
+        char *k = malloc(klen + 1);
+        if (!k) FAST_FAIL("out of memory");
+        memcpy(k, key, klen);
+        k[klen] = '\0';
+        w->first[w->nblocks++] = k;
+    }
+
+    unsigned char *p = w->block + w->used;
+    uint32_t v = (uint32_t) val;
+    p[0] = klen;
+    p[1] = (val & TOMB) ? 1 : 0;
+    memcpy(p + 2, &v, 4);
+    memcpy(p + REC_HDR, key, klen);
+    w->used += REC_HDR + klen;
+    w->nrecs++;
+}
+
+static void writer_abort(seg_writer *w) {
+    uint32_t i;
+    for (i = 0; i < w->nblocks; i++) free(w->first[i]);
+    free(w->first);
+    if (w->f) fclose(w->f);
+    unlink(w->tmp);
+}
+
+//Finishes the file, makes it durable, and renames it into place (the
+//caller still has to sync the directory). Returns the open segment,
+//or NULL on error. An empty segment is fine: it just has no blocks.
+static tier_seg *writer_finish(seg_writer *w, uint64_t covers_from) {
+    if (w->used) writer_end_block(w);
+
+    uint32_t i;
+    for (i = 0; i < w->nblocks; i++) {
+        unsigned char len = strlen(w->first[i]);
+        fwrite(&len, 1, 1, w->f);
+        fwrite(w->first[i], len, 1, w->f);
+    }
+
+    seg_trailer tr = {
+        .nrecs = w->nrecs,
+        .index_off = (uint64_t) w->nblocks * TIER_BLOCK,
+        .covers_from = covers_from,
+        .nblocks = w->nblocks
+    };
+    memcpy(tr.magic, SEG_MAGIC, 8);
+    fwrite(&tr, sizeof(tr), 1, w->f);
+
+    int rc = (fflush(w->f) == 0 && !ferror(w->f) && fsync(fileno(w->f)) == 0) ? 0 : -1;
+    long sz = ftell(w->f);
+    if (fclose(w->f) != 0) rc = -1;
+    w->f = NULL;
+
+    char path[PATH_MAX];
+    seg_path(path, w->t, w->part, w->seq);
+    if (rc == 0) rc = rename(w->tmp, path);
+    if (rc < 0) {
+        writer_abort(w);
+        return NULL;
+    }
+
+    //We already have the index, so no need to read it back
+    tier_seg *s = calloc(1, sizeof(*s));
+    if (!s) FAST_FAIL("out of memory");
+    s->fd = open(path, O_RDONLY | O_CLOEXEC);
+    s->seq = w->seq;
+    s->covers_from = covers_from;
+    s->nrecs = w->nrecs;
+    s->nblocks = w->nblocks;
+    s->first = w->first;
+    w->first = NULL;
+    if (s->fd < 0) {
+        seg_free(s);
+        return NULL;
+    }
+
+    //Flushes and merges both end up here
+    pthread_mutex_lock(&w->t->lock);
+    w->t->bytes_written += sz;
+    pthread_mutex_unlock(&w->t->lock);
+    return s;
+}
+
+static void part_push(tier_part *p, tier_seg *s) {
+    if (p->nsegs == p->cap) {
+        p->cap = p->cap ? 2*p->cap : 4;
+        p->segs = realloc(p->segs, p->cap * sizeof(tier_seg*));
+        if (!p->segs) FAST_FAIL("out of memory");
+    }
+    p->segs[p->nsegs++] = s;
+}
+
+//Reads a segment front to back, for merging
+typedef struct {
+    tier_seg *s;
+    uint32_t block; //Next block to read (so 0 means buf is empty)
+    unsigned char buf[TIER_BLOCK];
+    size_t off;
+    int done;
+    //The current record
+    char const *key;
+    size_t klen;
+    uint64_t val; //With TOMB set for deletes
+} seg_cursor;
+
+static int cursor_next(seg_cursor *c) {
+    //Step past the record we're on (if any), and move on to the next
+    //block once this one runs out
+    if (c->key) c->off += REC_HDR + c->klen;
+    while (c->block == 0 || c->off + REC_HDR > TIER_BLOCK || !c->buf[c->off]) {
+        if (c->block == c->s->nblocks) {
+            c->done = 1;
+            return 0;
+        }
+        if (pread_all(c->s->fd, c->buf, TIER_BLOCK, (off_t) c->block * TIER_BLOCK) < 0) return -1;
+        c->block++;
+        c->off = 0;
+    }
+
+    unsigned char *p = c->buf + c->off;
+    uint32_t v;
+    memcpy(&v, p + 2, 4);
+    c->klen = p[0];
+    c->key = (char*) p + REC_HDR;
+    c->val = v | (p[1] ? TOMB : 0);
+    return 0;
+}
+
+//Merges segs (oldest first, and starting from the oldest segment in
+//the partition) into one new segment. Since nothing older is left,
+//tombstones can be dropped along with anything they shadow.
+static tier_seg *merge_segs(tier *t, unsigned part, tier_seg **segs, unsigned n) {
+    seg_cursor *cs = calloc(n, sizeof(*cs));
+    if (!cs) FAST_FAIL("out of memory");
+
+    //The merged segment takes over the newest input's name, so it sits
+    //in the same place in the partition's order
+    seg_writer w;
+    tier_seg *out = NULL;
+    if (writer_start(&w, t, part, segs[n-1]->seq) < 0) goto done;
+
+    unsigned i;
+    for (i = 0; i < n; i++) {
+        cs[i].s = segs[i];
+        if (cursor_next(&cs[i]) < 0) goto fail;
+    }
+
+    for (;;) {
+        //Smallest key, and the newest segment that has it
+        int best = -1;
+        for (i = 0; i < n; i++) {
+            if (cs[i].done) continue;
+            if (best < 0) {
+                best = i;
+                continue;
+            }
+            int c = key_cmp(cs[i].key, cs[i].klen, cs[best].key, cs[best].klen);
+            if (c <= 0) best = i;
+        }
+        if (best < 0) break;
+
+        //Copy it out, since advancing the cursors may reuse the buffer
+        char key[256];
+        size_t klen = cs[best].klen;
+        uint64_t val = cs[best].val;
+        memcpy(key, cs[best].key, klen);
+        if (!(val & TOMB)) writer_add(&w, key, klen, val);
+
+        for (i = 0; i < n; i++) {
+            if (cs[i].done) continue;
+            if (key_cmp(cs[i].key, cs[i].klen, key, klen)) continue;
+            if (cursor_next(&cs[i]) < 0) goto fail;
+        }
+    }
+
+    out = writer_finish(&w, segs[0]->covers_from);
+    goto done;
+
+fail:
+    writer_abort(&w);
+done:
+    free(cs);
+    return out;
+}
+
+//The partition with the most segments, if any has enough to merge
+static tier_part *pick_part(tier *t, unsigned *which) {
+    tier_part *best = NULL;
+    unsigned i;
+    for (i = 0; i < t->opts.nparts; i++) {
+        tier_part *p = t->parts + i;
+        if (p->compacting || p->nsegs < t->opts.compact_segs) continue;
+        if (!best || p->nsegs > best->nsegs) {
+            best = p;
+            *which = i;
+        }
+    }
+    return best;
+}
+
+static void *compactor(void *arg) {
+    tier *t = arg;
+
+    pthread_mutex_lock(&t->lock);
+    for (;;) {
+        tier_part *p;
+        unsigned part = 0;
+        while (!t->stopping && !(p = pick_part(t, &part))) {
+            pthread_cond_wait(&t->wake, &t->lock);
+        }
+        if (t->stopping) break;
+
+        //Flushes can keep adding newer segments while we work; we only
+        //touch the ones that are here now
+        unsigned n = p->nsegs;
+        tier_seg **in = malloc(n * sizeof(tier_seg*));
+        if (!in) FAST_FAIL("out of memory");
+        memcpy(in, p->segs, n * sizeof(tier_seg*));
+        p->compacting = 1;
+        pthread_mutex_unlock(&t->lock);
+
+        tier_seg *merged = merge_segs(t, part, in, n);
+        if (merged && sync_dir(t->opts.dir) < 0) {
+            //It's in place, but might not stay there after a crash. The
+            //inputs are still good, so just carry on with them.
+            seg_free(merged);
+            merged = NULL;
+        }
+
+        pthread_mutex_lock(&t->lock);
+        p->compacting = 0;
+        if (!merged) {
+            //Don't spin on a partition we can't merge
+            t->io_error = 1;
+            free(in);
+            break;
+        }
+        p->segs[0] = merged;
+        memmove(p->segs + 1, p->segs + n, (p->nsegs - n) * sizeof(tier_seg*));
+        p->nsegs -= n - 1;
+        t->compactions++;
+        pthread_mutex_unlock(&t->lock);
+
+        //Nobody can see the inputs anymore. The newest one's file was
+        //already replaced by the rename.
+        unsigned i;
+        char path[PATH_MAX];
+        for (i = 0; i < n; i++) {
+            if (i < n - 1) {
+                seg_path(path, t, part, in[i]->seq);
+                unlink(path);
+            }
+            seg_free(in[i]);
+        }
+        free(in);
+
+        pthread_mutex_lock(&t->lock);
+    }
+    pthread_mutex_unlock(&t->lock);
+
+    return NULL;
+}
+
+//nparts is fixed the first time the store is opened
+static int read_meta(tier *t) {
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/meta", t->opts.dir);
+    FILE *f = fopen(path, "r");
+    if (f) {
+        unsigned n;
+        int ok = (fscanf(f, "nparts %u", &n) == 1 && n > 0);
+        fclose(f);
+        if (!ok) return -1;
+        t->opts.nparts = n;
+        return 0;
+    }
+    if (errno != ENOENT) return -1;
+
+    f = fopen(path, "w");
+    if (!f) return -1;
+    fprintf(f, "nparts %u\n", t->opts.nparts);
+    int rc = (fflush(f) == 0 && fsync(fileno(f)) == 0) ? 0 : -1;
+    if (fclose(f) != 0) rc = -1;
+    if (rc == 0) rc = sync_dir(t->opts.dir);
+    return rc;
+}
+
+static int seq_cmp(void const *a, void const *b) {
+    uint64_t x = (*(tier_seg* const*) a)->seq, y = (*(tier_seg* const*) b)->seq;
+    return (x > y) - (x < y);
+}
+
+static int load_segments(tier *t) {
+    DIR *d = opendir(t->opts.dir);
+    if (!d) return -1;
+
+    int rc = 0;
+    struct dirent *de;
+    char path[PATH_MAX];
+    while ((de = readdir(d))) {
+        unsigned part;
+        unsigned long long seq;
+        int len = 0;
+        snprintf(path, PATH_MAX, "%s/%s", t->opts.dir, de->d_name);
+
+        //Leftovers from a flush or merge that didn't finish
+        if (!strncmp(de->d_name, "seg.tmp.", 8)) {
+            unlink(path);
+            continue;
+        }
+        if (sscanf(de->d_name, "seg.%u.%llu%n", &part, &seq, &len) != 2) continue;
+        if (de->d_name[len] || part >= t->opts.nparts) continue;
+
+        tier_seg *s = seg_open(path, seq);
+        if (!s) {
+            rc = -1;
+            break;
+        }
+        part_push(t->parts + part, s);
+        if (seq >= t->next_seq) t->next_seq = seq + 1;
+    }
+    closedir(d);
+    if (rc < 0) return -1;
+
+    //Sort each partition by age, and get rid of anything a merged
+    //segment already covers
+    unsigned i;
+    for (i = 0; i < t->opts.nparts; i++) {
+        tier_part *p = t->parts + i;
+        if (p->nsegs) qsort(p->segs, p->nsegs, sizeof(tier_seg*), seq_cmp);
+
+        unsigned j, keep = 0;
+        for (j = 0; j < p->nsegs; j++) {
+            tier_seg *s = p->segs[j];
+            while (keep && p->segs[keep-1]->seq >= s->covers_from) {
+                tier_seg *old = p->segs[--keep];
+                seg_path(path, t, i, old->seq);
+                unlink(path);
+                seg_free(old);
+            }
+            p->segs[keep++] = s;
+        }
+        p->nsegs = keep;
+    }
+    return 0;
+}
+
+static void free_parts(tier *t) {
+    unsigned i, j;
+    for (i = 0; i < t->opts.nparts; i++) {
+        for (j = 0; j < t->parts[i].nsegs; j++) seg_free(t->parts[i].segs[j]);
+        free(t->parts[i].segs);
+    }
+    free(t->parts);
+    t->parts = NULL;
+}
+
+int tier_open(tier *t, tier_opts const *opts) {
+    memset(t, 0, sizeof(*t));
+    t->opts = *opts;
+    if (t->opts.nparts == 0) t->opts.nparts = 1;
+    if (t->opts.compact_segs < 2) t->opts.compact_segs = 2;
+
+    if (read_meta(t) < 0) return -1;
+    t->parts = calloc(t->opts.nparts, sizeof(tier_part));
+    if (!t->parts) FAST_FAIL("out of memory");
+    if (load_segments(t) < 0) {
+        free_parts(t);
+        return -1;
+    }
+
+    map_init(&t->hot, char const*, uint32_t, STR2VAL);
+    map_init(&t->pending, char const*, uint64_t, STR2VAL);
+
+    //An eighth of the budget buffers writes and the rest is the cache
+    t->pending_max = t->opts.mem_bytes / 8;
+    size_t hot_max = (t->opts.mem_bytes - t->pending_max) / (entry_cost(&t->hot) + 16);
+    if (hot_max < 16) hot_max = 16;
+    if (hot_max > UINT32_MAX / 2) hot_max = UINT32_MAX / 2;
+    map_set_capacity(&t->hot, hot_max, NULL, NULL);
+
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->wake, NULL);
+    //If there's work left over from last time, the compactor will 
+    //find it before it goes to sleep
+    if (pthread_create(&t->compactor, NULL, compactor, t)) {
+        FAST_FAIL("could not start compactor");
+    }
+    return 0;
+}
+
+static int check_key(char const *key) {
+    size_t klen = strlen(key);
+    return (klen == 0 || klen > 255) ? -2 : 0;
+}
+
+//Finds or adds key (the map gets its own copy) and returns its value
+static void *upsert(map *md, char const *key, int *inserted) {
+    char *copied = strdup(key);
+    if (!copied) FAST_FAIL("out of memory");
+    void *slot = map_emplace(md, copied, 1, inserted);
+    if (!*inserted) free(copied);
+    return slot;
+}
+
+static void cache(tier *t, char const *key, uint32_t val) {
+    int inserted;
+    *(uint32_t*) upsert(&t->hot, key, &inserted) = val;
+}
+
+int tier_get(tier *t, char const *key, uint32_t *val) {
+    t->gets++;
+
+    uint32_t *hv = map_search_touch(&t->hot, key);
+    if (hv) {
+        t->hot_hits++;
+        *val = *hv;
+        return 1;
+    }
+
+    uint64_t *pv = map_search(&t->pending, key);
+    if (pv) {
+        t->pending_hits++;
+        if (*pv & TOMB) return 0;
+        *val = (uint32_t) *pv;
+        cache(t, key, *val);
+        return 1;
+    }
+
+    //Newest segment first, since it shadows everything older
+    size_t klen = strlen(key);
+    tier_part *p = t->parts + part_of(t, key);
+    int rc = SEG_MISS;
+    pthread_mutex_lock(&t->lock);
+    int i;
+    for (i = (int) p->nsegs - 1; i >= 0 && rc == SEG_MISS; i--) {
+        rc = seg_find(t, p->segs[i], key, klen, val);
+    }
+    pthread_mutex_unlock(&t->lock);
+
+    if (rc < 0) return -1;
+    if (rc != SEG_SET) return 0;
+    t->disk_hits++;
+    cache(t, key, *val);
+    return 1;
+}
+
+static int buffer(tier *t, char const *key, uint64_t val) {
+    int inserted;
+    *(uint64_t*) upsert(&t->pending, key, &inserted) = val;
+    if (inserted) t->pending_bytes += entry_cost(&t->pending) + strlen(key) + 1;
+    if (t->pending_bytes > t->pending_max) return tier_flush(t);
+    return 0;
+}
+
+int tier_set(tier *t, char const *key, uint32_t val) {
+    if (check_key(key) < 0) return -2;
+    if (t->io_error) return -1;
+    cache(t, key, val);
+    return buffer(t, key, val);
+}
+
+int tier_del(tier *t, char const *key) {
+    if (check_key(key) < 0) return -2;
+    if (t->io_error) return -1;
+    map_search_delete(&t->hot, key, NULL);
+    return buffer(t, key, TOMB);
+}
+
+typedef struct {
+    unsigned part;
+    char const *key;
+    size_t klen;
+    uint64_t val;
+} flush_rec;
+
+static int flush_cmp(void const *a, void const *b) {
+    flush_rec const *x = a, *y = b;
+    if (x->part != y->part) return (x->part > y->part) - (x->part < y->part);
+    return key_cmp(x->key, x->klen, y->key, y->klen);
+}
+
+int tier_flush(tier *t) {
+    if (t->io_error) return -1;
+    if (t->pending.count == 0) return 0;
+
+    //Sort everything by partition, then by key
+    uint32_t n = t->pending.count, i = 0;
+    flush_rec *recs = malloc(n * sizeof(flush_rec));
+    if (!recs) FAST_FAIL("out of memory");
+    map_iter it;
+    for (it = map_begin(&t->pending); it != map_end(&t->pending); map_iter_step(it)) {
+        char const *key;
+        uint64_t val;
+        map_iter_deref(&t->pending, it, &key, &val);
+        recs[i++] = (flush_rec) {part_of(t, key), key, strlen(key), val};
+    }
+    qsort(recs, n, sizeof(flush_rec), flush_cmp);
+
+    //One new segment for every partition that has something
+    tier_seg **made = malloc(n * sizeof(tier_seg*));
+    unsigned *made_part = malloc(n * sizeof(unsigned));
+    if (!made || !made_part) FAST_FAIL("out of memory");
+    unsigned nmade = 0;
+    int rc = 0;
+    for (i = 0; i < n && rc == 0; ) {
+        unsigned part = recs[i].part;
+        pthread_mutex_lock(&t->lock);
+        uint64_t seq = t->next_seq++;
+        pthread_mutex_unlock(&t->lock);
+
+        seg_writer w;
+        if (writer_start(&w, t, part, seq) < 0) {
+            rc = -1;
+            break;
+        }
+        for (; i < n && recs[i].part == part; i++) {
+            writer_add(&w, recs[i].key, recs[i].klen, recs[i].val);
+        }
+        tier_seg *s = writer_finish(&w, seq);
+        if (!s) rc = -1;
+        else {
+            made[nmade] = s;
+            made_part[nmade++] = part;
+        }
+    }
+    if (rc == 0) rc = sync_dir(t->opts.dir);
+
+    //If anything went wrong, pending keeps everything, and since the
+    //segments we did make only repeat what's in pending, they can stay
+    pthread_mutex_lock(&t->lock);
+    for (i = 0; i < nmade; i++) part_push(t->parts + made_part[i], made[i]);
+    if (rc < 0) t->io_error = 1;
+    pthread_cond_signal(&t->wake);
+    pthread_mutex_unlock(&t->lock);
+
+    free(made);
+    free(made_part);
+    free(recs);
+    if (rc < 0) return -1;
+
+    map_clear(&t->pending);
+    t->pending_bytes = 0;
+    t->flushes++;
+    return 0;
+}
+
+void tier_close(tier *t) {
+    tier_flush(t);
+
+    pthread_mutex_lock(&t->lock);
+    t->stopping = 1;
+    pthread_cond_signal(&t->wake);
+    pthread_mutex_unlock(&t->lock);
+    pthread_join(t->compactor, NULL);
+
+    free_parts(t);
+    map_free(&t->hot);
+    map_free(&t->pending);
+    pthread_mutex_destroy(&t->lock);
+    pthread_cond_destroy(&t->wake);
+}
@@ -0,0 +1,111 @@
+#ifndef TIER_H
+#define TIER_H 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "map.h"
+
+//Out-of-core store for when the keys don't fit in memory. Same kind
+//of data as the driver (strings to uint32_t), but only a bounded part
+//of it lives in a map:
+//  - hot: a STR2VAL map in cache mode, holding whatever was used most
+//    recently. Everything in it is also on disk or in pending, so
+//    evicting from it never costs anything.
+//  - pending: writes (and deletes, as tombstones) that haven't made it
+//    to disk yet. Once it's over its share of the budget, it gets
+//    sorted and written out as one new segment per partition.
+//  - segments: keys are split into nparts partitions by hash, and each
+//    partition is a stack of sorted, immutable files. Each file is
+//    made of TIER_BLOCK sized blocks, and we keep the first key of
+//    every block in memory, so looking a key up in a segment costs one
+//    pread. Newer segments shadow older ones.
+//A background thread merges a partition's segments into one once there
+//are compact_segs of them, which also throws away overwritten values
+//and tombstones.
+//
+//The files in dir look like this:
+//  meta              - nparts (which can't change once there's data)
+//  seg.<part>.<seq>  - a segment; bigger seq is newer
+//Segments are written to seg.tmp.<seq> and renamed into place. Writes
+//only become durable when pending gets flushed (or at tier_close), so
+//pair this with a log if you need more than that.
+//
+//Only one thread may call into a tier at a time.
+
+#define TIER_BLOCK 4096
+
+typedef struct {
+    char const *dir;       //Must already exist
+    size_t mem_bytes;      //Roughly how much memory hot + pending get
+    unsigned nparts;       //Ignored if dir already has data
+    unsigned compact_segs; //Merge a partition once it has this many
+} tier_opts;
+
+#define TIER_DEFAULT_OPTS(d) ((tier_opts) { \
+    .dir = (d),                             \
+    .mem_bytes = 64 << 20,                  \
+    .nparts = 64,                           \
+    .compact_segs = 4                       \
+})
+
+typedef struct tier_seg tier_seg;
+
+typedef struct {
+    tier_seg **segs; //Oldest first
+    unsigned nsegs;
+    unsigned cap;
+    int compacting;
+} tier_part;
+
+typedef struct {
+    tier_opts opts;
+
+    map hot;
+    map pending;          //Values are uint64_t, with bit 32 set for deletes
+    size_t pending_bytes; //Estimate of how much memory pending uses
+    size_t pending_max;
+
+    tier_part *parts;
+    uint64_t next_seq;
+
+    //Protects parts (the segment lists) from the compactor
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t compactor;
+    int stopping;
+    int io_error; //Sticky
+
+    //Counters. compactions gets bumped by the compactor (under lock).
+    uint64_t gets;
+    uint64_t hot_hits;
+    uint64_t pending_hits;
+    uint64_t disk_hits;
+    uint64_t preads;
+    uint64_t flushes;
+    uint64_t compactions;
+    uint64_t bytes_written;
+} tier;
+
+//Opens (or creates) the store in opts->dir. Returns 0 on success or
+//negative on error.
+int tier_open(tier *t, tier_opts const *opts);
+
+//Returns 1 and fills in *val if key is there, 0 if it isn't, or
+//negative on an I/O error
+int tier_get(tier *t, char const *key, uint32_t *val);
+
+//Keys have to be 1 to 255 characters. These return 0 on success, or
+//negative if the key is bad or the store has hit an I/O error. Unlike
+//kv_del, tier_del can't tell you whether the key was there without
+//going to disk, so it doesn't try.
+int tier_set(tier *t, char const *key, uint32_t val);
+int tier_del(tier *t, char const *key);
+
+//Writes everything in pending out to new segments
+int tier_flush(tier *t);
+
+//Flushes, waits for the compactor, and closes everything
+void tier_close(tier *t);
+
+#endif
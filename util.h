@@ -0,0 +1,32 @@
+#ifndef UTIL_H
+#define UTIL_H 1
+
+//Little helpers that more than one file needs and that don't belong
+//to any one of them.
+//
+//Include this before any system header. It turns on the POSIX and BSD
+//declarations we use (strdup, fsync, clock_gettime, ...), which libc 
+//hides in a strict -std=c99/c11 build. That used to be papered over
+//with a hand-written strdup prototype in every file that needed it.
+#if !defined(_DEFAULT_SOURCE) && !defined(_GNU_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
+#include <stddef.h>
+#include <string.h>
+
+//Seconds on the monotonic clock, for timing things
+double now_sec(void);
+
+//Makes renames and newly created files in dir durable. Returns 0 on
+//success or negative on error.
+int sync_dir(char const *dir);
+
+//Same order as strcmp, but for keys that aren't NUL-terminated
+static inline int key_cmp(char const *a, size_t alen, char const *b, size_t blen) {
+    int c = memcmp(a, b, alen < blen ? alen : blen);
+    if (c) return c;
+    return (alen > blen) - (alen < blen);
+}
+
+#endif
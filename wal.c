@@ -0,0 +1,689 @@
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "map.h"
+#include "wal.h"
+#include "fast_fail.h"
+
+//Every record looks like this (in host byte order, since the files
+//never leave the machine):
+//  uint32_t crc;  //CRC-32 of everything after it
+//  uint8_t op;
+//  uint8_t klen;
+//  uint32_t val;  //Ignored for deletes
+//  char key[klen];
+//Keys in the driver are at most 31 characters so one length byte is
+//plenty.
+#define REC_HDR 10
+#define REC_MAX (REC_HDR + 255)
+
+enum {
+    OP_SET = 1,
+    OP_DEL = 2,
+    OP_BATCH = 3 //No key; val says how many OP_SETs follow
+};
+
+//The snapshot is a header followed by one OP_SET record per key
+#define SNAP_MAGIC "KVSNAP01"
+typedef struct {
+    char magic[8];
+    uint64_t gen;   //Every log older than this is included
+    uint64_t count; //Number of records that follow
+} snap_hdr;
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+    uint32_t i;
+    for (i = 0; i < 256; i++) {
+        uint32_t c = i;
+        int j;
+        for (j = 0; j < 8; j++) c = (c & 1) ? (c >> 1) ^ 0xEDB88320 : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32(void const *p, size_t n) {
+    unsigned char const *b = p;
+    uint32_t c = 0xFFFFFFFF;
+    while (n--) c = crc_table[(c ^ *b++) & 0xFF] ^ (c >> 8);
+    return ~c;
+}
+
+//Writes a record into dst (which must have REC_MAX bytes) and returns
+//its length
+static size_t encode(void *dst, int op, char const *key, size_t klen, uint32_t val) {
+    unsigned char *p = dst;
+    p[4] = op;
+    p[5] = klen;
+    memcpy(p + 6, &val, 4);
+    memcpy(p + REC_HDR, key, klen);
+    uint32_t crc = crc32(p + 4, REC_HDR - 4 + klen);
+    memcpy(p, &crc, 4);
+    return REC_HDR + klen;
+}
+
+//Checks the record at p (with avail bytes left in the file). Returns
+//its length, or 0 if it's cut off or corrupted.
+static size_t decode(void const *p, size_t avail, int *op, char *key, uint32_t *val) {
+    unsigned char const *b = p;
+    if (avail < REC_HDR) return 0;
+    size_t klen = b[5];
+    if (avail < REC_HDR + klen) return 0;
+    uint32_t crc;
+    memcpy(&crc, b, 4);
+    if (crc != crc32(b + 4, REC_HDR - 4 + klen)) return 0;
+    *op = b[4];
+    memcpy(val, b + 6, 4);
+    memcpy(key, b + REC_HDR, klen);
+    key[klen] = '\0';
+    return REC_HDR + klen;
+}
+
+static int write_all(int fd, void const *p, size_t n) {
+    while (n) {
+        ssize_t rc = write(fd, p, n);
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += rc;
+        n -= rc;
+    }
+    return 0;
+}
+
+static void log_path(char *dst, char const *dir, uint64_t gen) {
+    snprintf(dst, PATH_MAX, "%s/log.%llu", dir, (unsigned long long) gen);
+}
+
+//Maps a whole file for reading. Returns NULL with *sz = 0 if the file
+//is empty, or NULL with *sz = -1 (and errno set) if it couldn't be 
+//opened or mapped.
+static void *map_file(char const *path, ssize_t *sz) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        *sz = -1;
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        *sz = -1;
+        close(fd);
+        return NULL;
+    }
+    if (st.st_size == 0) {
+        *sz = 0;
+        close(fd);
+        return NULL;
+    }
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        *sz = -1;
+        return NULL;
+    }
+    *sz = st.st_size;
+    return p;
+}
+
+static void apply(map *md, int op, char const *key, uint32_t val) {
+    if (op == OP_SET) {
+        char *copied = strdup(key);
+        if (!copied) FAST_FAIL("out of memory");
+        int inserted;
+        uint32_t *slot = map_emplace(md, copied, 1, &inserted);
+        *slot = val;
+        if (!inserted) free(copied);
+    } else {
+        map_search_delete(md, key, NULL);
+    }
+}
+
+//Returns 1 if the n records at p all made it to disk in one piece
+static int batch_ok(void const *p, size_t sz, uint32_t n) {
+    size_t off = 0;
+    while (n--) {
+        int op;
+        char key[256];
+        uint32_t val;
+        size_t len = decode(p + off, sz - off, &op, key, &val);
+        if (len == 0 || op != OP_SET) return 0;
+        off += len;
+    }
+    return 1;
+}
+
+//Returns the number of bytes of valid records at the start of the log
+static size_t replay_log(map *md, void const *p, size_t sz) {
+    size_t off = 0;
+    for (;;) {
+        int op;
+        char key[256];
+        uint32_t val;
+        size_t len = decode(p + off, sz - off, &op, key, &val);
+        if (len == 0) break;
+        if (op == OP_BATCH) {
+            //A batch counts as torn unless all of it is there, so 
+            //check before applying any of it
+            if (!batch_ok(p + off + len, sz - off - len, val)) break;
+        } else {
+            apply(md, op, key, val);
+        }
+        off += len;
+    }
+    return off;
+}
+
+static uint32_t count_sets(void const *p, size_t sz) {
+    size_t off = 0;
+    uint32_t n = 0;
+    for (;;) {
+        int op;
+        char key[256];
+        uint32_t val;
+        size_t len = decode(p + off, sz - off, &op, key, &val);
+        if (len == 0) break;
+        n += (op == OP_SET);
+        off += len;
+    }
+    return n;
+}
+
+//Returns 1 if the snapshot was loaded, 0 if there wasn't one, or
+//negative if it's unreadable
+static int load_snapshot(wal *w, map *md) {
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/snap", w->opts.dir);
+    ssize_t sz;
+    void *p = map_file(path, &sz);
+    //An empty snapshot can't happen either, so it counts as unreadable
+    if (!p) return (sz < 0 && errno == ENOENT) ? 0 : -1;
+
+    snap_hdr hdr;
+    if ((size_t) sz < sizeof(hdr)) goto bad;
+    memcpy(&hdr, p, sizeof(hdr));
+    if (memcmp(hdr.magic, SNAP_MAGIC, 8)) goto bad;
+
+    //The snapshot was fsynced before it got renamed into place, so
+    //unlike the logs, a short one means something is badly wrong
+    map_reserve(md, hdr.count);
+    size_t body = sz - sizeof(hdr);
+    if (replay_log(md, p + sizeof(hdr), body) != body || md->count != hdr.count) goto bad;
+
+    w->gen = hdr.gen;
+    munmap(p, sz);
+    return 1;
+
+bad:
+    munmap(p, sz);
+    return -1;
+}
+
+static int gen_cmp(void const *a, void const *b) {
+    uint64_t x = *(uint64_t const*) a, y = *(uint64_t const*) b;
+    return (x > y) - (x < y);
+}
+
+//Lists the generations of every log in dir, in order. Returns the
+//number found, or negative on error.
+static int list_logs(char const *dir, uint64_t **gens) {
+    DIR *d = opendir(dir);
+    if (!d) return -1;
+    int n = 0, cap = 8;
+    *gens = malloc(cap * sizeof(**gens));
+    if (!*gens) FAST_FAIL("out of memory");
+
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        char *end;
+        if (strncmp(de->d_name, "log.", 4)) continue;
+        unsigned long long g = strtoull(de->d_name + 4, &end, 10);
+        if (end == de->d_name + 4 || *end) continue;
+        if (n == cap) {
+            cap *= 2;
+            *gens = realloc(*gens, cap * sizeof(**gens));
+            if (!*gens) FAST_FAIL("out of memory");
+        }
+        (*gens)[n++] = g;
+    }
+    closedir(d);
+    qsort(*gens, n, sizeof(**gens), gen_cmp);
+    return n;
+}
+
+static int replay_logs(wal *w, map *md) {
+    uint64_t *gens;
+    int n = list_logs(w->opts.dir, &gens);
+    if (n < 0) return -1;
+
+    //Logs from before the snapshot are leftovers from a crash in the
+    //middle of compaction
+    char path[PATH_MAX];
+    int first = 0;
+    while (first < n && gens[first] < w->gen) {
+        log_path(path, w->opts.dir, gens[first]);
+        unlink(path);
+        first++;
+    }
+
+    void **data = calloc(n + 1, sizeof(*data));
+    ssize_t *sizes = calloc(n + 1, sizeof(*sizes));
+    if (!data || !sizes) FAST_FAIL("out of memory");
+
+    //Counting the sets first lets us size the map once instead of
+    //growing it over and over during the replay. Deletes could make
+    //this an overestimate, but never by more than the log itself.
+    int rc = 0, i;
+    uint32_t sets = 0;
+    for (i = first; i < n; i++) {
+        log_path(path, w->opts.dir, gens[i]);
+        data[i] = map_file(path, &sizes[i]);
+        if (sizes[i] < 0) rc = -1;
+        else if (data[i]) sets += count_sets(data[i], sizes[i]);
+    }
+    if (rc < 0) goto done;
+    map_reserve(md, md->count + sets);
+
+    //Replay stops at the first bad record, even if it isn't in the 
+    //last log: anything after it would be applied on top of a gap.
+    //Normally only the end of the newest log can be torn (rotate 
+    //commits the old log before starting a new one), so if we get
+    //here with logs left over, something else went wrong. Move them 
+    //out of the way rather than deleting them, so they're still 
+    //around to look at.
+    size_t valid = 0;
+    int last = n - 1;
+    for (i = first; i < n; i++) {
+        valid = data[i] ? replay_log(md, data[i], sizes[i]) : 0;
+        if ((ssize_t) valid != sizes[i]) {
+            last = i;
+            break;
+        }
+    }
+    for (i = last + 1; i < n; i++) {
+        char skipped[PATH_MAX + 16];
+        log_path(path, w->opts.dir, gens[i]);
+        snprintf(skipped, sizeof(skipped), "%s.skipped", path);
+        if (rename(path, skipped) < 0) rc = -1;
+    }
+    if (last < n - 1 && sync_dir(w->opts.dir) < 0) rc = -1;
+
+    //Keep appending to the last log we replayed. If the last few 
+    //records there never made it to disk in one piece, chop them off
+    //first.
+    w->fd = -1;
+    if (rc == 0 && first < n) {
+        w->gen = gens[last];
+        log_path(path, w->opts.dir, w->gen);
+        w->fd = open(path, O_WRONLY | O_APPEND);
+        if (w->fd < 0) rc = -1;
+        else if ((ssize_t) valid != sizes[last]) {
+            if (ftruncate(w->fd, valid) < 0 || fdatasync(w->fd) < 0) rc = -1;
+        }
+        w->log_sz = valid;
+    }
+
+done:
+    for (i = first; i < n; i++) {
+        if (data[i]) munmap(data[i], sizes[i]);
+    }
+    free(data);
+    free(sizes);
+    free(gens);
+    return rc;
+}
+
+static int open_new_log(wal *w, uint64_t gen) {
+    char path[PATH_MAX];
+    log_path(path, w->opts.dir, gen);
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    if (sync_dir(w->opts.dir) < 0) {
+        close(fd);
+        return -1;
+    }
+    w->fd = fd;
+    w->gen = gen;
+    w->log_sz = 0;
+    return 0;
+}
+
+static int commit(wal *w, void const *p, size_t n) {
+    if (write_all(w->fd, p, n) < 0 || fdatasync(w->fd) < 0) {
+        w->io_error = 1;
+        return -1;
+    }
+    w->commits++;
+    return 0;
+}
+
+static void deadline_after(struct timespec *ts, unsigned us) {
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_nsec += (long) (us % 1000000) * 1000;
+    ts->tv_sec += us / 1000000 + ts->tv_nsec / 1000000000;
+    ts->tv_nsec %= 1000000000;
+}
+
+static void *flusher(void *arg) {
+    wal *w = arg;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        //Wait for the first record of a batch, then give the batch
+        //until its deadline (or until it's big enough) to fill up
+        while (!w->stopping && w->buf_len == 0) {
+            pthread_cond_wait(&w->wake, &w->lock);
+        }
+        while (!w->stopping && w->buf_len < w->opts.commit_bytes) {
+            if (pthread_cond_timedwait(&w->wake, &w->lock, &w->deadline) == ETIMEDOUT) break;
+        }
+        if (w->buf_len == 0) {
+            //Either we're done or rotate() committed the batch for us
+            if (w->stopping) break;
+            continue;
+        }
+
+        //Swap buffers so appends can carry on while we're on the disk
+        char *batch = w->buf;
+        size_t len = w->buf_len;
+        w->buf = w->spare;
+        w->spare = batch;
+        size_t cap = w->buf_cap;
+        w->buf_cap = w->spare_cap;
+        w->spare_cap = cap;
+        w->buf_len = 0;
+        w->flushing = 1;
+        pthread_mutex_unlock(&w->lock);
+
+        int rc = write_all(w->fd, batch, len);
+        if (rc == 0) rc = fdatasync(w->fd);
+
+        pthread_mutex_lock(&w->lock);
+        if (rc < 0) w->io_error = 1;
+        else w->commits++;
+        w->flushing = 0;
+        pthread_cond_broadcast(&w->idle);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return NULL;
+}
+
+int wal_open(wal *w, wal_opts const *opts, map *md) {
+    pthread_once(&crc_once, crc_init);
+    memset(w, 0, sizeof(*w));
+    w->opts = *opts;
+    if (w->opts.commit_bytes == 0) w->opts.commit_bytes = 1;
+    w->fd = -1;
+
+    if (load_snapshot(w, md) < 0) return -1;
+    w->oldest_gen = w->gen;
+    if (replay_logs(w, md) < 0) goto fail;
+    if (w->fd < 0 && open_new_log(w, w->gen) < 0) goto fail;
+
+    w->buf_cap = w->spare_cap = REC_MAX * 64;
+    w->buf = malloc(w->buf_cap);
+    w->spare = malloc(w->spare_cap);
+    if (!w->buf || !w->spare) FAST_FAIL("out of memory");
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&w->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&w->idle, NULL);
+
+    //With no latency budget there's nothing to batch, so every append
+    //commits on the spot and we don't need the thread
+    if (w->opts.commit_us && pthread_create(&w->flusher, NULL, flusher, w)) {
+        FAST_FAIL("could not start WAL flusher");
+    }
+    return 0;
+
+fail:
+    if (w->fd >= 0) close(w->fd);
+    w->fd = -1;
+    return -1;
+}
+
+//Adds a record to the buffer. Caller holds the lock.
+static void buffer_rec(wal *w, int op, char const *key, size_t klen, uint32_t val) {
+    if (w->buf_len + REC_MAX > w->buf_cap) {
+        w->buf_cap *= 2;
+        w->buf = realloc(w->buf, w->buf_cap);
+        if (!w->buf) FAST_FAIL("out of memory");
+    }
+    size_t len = encode(w->buf + w->buf_len, op, key, klen, val);
+    w->buf_len += len;
+    w->log_sz += len;
+    w->records++;
+}
+
+//Call (with the lock held) after buffering records. was_empty says 
+//whether the buffer was empty before they went in.
+static int kick(wal *w, int was_empty) {
+    int rc = 0;
+    if (w->opts.commit_us == 0) {
+        rc = commit(w, w->buf, w->buf_len);
+        w->buf_len = 0;
+    } else if (was_empty) {
+        //These records start a new batch, so they set the deadline
+        deadline_after(&w->deadline, w->opts.commit_us);
+        pthread_cond_signal(&w->wake);
+    } else if (w->buf_len >= w->opts.commit_bytes) {
+        pthread_cond_signal(&w->wake);
+    }
+    return rc;
+}
+
+static int append(wal *w, int op, char const *key, uint32_t val) {
+    size_t klen = strlen(key);
+    if (klen > 255) return -2;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->io_error) {
+        pthread_mutex_unlock(&w->lock);
+        return -1;
+    }
+
+    int was_empty = (w->buf_len == 0);
+    buffer_rec(w, op, key, klen, val);
+    int rc = kick(w, was_empty);
+    pthread_mutex_unlock(&w->lock);
+
+    return rc;
+}
+
+int wal_log_set(wal *w, char const *key, uint32_t val) {
+    return append(w, OP_SET, key, val);
+}
+
+int wal_log_del(wal *w, char const *key) {
+    return append(w, OP_DEL, key, 0);
+}
+
+int wal_log_sets(wal *w, char const *const *keys, uint32_t const *vals, unsigned n) {
+    unsigned i;
+    for (i = 0; i < n; i++) {
+        if (strlen(keys[i]) > 255) return -2;
+    }
+    if (n == 0) return 0;
+
+    //All under one lock, so the flusher can't split the batch between
+    //two commits
+    pthread_mutex_lock(&w->lock);
+    if (w->io_error) {
+        pthread_mutex_unlock(&w->lock);
+        return -1;
+    }
+
+    int was_empty = (w->buf_len == 0);
+    buffer_rec(w, OP_BATCH, "", 0, n);
+    for (i = 0; i < n; i++) {
+        buffer_rec(w, OP_SET, keys[i], strlen(keys[i]), vals[i]);
+    }
+    int rc = kick(w, was_empty);
+    pthread_mutex_unlock(&w->lock);
+
+    return rc;
+}
+
+typedef struct {
+    wal *w;
+    map snap;      //Deep copy of the caller's map
+    uint64_t gen;  //First log that isn't covered by snap
+} snap_job;
+
+static int write_snapshot(snap_job *job) {
+    wal *w = job->w;
+    char tmp[PATH_MAX], path[PATH_MAX];
+    snprintf(tmp, PATH_MAX, "%s/snap.tmp", w->opts.dir);
+    snprintf(path, PATH_MAX, "%s/snap", w->opts.dir);
+
+    FILE *f = fopen(tmp, "w");
+    if (!f) return -1;
+    setvbuf(f, NULL, _IOFBF, 1 << 20);
+
+    snap_hdr hdr;
+    memcpy(hdr.magic, SNAP_MAGIC, 8);
+    hdr.gen = job->gen;
+    hdr.count = job->snap.count;
+    fwrite(&hdr, sizeof(hdr), 1, f);
+
+    map_iter it;
+    for (it = map_begin(&job->snap); it != map_end(&job->snap); map_iter_step(it)) {
+        char const *key;
+        uint32_t val;
+        map_iter_deref(&job->snap, it, &key, &val);
+        char rec[REC_MAX];
+        size_t klen = strlen(key);
+        fwrite(rec, encode(rec, OP_SET, key, klen, val), 1, f);
+    }
+
+    int rc = (fflush(f) == 0 && !ferror(f) && fsync(fileno(f)) == 0) ? 0 : -1;
+    if (fclose(f) != 0) rc = -1;
+    if (rc == 0) rc = rename(tmp, path);
+    if (rc == 0) rc = sync_dir(w->opts.dir);
+    if (rc < 0) {
+        unlink(tmp);
+        return -1;
+    }
+
+    //Now the snapshot is durable the old logs can go
+    pthread_mutex_lock(&w->lock);
+    uint64_t g = w->oldest_gen;
+    w->oldest_gen = job->gen;
+    pthread_mutex_unlock(&w->lock);
+    for (; g < job->gen; g++) {
+        log_path(path, w->opts.dir, g);
+        unlink(path);
+    }
+    return 0;
+}
+
+static void *snapper(void *arg) {
+    snap_job *job = arg;
+    wal *w = job->w;
+
+    //If this fails we just keep the old logs around; replaying them
+    //on top of the previous snapshot still gives the right answer
+    write_snapshot(job);
+    map_free(&job->snap);
+    free(job);
+
+    pthread_mutex_lock(&w->lock);
+    w->snap_done = 1;
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+//Commits whatever is buffered to the current log and starts the next
+//one. Everything appended before this call ends up in the old log and
+//everything after in the new one.
+static int rotate(wal *w) {
+    pthread_mutex_lock(&w->lock);
+    while (w->flushing) pthread_cond_wait(&w->idle, &w->lock);
+
+    int rc = w->io_error ? -1 : 0;
+    if (rc == 0 && w->buf_len) rc = commit(w, w->buf, w->buf_len);
+    w->buf_len = 0;
+
+    if (rc == 0) {
+        int old_fd = w->fd;
+        rc = open_new_log(w, w->gen + 1);
+        if (rc == 0) close(old_fd);
+        else w->io_error = 1;
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return rc;
+}
+
+void wal_maybe_compact(wal *w, map const *md) {
+    if (w->opts.compact_bytes == 0 || w->log_sz < w->opts.compact_bytes) return;
+
+    //Only one snapshot at a time. If the last one is still going, the
+    //log will just have to get a bit bigger.
+    if (w->snapping) {
+        pthread_mutex_lock(&w->lock);
+        int done = w->snap_done;
+        pthread_mutex_unlock(&w->lock);
+        if (!done) return;
+        pthread_join(w->snapper, NULL);
+        w->snapping = 0;
+        w->snap_done = 0;
+    }
+
+    //The copy has to be taken at the same point in the record stream
+    //as the rotation, which is fine as long as the caller isn't
+    //mutating md from another thread
+    if (rotate(w) < 0) return;
+
+    snap_job *job = malloc(sizeof(*job));
+    if (!job) FAST_FAIL("out of memory");
+    job->w = w;
+    job->gen = w->gen;
+    if (map_clone(md, &job->snap, MAP_CLONE_DEEP_KEYS) < 0) {
+        free(job);
+        return;
+    }
+
+    if (pthread_create(&w->snapper, NULL, snapper, job)) {
+        map_free(&job->snap);
+        free(job);
+        return;
+    }
+    w->snapping = 1;
+}
+
+void wal_close(wal *w) {
+    if (w->opts.commit_us) {
+        pthread_mutex_lock(&w->lock);
+        w->stopping = 1;
+        pthread_cond_signal(&w->wake);
+        pthread_mutex_unlock(&w->lock);
+        pthread_join(w->flusher, NULL);
+    }
+    if (w->snapping) pthread_join(w->snapper, NULL);
+
+    close(w->fd);
+    free(w->buf);
+    free(w->spare);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->wake);
+    pthread_cond_destroy(&w->idle);
+}
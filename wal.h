@@ -0,0 +1,106 @@
+#ifndef WAL_H
+#define WAL_H 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include "map.h"
+
+//Write-ahead log for the key-value driver in main.c (i.e. a STR2VAL 
+//map from char const* to uint32_t). Every set/delk gets appended to a
+//compact binary log, and the log gets replayed on startup.
+//
+//Calling fsync on every mutation would be painfully slow, so we do 
+//group commit instead: records pile up in a buffer, and a background 
+//thread writes and fdatasyncs the whole buffer at once, either after 
+//commit_us microseconds or as soon as commit_bytes are waiting, 
+//whichever comes first. The catch is that a mutation is acknowledged 
+//before it's durable, so a crash can lose up to commit_us worth of 
+//writes (but never leaves a half-applied record behind: every record 
+//has a CRC and replay stops at the first bad one, and a batch from 
+//wal_log_sets only gets replayed if all of it is there). Set commit_us
+//to 0 to fsync every record before returning.
+//
+//Once the log gets bigger than compact_bytes, we snapshot the map 
+//(with map_clone, so the caller doesn't have to wait for the disk) 
+//and start a fresh log. The files in dir look like this:
+//  snap       - every key/value as of the start of log.<gen>
+//  log.<gen>  - records since then
+//Snapshots are written to snap.tmp and renamed into place, so there's
+//always a complete one.
+
+typedef struct {
+    char const *dir;        //Must already exist
+    unsigned commit_us;     //Latency budget for group commit
+    unsigned commit_bytes;  //Size budget for group commit
+    unsigned compact_bytes; //Snapshot once the log is this big (0 = never)
+} wal_opts;
+
+#define WAL_DEFAULT_OPTS(d) ((wal_opts) { \
+    .dir = (d),                           \
+    .commit_us = 2000,                    \
+    .commit_bytes = 1 << 16,              \
+    .compact_bytes = 64 << 20             \
+})
+
+typedef struct {
+    wal_opts opts;
+    
+    int fd;          //Current log file
+    uint64_t gen;    //Its generation number
+    uint64_t log_sz; //How many bytes have been handed to it so far
+
+    //Records waiting to be written. The flusher swaps this with 
+    //spare so it can do the write without holding the lock.
+    char *buf;
+    size_t buf_len;
+    size_t buf_cap;
+    char *spare;
+    size_t spare_cap;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;      //Signalled when the flusher should hurry up
+    pthread_cond_t idle;      //Signalled when the flusher finishes a batch
+    struct timespec deadline; //When the current batch has to be committed
+    pthread_t flusher;
+    int flushing;             //Set while the flusher is writing outside the lock
+    int stopping;
+    int io_error;             //Sticky; set if a write or fsync ever fails
+
+    //Snapshots are written on their own thread
+    pthread_t snapper;
+    int snapping;
+    int snap_done;
+    uint64_t oldest_gen; //Oldest log that might still be on disk (under lock)
+
+    //Counters
+    uint64_t records;
+    uint64_t commits; //Number of fdatasyncs
+} wal;
+
+//Loads the snapshot and replays every log in opts->dir into md (which 
+//should be a freshly initialized STR2VAL map; it gets presized so the
+//replay doesn't have to keep growing it), then opens a log for new 
+//records. Keys inserted into md are owned by md. Returns 0 on success
+//or negative on error.
+int wal_open(wal *w, wal_opts const *opts, map *md);
+
+//Appends a record. Returns 0 on success or negative if the log has hit
+//an I/O error (after which nothing else will be logged).
+int wal_log_set(wal *w, char const *key, uint32_t val);
+int wal_log_del(wal *w, char const *key);
+
+//Appends n sets as one batch: replay applies either all of them or 
+//none. Same return values as wal_log_set.
+int wal_log_sets(wal *w, char const *const *keys, uint32_t const *vals, unsigned n);
+
+//Call after applying a mutation to md. If the log has gotten too big,
+//this snapshots md and switches to a new log.
+void wal_maybe_compact(wal *w, map const *md);
+
+//Commits anything still in the buffer, waits for a snapshot in 
+//progress, and closes the log.
+void wal_close(wal *w);
+
+#endif
@@ -1,2 +1,2 @@
-clang -Wall -g -o dbg *.c 
+clang -Wall -g -o dbg *.c -pthread -lrt 
 gdb dbg
\ No newline at end of file
@@ -1,2 +1,2 @@
-clang -Wall -g -o dbg *.c
+clang -Wall -g -o dbg *.c -pthread -lrt
 valgrind --leak-check=full -v ./dbg <test.txt 2>report.txt
\ No newline at end of file